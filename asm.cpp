@@ -0,0 +1,144 @@
+#include "asm.h"
+#include <algorithm>
+#include <charconv>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+bool isImmediate(const std::string& text) {
+    return !text.empty() && ((text[0] >= '0' && text[0] <= '9') || text[0] == '-');
+}
+
+uint8_t parseRegister(const std::string& name) {
+    if (name == "rax") return static_cast<uint8_t>(Register::RAX);
+    if (name == "rbx") return static_cast<uint8_t>(Register::RBX);
+    if (name == "rcx") return static_cast<uint8_t>(Register::RCX);
+    if (name == "rdx") return static_cast<uint8_t>(Register::RDX);
+    throw std::runtime_error("Unknown register '" + name + "'");
+}
+
+class AsmReader {
+    std::istringstream iss;
+    std::string mnemonic;
+
+public:
+    explicit AsmReader(const std::string& text) : iss(text) {}
+
+    bool nextMnemonic(std::string& out) {
+        if (!(iss >> out)) return false;
+        std::transform(out.begin(), out.end(), out.begin(), ::tolower);
+        mnemonic = out;
+        return true;
+    }
+
+    std::string operand() {
+        std::string arg;
+        if (!(iss >> arg)) {
+            throw std::runtime_error("Missing operand for '" + mnemonic + "'");
+        }
+        return arg;
+    }
+
+    // The lexer splits "-5" into "-" and "5", so a lone minus sign is
+    // joined with the following token here.
+    int64_t immediate(std::string text) {
+        if (text == "-") text += operand();
+        int64_t value = 0;
+        const char* first = text.data();
+        const char* last = first + text.size();
+        auto result = std::from_chars(first, last, value);
+        if (result.ec != std::errc() || result.ptr != last) {
+            throw std::runtime_error("Invalid immediate '" + text + "' for '" + mnemonic + "'");
+        }
+        return value;
+    }
+};
+
+}
+
+AsmBlock decodeAsm(const std::string& asmCode) {
+    AsmBlock block;
+    AsmReader reader(asmCode);
+    std::string inst;
+
+    while (reader.nextMnemonic(inst)) {
+        AsmOp op{AsmOpCode::MOV_IMM, 0, 0, 0};
+
+        if (inst == "mov" || inst == "add" || inst == "sub") {
+            op.dst = parseRegister(reader.operand());
+            std::string src = reader.operand();
+            bool imm = isImmediate(src);
+            if (imm) {
+                op.imm = reader.immediate(src);
+            } else {
+                op.src = parseRegister(src);
+            }
+
+            if (inst == "mov") op.op = imm ? AsmOpCode::MOV_IMM : AsmOpCode::MOV_REG;
+            else if (inst == "add") op.op = imm ? AsmOpCode::ADD_IMM : AsmOpCode::ADD_REG;
+            else op.op = imm ? AsmOpCode::SUB_IMM : AsmOpCode::SUB_REG;
+        }
+        else if (inst == "push" || inst == "pop" || inst == "inc" || inst == "dec") {
+            op.dst = parseRegister(reader.operand());
+            if (inst == "push") op.op = AsmOpCode::PUSH;
+            else if (inst == "pop") op.op = AsmOpCode::POP;
+            else if (inst == "inc") op.op = AsmOpCode::INC;
+            else op.op = AsmOpCode::DEC;
+        }
+        else {
+            throw std::runtime_error("Unknown asm instruction '" + inst + "'");
+        }
+
+        block.push_back(op);
+    }
+
+    return block;
+}
+
+void executeAsmBlock(const AsmBlock& block, CPUState& cpu, std::vector<int64_t>& stack) {
+    for (const AsmOp& op : block) {
+        int64_t& dst = cpu.regs.data[op.dst];
+        switch (op.op) {
+            case AsmOpCode::MOV_IMM:
+                dst = op.imm;
+                break;
+            case AsmOpCode::MOV_REG:
+                dst = cpu.regs.data[op.src];
+                break;
+            case AsmOpCode::ADD_IMM:
+                dst += op.imm;
+                cpu.updateFlags(dst);
+                break;
+            case AsmOpCode::ADD_REG:
+                dst += cpu.regs.data[op.src];
+                cpu.updateFlags(dst);
+                break;
+            case AsmOpCode::SUB_IMM:
+                dst -= op.imm;
+                cpu.updateFlags(dst);
+                break;
+            case AsmOpCode::SUB_REG:
+                dst -= cpu.regs.data[op.src];
+                cpu.updateFlags(dst);
+                break;
+            case AsmOpCode::PUSH:
+                stack.push_back(dst);
+                break;
+            case AsmOpCode::POP:
+                if (!stack.empty()) {
+                    dst = stack.back();
+                    stack.pop_back();
+                }
+                break;
+            case AsmOpCode::INC:
+                dst++;
+                cpu.updateFlags(dst);
+                break;
+            case AsmOpCode::DEC:
+                dst--;
+                cpu.updateFlags(dst);
+                break;
+        }
+    }
+}
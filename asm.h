@@ -0,0 +1,13 @@
+#pragma once
+#include "token.h"
+#include <string>
+#include <vector>
+
+using AsmBlock = std::vector<AsmOp>;
+
+// Decodes the text of an asm { } block into micro-ops. Throws on unknown
+// mnemonics, unknown registers, missing operands or malformed immediates.
+AsmBlock decodeAsm(const std::string& asmCode);
+
+// Runs decoded micro-ops against the emulated CPU. push/pop use `stack`.
+void executeAsmBlock(const AsmBlock& block, CPUState& cpu, std::vector<int64_t>& stack);
@@ -1,4 +1,6 @@
 #pragma once
+#include "symbols.h"
+#include "token.h"
 #include <string>
 #include <vector>
 #include <memory>
@@ -17,6 +19,7 @@ enum class ASTType {
     IF_STMT,
     WHILE_STMT,
     PRINT,
+    SNAPSHOT,
     ASSIGN,
     EXPR_STMT
 };
@@ -25,9 +28,14 @@ struct ASTNode {
     ASTType type;
     std::string value;
     std::vector<std::shared_ptr<ASTNode>> children;
+    // Interned `value` of VAR_DECL, FUNC_DECL, IDENTIFIER, CALL and ASSIGN.
+    Symbol symbol = kNoSymbol;
+    // Operator token of a BINARY_OP.
+    TokenType op = TokenType::END_OF_FILE;
     
     ASTNode(ASTType t) : type(t) {}
     ASTNode(ASTType t, const std::string& v) : type(t), value(v) {}
+    ASTNode(ASTType t, const std::string& v, Symbol s) : type(t), value(v), symbol(s) {}
 };
 
 using ASTPtr = std::shared_ptr<ASTNode>;
\ No newline at end of file
@@ -2,23 +2,36 @@
 
 #include <stdexcept>
 
-Compiler::Compiler(VM* vmInstance) : vm(vmInstance) {
+// An asm block may leave values on the operand stack, below the arguments
+// of a later TAIL_CALL.
+static bool containsAsm(const ASTPtr& node) {
+    if (node->type == ASTType::ASM_BLOCK) return true;
+    for (auto& child : node->children) {
+        if (containsAsm(child)) return true;
+    }
+    return false;
+}
+
+Compiler::Compiler(VM* vmInstance) : vm(vmInstance), optimizationLevel(0), tailCalls(true) {
     reset();
 }
 
 void Compiler::reset() {
     code.clear();
+    strings.clear();
+    functions.clear();
     scopes.clear();
     functionStack.clear();
-    functionAddresses.clear();
-    pendingCalls.clear();
+    functionSymbols.clear();
+    mainSymbol = kNoSymbol;
     globalVarCounter = 0;
-    scopes.push_back({});
-    functionStack.push_back({"__global", false, 0});
+    globalNames.clear();
+    scopes.enterScope();
+    functionStack.push_back({"__global", false, 0, {}});
 }
 
-size_t Compiler::emit(OpCode op, int64_t operand, const std::string& text) {
-    code.emplace_back(op, operand, text);
+size_t Compiler::emit(OpCode op, int64_t operand) {
+    code.emplace_back(op, operand);
     return code.size() - 1;
 }
 
@@ -27,31 +40,23 @@ bool Compiler::inFunction() const {
 }
 
 void Compiler::enterScope() {
-    scopes.push_back({});
+    scopes.enterScope();
 }
 
 void Compiler::leaveScope() {
-    if (!scopes.empty()) {
-        scopes.pop_back();
-    }
+    scopes.leaveScope();
 }
 
-VariableInfo* Compiler::resolveVariable(const std::string& name) {
-    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
-        auto varIt = it->variables.find(name);
-        if (varIt != it->variables.end()) {
-            return &varIt->second;
-        }
-    }
-    return nullptr;
+VariableInfo* Compiler::resolveVariable(Symbol symbol) {
+    return scopes.find(symbol);
 }
 
-VariableInfo Compiler::declareVariable(const std::string& name) {
-    if (scopes.empty()) {
+VariableInfo Compiler::declareVariable(Symbol symbol, const std::string& name) {
+    if (scopes.depth() == 0) {
         throw std::runtime_error("Internal compiler error: missing scope");
     }
 
-    if (scopes.back().variables.find(name) != scopes.back().variables.end()) {
+    if (scopes.inCurrentScope(symbol)) {
         throw std::runtime_error("Variable '" + name + "' already declared in this scope");
     }
 
@@ -59,12 +64,14 @@ VariableInfo Compiler::declareVariable(const std::string& name) {
     if (inFunction()) {
         info.isGlobal = false;
         info.index = functionStack.back().nextLocalIndex++;
+        functionStack.back().localNames.push_back(name);
     } else {
         info.isGlobal = true;
         info.index = globalVarCounter++;
+        globalNames.push_back(name);
     }
 
-    scopes.back().variables[name] = info;
+    scopes.declare(symbol, info);
     return info;
 }
 
@@ -84,15 +91,45 @@ void Compiler::loadVariable(const VariableInfo& info) {
     }
 }
 
-void Compiler::patchFunctionCalls(const std::string& name, size_t address) {
-    for (auto it = pendingCalls.begin(); it != pendingCalls.end();) {
-        if (it->second == name) {
-            code[it->first].operand = static_cast<int64_t>(address);
-            it = pendingCalls.erase(it);
-        } else {
-            ++it;
+void Compiler::checkArguments(const std::string& name, uint32_t expected, uint32_t given) {
+    if (expected != given) {
+        throw std::runtime_error("Function '" + name + "' expects " + std::to_string(expected) +
+                                 " arguments, got " + std::to_string(given));
+    }
+}
+
+FunctionSymbol& Compiler::functionSymbol(Symbol symbol, const std::string& name) {
+    if (symbol >= functionSymbols.size()) functionSymbols.resize(symbol + 1);
+    FunctionSymbol& function = functionSymbols[symbol];
+    if (function.name.empty()) function.name = name;
+    return function;
+}
+
+// Resolves every call in one pass over the relocation lists, once all
+// functions are compiled. Calls to names that were never defined are
+// reported together, in order of first appearance in the source.
+void Compiler::link() {
+    std::vector<std::string> unresolved;
+    for (const FunctionSymbol& function : functionSymbols) {
+        if (function.calls.empty()) continue;
+        if (function.address == FunctionSymbol::kUndefined) {
+            unresolved.push_back("'" + function.name + "'");
+            continue;
+        }
+        for (size_t index : function.calls) {
+            Instruction& call = code[index];
+            checkArguments(function.name, function.paramCount, static_cast<uint32_t>(packedHigh(call.operand)));
+            setBranchTarget(call, function.address);
         }
     }
+    if (unresolved.size() == 1) {
+        throw std::runtime_error("Unresolved function call to " + unresolved[0]);
+    }
+    if (!unresolved.empty()) {
+        std::string names = unresolved[0];
+        for (size_t i = 1; i < unresolved.size(); i++) names += ", " + unresolved[i];
+        throw std::runtime_error("Unresolved function calls to " + names);
+    }
 }
 
 void Compiler::compileNode(ASTPtr node) {
@@ -117,6 +154,9 @@ void Compiler::compileNode(ASTPtr node) {
             compileExpr(node->children[0]);
             emit(OpCode::PRINT);
             break;
+        case ASTType::SNAPSHOT:
+            emit(OpCode::SNAPSHOT);
+            break;
         case ASTType::ASM_BLOCK:
             compileAsm(node);
             break;
@@ -146,29 +186,75 @@ void Compiler::compileBlock(ASTPtr node) {
 }
 
 void Compiler::compileVarDecl(ASTPtr node) {
-    VariableInfo info = declareVariable(node->value);
+    VariableInfo info = declareVariable(node->symbol, node->value);
     compileExpr(node->children[0]);
     storeVariable(info);
 }
 
 void Compiler::compileFunction(ASTPtr node) {
     std::string name = node->value;
+    const ASTPtr& body = node->children.back();
+    uint32_t paramCount = static_cast<uint32_t>(node->children.size() - 1);
     size_t skipIndex = emit(OpCode::JMP, 0);
 
     size_t entryPoint = code.size();
-    functionAddresses[name] = entryPoint;
-    patchFunctionCalls(name, entryPoint);
-
-    functionStack.push_back({name, true, 0});
-    compileBlock(node->children[0]);
-    emit(OpCode::PUSH, 0);
-    emit(OpCode::RET);
-    functionStack.pop_back();
+    FunctionSymbol& function = functionSymbol(node->symbol, name);
+    function.address = entryPoint;
+    function.paramCount = paramCount;
+    if (name == "main") mainSymbol = node->symbol;
+
+    // Optimized frames hold SSA values rather than variables, so they
+    // carry no local names.
+    LoweredFunction lowered;
+    auto globalIndex = [this](Symbol variable) {
+        VariableInfo* info = resolveVariable(variable);
+        return info && info->isGlobal ? info->index : -1;
+    };
+    if (optimizationLevel > 0 &&
+        optimizeFunction(node, globalIndex, {optimizationLevel > 1, optimizationLevel > 1, tailCalls}, lowered)) {
+        emitLowered(lowered);
+        functions.push_back({name, entryPoint, lowered.frameSize, paramCount, {}});
+    } else {
+        // Parameters take the first slots and share the body's outermost
+        // scope, so the body cannot redeclare them.
+        functionStack.push_back({name, true, 0, {}, tailCalls && !containsAsm(body)});
+        enterScope();
+        for (size_t i = 0; i < paramCount; i++) {
+            declareVariable(node->children[i]->symbol, node->children[i]->value);
+        }
+        for (auto& child : body->children) {
+            compileNode(child);
+        }
+        leaveScope();
+        emit(OpCode::PUSH, 0);
+        emit(OpCode::RET);
+        functions.push_back({name, entryPoint, static_cast<uint32_t>(functionStack.back().nextLocalIndex),
+                             paramCount, std::move(functionStack.back().localNames)});
+        functionStack.pop_back();
+    }
 
     size_t afterFunction = code.size();
     code[skipIndex].operand = static_cast<int64_t>(afterFunction);
 }
 
+void Compiler::emitLowered(const LoweredFunction& lowered) {
+    size_t base = code.size();
+    for (Instruction instruction : lowered.code) {
+        if (isCall(instruction.op)) {
+            const Callee& callee = lowered.callees[packedLow(instruction.operand)];
+            emitCall(callee.symbol, callee.name, static_cast<uint32_t>(packedHigh(instruction.operand)), instruction.op);
+            continue;
+        }
+        if (instruction.op == OpCode::EXEC_ASM) {
+            strings.push_back(lowered.asmCode[static_cast<size_t>(instruction.operand)]);
+            instruction.operand = static_cast<int64_t>(strings.size() - 1);
+        } else if (isBranch(instruction.op)) {
+            instruction.operand += static_cast<int64_t>(base);
+        }
+        code.push_back(instruction);
+    }
+}
+
 void Compiler::compileIf(ASTPtr node) {
     compileExpr(node->children[0]);
     size_t jumpFalse = emit(OpCode::JMP_IF_FALSE, 0);
@@ -198,6 +284,10 @@ void Compiler::compileReturn(ASTPtr node) {
         throw std::runtime_error("Return statement outside of function");
     }
 
+    if (!node->children.empty() && node->children[0]->type == ASTType::CALL && functionStack.back().tailCalls) {
+        compileCall(node->children[0], OpCode::TAIL_CALL);
+        return;
+    }
     if (!node->children.empty()) {
         compileExpr(node->children[0]);
     } else {
@@ -207,7 +297,8 @@ void Compiler::compileReturn(ASTPtr node) {
 }
 
 void Compiler::compileAsm(ASTPtr node) {
-    emit(OpCode::EXEC_ASM, 0, node->value);
+    strings.push_back(node->value);
+    emit(OpCode::EXEC_ASM, static_cast<int64_t>(strings.size() - 1));
 }
 
 void Compiler::compileExprStmt(ASTPtr node) {
@@ -221,7 +312,7 @@ void Compiler::compileExpr(ASTPtr node) {
             emit(OpCode::PUSH, std::stoll(node->value));
             break;
         case ASTType::IDENTIFIER: {
-            VariableInfo* info = resolveVariable(node->value);
+            VariableInfo* info = resolveVariable(node->symbol);
             if (!info) {
                 throw std::runtime_error("Undefined variable '" + node->value + "'");
             }
@@ -243,64 +334,74 @@ void Compiler::compileExpr(ASTPtr node) {
 }
 
 void Compiler::compileAssignment(ASTPtr node) {
-    VariableInfo* info = resolveVariable(node->value);
-    if (!info) {
+    VariableInfo* found = resolveVariable(node->symbol);
+    if (!found) {
         throw std::runtime_error("Undefined variable '" + node->value + "'");
     }
+    VariableInfo info = *found;
     compileExpr(node->children[0]);
-    storeVariable(*info);
-    loadVariable(*info);
+    storeVariable(info);
+    loadVariable(info);
 }
 
 void Compiler::compileBinaryOp(ASTPtr node) {
-    compileExpr(node->children[0]);
+    TokenType op = node->op;
+    const ASTPtr& left = node->children[0];
+    // The parser lowers -x to 0 - x.
+    if (op == TokenType::MINUS && left->type == ASTType::NUMBER && std::stoll(left->value) == 0) {
+        compileExpr(node->children[1]);
+        emit(OpCode::NEG);
+        return;
+    }
+
+    compileExpr(left);
     compileExpr(node->children[1]);
 
-    const std::string& op = node->value;
-    if (op == "+") emit(OpCode::ADD);
-    else if (op == "-") emit(OpCode::SUB);
-    else if (op == "*") emit(OpCode::MUL);
-    else if (op == "/") emit(OpCode::DIV);
-    else if (op == "==") emit(OpCode::CMP_EQ);
-    else if (op == "!=") emit(OpCode::CMP_NEQ);
-    else if (op == "<") emit(OpCode::CMP_LT);
-    else if (op == "<=") emit(OpCode::CMP_LEQ);
-    else if (op == ">") emit(OpCode::CMP_GT);
-    else if (op == ">=") emit(OpCode::CMP_GEQ);
-    else throw std::runtime_error("Unsupported binary operator '" + op + "'");
+    switch (op) {
+        case TokenType::PLUS: emit(OpCode::ADD); break;
+        case TokenType::MINUS: emit(OpCode::SUB); break;
+        case TokenType::STAR: emit(OpCode::MUL); break;
+        case TokenType::SLASH: emit(OpCode::DIV); break;
+        case TokenType::EQ: emit(OpCode::CMP_EQ); break;
+        case TokenType::NEQ: emit(OpCode::CMP_NEQ); break;
+        case TokenType::LT: emit(OpCode::CMP_LT); break;
+        case TokenType::LEQ: emit(OpCode::CMP_LEQ); break;
+        case TokenType::GT: emit(OpCode::CMP_GT); break;
+        case TokenType::GEQ: emit(OpCode::CMP_GEQ); break;
+        default: throw std::runtime_error("Unsupported binary operator '" + node->value + "'");
+    }
 }
 
-void Compiler::compileCall(ASTPtr node) {
-    if (!node->children.empty()) {
-        throw std::runtime_error("Function arguments are not supported yet");
+// Arguments are left on the operand stack in order; CALL moves them into
+// the callee's first local slots.
+void Compiler::compileCall(ASTPtr node, OpCode op) {
+    for (auto& argument : node->children) {
+        compileExpr(argument);
     }
+    emitCall(node->symbol, node->value, static_cast<uint32_t>(node->children.size()), op);
+}
 
-    auto it = functionAddresses.find(node->value);
-    size_t index;
-    if (it != functionAddresses.end()) {
-        index = emit(OpCode::CALL, static_cast<int64_t>(it->second));
-    } else {
-        index = emit(OpCode::CALL, 0);
-        pendingCalls.emplace_back(index, node->value);
-    }
-    (void)index;
+void Compiler::emitCall(Symbol symbol, const std::string& name, uint32_t argumentCount, OpCode op) {
+    functionSymbol(symbol, name).calls.push_back(emit(op, callOperand(0, argumentCount)));
 }
 
-std::vector<Instruction> Compiler::compile(ASTPtr ast) {
+Program Compiler::compile(ASTPtr ast) {
     reset();
     compileNode(ast);
 
-    auto mainIt = functionAddresses.find("main");
-    if (mainIt == functionAddresses.end()) {
+    if (mainSymbol == kNoSymbol) {
         throw std::runtime_error("Entry point 'main' was not defined");
     }
 
-    emit(OpCode::CALL, static_cast<int64_t>(mainIt->second));
+    emitCall(mainSymbol, "main", 0);
     emit(OpCode::HALT);
-
-    if (!pendingCalls.empty()) {
-        throw std::runtime_error("Unresolved function call to '" + pendingCalls.front().second + "'");
-    }
-
-    return code;
+    link();
+
+    Program program;
+    program.code = std::move(code);
+    program.strings = std::move(strings);
+    program.functions = std::move(functions);
+    program.globalCount = static_cast<uint32_t>(globalVarCounter);
+    program.globalNames = std::move(globalNames);
+    return program;
 }
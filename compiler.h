@@ -2,8 +2,10 @@
 #include "ast.h"
 #include "token.h"
 #include "vm.h"
+#include "program.h"
+#include "ssa.h"
+#include "symbols.h"
 #include <vector>
-#include <map>
 #include <string>
 
 struct VariableInfo {
@@ -11,24 +13,40 @@ struct VariableInfo {
     int index;
 };
 
-struct ScopeFrame {
-    std::map<std::string, VariableInfo> variables;
+// Functions by symbol; `address` stays kUndefined until the FUNC_DECL is
+// compiled. `calls` is the relocation list: the index of every CALL and
+// TAIL_CALL to the function, patched by link(). The name is kept for
+// error messages.
+struct FunctionSymbol {
+    static constexpr size_t kUndefined = SIZE_MAX;
+    std::string name;
+    size_t address = kUndefined;
+    uint32_t paramCount = 0;
+    std::vector<size_t> calls;
 };
 
 struct FunctionContext {
     std::string name;
     bool isFunction;
     int nextLocalIndex;
+    std::vector<std::string> localNames;
+    // Whether `return f(...)` may reuse the frame with TAIL_CALL.
+    bool tailCalls = false;
 };
 
 class Compiler {
     std::vector<Instruction> code;
+    std::vector<std::string> strings;
+    std::vector<FunctionEntry> functions;
     VM* vm;
-    std::vector<ScopeFrame> scopes;
+    ScopedSymbols<VariableInfo> scopes;
     std::vector<FunctionContext> functionStack;
     int globalVarCounter;
-    std::map<std::string, size_t> functionAddresses;
-    std::vector<std::pair<size_t, std::string>> pendingCalls;
+    std::vector<std::string> globalNames;
+    std::vector<FunctionSymbol> functionSymbols;
+    Symbol mainSymbol;
+    int optimizationLevel;
+    bool tailCalls;
 
     void reset();
     void compileNode(ASTPtr node);
@@ -43,18 +61,29 @@ class Compiler {
     void compileExpr(ASTPtr node);
     void compileAssignment(ASTPtr node);
     void compileBinaryOp(ASTPtr node);
-    void compileCall(ASTPtr node);
+    void compileCall(ASTPtr node, OpCode op = OpCode::CALL);
+    void emitCall(Symbol symbol, const std::string& name, uint32_t argumentCount, OpCode op = OpCode::CALL);
+    FunctionSymbol& functionSymbol(Symbol symbol, const std::string& name);
+    void checkArguments(const std::string& name, uint32_t expected, uint32_t given);
+    void emitLowered(const LoweredFunction& lowered);
     void storeVariable(const VariableInfo& info);
     void loadVariable(const VariableInfo& info);
-    VariableInfo declareVariable(const std::string& name);
-    VariableInfo* resolveVariable(const std::string& name);
+    VariableInfo declareVariable(Symbol symbol, const std::string& name);
+    VariableInfo* resolveVariable(Symbol symbol);
     void enterScope();
     void leaveScope();
     bool inFunction() const;
-    void patchFunctionCalls(const std::string& name, size_t address);
-    size_t emit(OpCode op, int64_t operand = 0, const std::string& text = "");
+    void link();
+    size_t emit(OpCode op, int64_t operand = 0);
 
 public:
     Compiler(VM* vmInstance);
-    std::vector<Instruction> compile(ASTPtr ast);
+    // 0 compiles function bodies straight from the AST; 1 goes through
+    // SSA with copy propagation and dead-code elimination (ssa.h); 2 also
+    // eliminates common subexpressions and hoists loop invariants.
+    void setOptimizationLevel(int level) { optimizationLevel = level; }
+    // On by default: `return f(...)` compiles to TAIL_CALL, which reuses
+    // the caller's frame.
+    void setTailCalls(bool enabled) { tailCalls = enabled; }
+    Program compile(ASTPtr ast);
 };
\ No newline at end of file
@@ -1,33 +1,307 @@
 #include "debugger.h"
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 
 Debugger::Debugger(VM* vmInstance) : vm(vmInstance), active(false) {}
 
+void Debugger::record(uint64_t interval, size_t memoryBudget) {
+    recorder.emplace(*vm, interval, memoryBudget);
+}
+
+bool Debugger::recording() const {
+    if (!recorder) std::cout << "Not recording; start the debugger with --record" << std::endl;
+    return recorder.has_value();
+}
+
 void Debugger::printHelp() {
     std::cout << "\n=== MicroC Debugger Commands ===" << std::endl;
     std::cout << "step (s)    - Execute one instruction" << std::endl;
     std::cout << "continue (c) - Run until breakpoint" << std::endl;
+    std::cout << "reverse-step (rs) - Go back one instruction (--record)" << std::endl;
+    std::cout << "reverse-continue (rc) - Go back to the previous breakpoint or watch (--record)" << std::endl;
+    std::cout << "goto <count> - Go to the state after <count> instructions (--record)" << std::endl;
+    std::cout << "info        - Show the instruction count and the recording" << std::endl;
+    std::cout << "break (b) <pc|function> [if <var> <op> <value>] - Set a breakpoint" << std::endl;
+    std::cout << "delete <pc> - Remove a breakpoint" << std::endl;
+    std::cout << "watch (w) <var|function.var> - Stop when a variable changes" << std::endl;
+    std::cout << "unwatch     - Remove all watches" << std::endl;
+    std::cout << "print (p) <var> - Show a variable" << std::endl;
     std::cout << "regs (r)    - Show CPU registers" << std::endl;
     std::cout << "stack       - Show stack contents" << std::endl;
     std::cout << "quit (q)    - Exit debugger" << std::endl;
     std::cout << "help (h)    - Show this help" << std::endl;
 }
 
-void Debugger::handleCommand(const std::string& cmd) {
-    if (cmd == "s" || cmd == "step") {
-        vm->step();
+// Finds `name` among the locals of the function being executed, then the
+// globals; `function.name` names a local of another function.
+bool Debugger::resolve(const std::string& name, VM::Watch& variable) const {
+    const LoadedProgram& program = vm->getProgram();
+    std::string local = name;
+    int32_t function = vm->finished() ? 0 : program.verified.owner[vm->getPc()];
+    size_t dot = name.find('.');
+    if (dot != std::string::npos) {
+        function = -1;
+        for (size_t id = 1; id < program.functionNames.size(); id++) {
+            if (program.functionNames[id] == name.substr(0, dot)) function = static_cast<int32_t>(id);
+        }
+        if (function < 0) return false;
+        local = name.substr(dot + 1);
+    }
+    if (function > 0) {
+        const std::vector<std::string>& names = program.localNames[static_cast<size_t>(function)];
+        for (size_t slot = 0; slot < names.size(); slot++) {
+            if (names[slot] == local) {
+                variable = {function, static_cast<uint32_t>(slot)};
+                return true;
+            }
+        }
+    }
+    if (dot != std::string::npos) return false;
+    for (size_t slot = 0; slot < program.globalNames.size(); slot++) {
+        if (program.globalNames[slot] == name) {
+            variable = {-1, static_cast<uint32_t>(slot)};
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Debugger::read(const std::string& name, int64_t& value) const {
+    VM::Watch variable;
+    return resolve(name, variable) && vm->readVariable(variable, value);
+}
+
+bool Debugger::conditionHolds(size_t pc) const {
+    auto condition = conditions.find(pc);
+    if (condition == conditions.end()) return true;
+    const Condition& c = condition->second;
+    int64_t value;
+    if (!read(c.variable, value)) return true;
+    if (c.op == "==") return value == c.value;
+    if (c.op == "!=") return value != c.value;
+    if (c.op == "<") return value < c.value;
+    if (c.op == ">") return value > c.value;
+    if (c.op == "<=") return value <= c.value;
+    return value >= c.value;
+}
+
+void Debugger::breakAt(std::istringstream& args) {
+    std::string target;
+    if (!(args >> target)) {
+        std::cout << "Usage: break <pc|function> [if <var> <op> <value>]" << std::endl;
+        return;
     }
-    else if (cmd == "c" || cmd == "continue") {
+    const LoadedProgram& program = vm->getProgram();
+    size_t pc = program.code.size();
+    char* end = nullptr;
+    unsigned long number = std::strtoul(target.c_str(), &end, 10);
+    if (*end == '\0') {
+        pc = number;
+    } else {
+        for (size_t id = 1; id < program.functionNames.size(); id++) {
+            if (program.functionNames[id] == target) pc = program.verified.functions[id].entry;
+        }
+    }
+    if (pc >= program.code.size()) {
+        std::cout << "No function or instruction '" << target << "'" << std::endl;
+        return;
+    }
+
+    std::string keyword;
+    Condition condition;
+    if (args >> keyword) {
+        VM::Watch variable;
+        static const char* const ops[] = {"==", "!=", "<", ">", "<=", ">="};
+        bool validOp = false;
+        if (keyword == "if" && args >> condition.variable >> condition.op >> condition.value) {
+            for (const char* op : ops) validOp = validOp || condition.op == op;
+        }
+        if (!validOp) {
+            std::cout << "Usage: break <pc|function> if <var> <op> <value>, op one of == != < > <= >=" << std::endl;
+            return;
+        }
+        if (!resolve(condition.variable, variable) && condition.variable.find('.') == std::string::npos) {
+            std::cout << "Note: '" << condition.variable << "' is not a global; it must be a local where the breakpoint is" << std::endl;
+        }
+        conditions[pc] = condition;
+    } else {
+        conditions.erase(pc);
+    }
+    // Setting the first breakpoint swaps in a patched copy of the program,
+    // so `program` is not used past this point.
+    vm->setBreakpoint(pc);
+    std::cout << "Breakpoint at pc " << pc << " (" << opcodeName(vm->originalOp(pc)) << ")";
+    if (conditions.count(pc)) std::cout << " if " << condition.variable << " " << condition.op << " " << condition.value;
+    std::cout << std::endl;
+}
+
+void Debugger::watch(const std::string& name) {
+    VM::Watch variable;
+    if (!resolve(name, variable)) {
+        std::cout << "No variable '" << name << "' here" << std::endl;
+        return;
+    }
+    vm->addWatch(variable);
+    std::cout << "Watching " << name << std::endl;
+}
+
+void Debugger::runToStop() {
+    if (recorder) {
+        recorder->forward(*vm, VM::kNoLimit, true);
+    } else {
         vm->run();
     }
-    else if (cmd == "r" || cmd == "regs") {
+}
+
+void Debugger::report(VM::Stop stop, const VM::WatchHit& hit) const {
+    const LoadedProgram& program = vm->getProgram();
+    if (stop == VM::Stop::Breakpoint) {
+        size_t pc = vm->getPc();
+        int32_t owner = program.verified.owner[pc];
+        std::cout << "Breakpoint at pc " << pc << " in " << program.functionNames[static_cast<size_t>(owner)];
+    } else if (stop == VM::Stop::Watch) {
+        const std::string& name = hit.watch.function < 0
+            ? program.globalNames[hit.watch.slot]
+            : program.localNames[static_cast<size_t>(hit.watch.function)][hit.watch.slot];
+        std::cout << "Watch " << name << ": " << hit.before << " -> " << hit.after << " at pc " << hit.pc;
+    } else if (vm->finished()) {
+        std::cout << "Program finished";
+    } else {
+        std::cout << "At pc " << vm->getPc();
+    }
+    std::cout << " (instruction " << vm->getExecutedCount() << ")" << std::endl;
+}
+
+// Runs until a breakpoint whose condition holds, a watch or the end.
+void Debugger::resume() {
+    do {
+        runToStop();
+    } while (vm->getStop() == VM::Stop::Breakpoint && !conditionHolds(vm->getPc()));
+    report(vm->getStop(), vm->getWatchHit());
+}
+
+// Replays from `checkpoint` up to `end` instructions and finds the last
+// stop continue would have made there.
+bool Debugger::lastStopBefore(size_t checkpoint, uint64_t end, uint64_t& at, VM::Stop& stop, VM::WatchHit& hit) {
+    bool found = false;
+    recorder->restore(*vm, checkpoint);
+    if (vm->hasBreakpoint(vm->getPc()) && conditionHolds(vm->getPc()) && vm->getExecutedCount() < end) {
+        found = true;
+        at = vm->getExecutedCount();
+        stop = VM::Stop::Breakpoint;
+    }
+    while (!vm->finished() && vm->getExecutedCount() < end) {
+        recorder->forward(*vm, end, true);
+        VM::Stop reason = vm->getStop();
+        if (vm->getExecutedCount() >= end) break;
+        if (reason == VM::Stop::Watch || (reason == VM::Stop::Breakpoint && conditionHolds(vm->getPc()))) {
+            found = true;
+            at = vm->getExecutedCount();
+            stop = reason;
+            hit = vm->getWatchHit();
+        }
+    }
+    return found;
+}
+
+void Debugger::reverseContinue() {
+    uint64_t end = vm->getExecutedCount();
+    uint64_t at = 0;
+    VM::Stop stop = VM::Stop::None;
+    VM::WatchHit hit{};
+    bool found = false;
+    if (end > 0) {
+        for (size_t index = recorder->checkpointBefore(end - 1);; index--) {
+            found = lastStopBefore(index, end, at, stop, hit);
+            if (found || index == 0) break;
+            end = recorder->checkpointAt(index);
+        }
+    }
+    recorder->seek(*vm, found ? at : 0);
+    if (!found) std::cout << "Reached the start of the recording" << std::endl;
+    report(found ? stop : VM::Stop::None, hit);
+}
+
+void Debugger::handleCommand(const std::string& cmd) {
+    std::istringstream args(cmd);
+    std::string name;
+    args >> name;
+    if (name == "s" || name == "step") {
+        if (recorder) {
+            recorder->forward(*vm, vm->getExecutedCount() + 1, true);
+            vm->printState();
+        } else {
+            vm->step();
+        }
+        if (vm->getStop() == VM::Stop::Watch) {
+            const VM::WatchHit& hit = vm->getWatchHit();
+            std::cout << "Watch: " << hit.before << " -> " << hit.after << std::endl;
+        }
+    }
+    else if (name == "c" || name == "continue") {
+        resume();
+    }
+    else if (name == "rs" || name == "reverse-step") {
+        if (recording()) {
+            uint64_t count = vm->getExecutedCount();
+            recorder->seek(*vm, count > 0 ? count - 1 : 0);
+            vm->printState();
+        }
+    }
+    else if (name == "rc" || name == "reverse-continue") {
+        if (recording()) reverseContinue();
+    }
+    else if (name == "goto") {
+        uint64_t count;
+        if (!(args >> count)) {
+            std::cout << "Usage: goto <instruction count>" << std::endl;
+        } else if (recording()) {
+            recorder->seek(*vm, count);
+            report(VM::Stop::None, vm->getWatchHit());
+        }
+    }
+    else if (name == "info") {
+        std::cout << "Instruction " << vm->getExecutedCount() << ", pc " << vm->getPc() << std::endl;
+        if (recorder) {
+            std::cout << "Recording: " << recorder->checkpointCount() << " checkpoints every "
+                      << recorder->checkpointInterval() << " instructions, "
+                      << recorder->memoryInUse() / 1024 << " KB" << std::endl;
+        }
+    }
+    else if (name == "b" || name == "break") {
+        breakAt(args);
+    }
+    else if (name == "delete") {
+        size_t pc;
+        if (args >> pc && vm->hasBreakpoint(pc)) {
+            vm->clearBreakpoint(pc);
+            conditions.erase(pc);
+        } else {
+            std::cout << "No breakpoint there" << std::endl;
+        }
+    }
+    else if (name == "w" || name == "watch") {
+        std::string variable;
+        if (args >> variable) watch(variable);
+        else std::cout << "Usage: watch <var|function.var>" << std::endl;
+    }
+    else if (name == "unwatch") {
+        vm->clearWatches();
+    }
+    else if (name == "p" || name == "print") {
+        std::string variable;
+        int64_t value;
+        if (args >> variable && read(variable, value)) std::cout << variable << " = " << value << std::endl;
+        else std::cout << "No variable '" << variable << "' here" << std::endl;
+    }
+    else if (name == "r" || name == "regs" || name == "stack") {
         vm->printState();
     }
-    else if (cmd == "q" || cmd == "quit") {
+    else if (name == "q" || name == "quit") {
         active = false;
     }
-    else if (cmd == "h" || cmd == "help") {
+    else if (name == "h" || name == "help") {
         printHelp();
     }
     else {
@@ -37,15 +311,16 @@ void Debugger::handleCommand(const std::string& cmd) {
 
 void Debugger::start() {
     active = true;
-    vm->setStepMode(true);
+    // Program output shares the terminal with the prompt.
+    vm->getOutput().setFlushPolicy(OutputBuffer::FlushPolicy::PerLine);
     printHelp();
     
     std::string line;
     while (active) {
         std::cout << "\n(microc-db) ";
-        std::getline(std::cin, line);
+        if (!std::getline(std::cin, line)) break;
         if (!line.empty()) {
             handleCommand(line);
         }
     }
-}
\ No newline at end of file
+}
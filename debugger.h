@@ -1,14 +1,43 @@
 #pragma once
+#include "replay.h"
 #include "vm.h"
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <sstream>
 #include <string>
 
 class Debugger {
+    // Optional condition of a breakpoint: `variable op value`.
+    struct Condition {
+        std::string variable;
+        std::string op;
+        int64_t value;
+    };
+
     VM* vm;
     bool active;
+    std::map<size_t, Condition> conditions;
+    std::optional<Recorder> recorder;
+
+    bool resolve(const std::string& name, VM::Watch& variable) const;
+    bool read(const std::string& name, int64_t& value) const;
+    bool conditionHolds(size_t pc) const;
+    void breakAt(std::istringstream& args);
+    void watch(const std::string& name);
+    void runToStop();
+    void report(VM::Stop stop, const VM::WatchHit& hit) const;
+    void resume();
+    bool lastStopBefore(size_t checkpoint, uint64_t end, uint64_t& at, VM::Stop& stop, VM::WatchHit& hit);
+    void reverseContinue();
+    bool recording() const;
     
 public:
     Debugger(VM* vmInstance);
+    // Checkpoints the run so it can be stepped backwards; call before
+    // start().
+    void record(uint64_t interval, size_t memoryBudget);
     void start();
     void handleCommand(const std::string& cmd);
     void printHelp();
-};
\ No newline at end of file
+};
@@ -0,0 +1,190 @@
+#include "fold.h"
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+bool literalValue(const ASTPtr& node, int64_t& value) {
+    if (node->type != ASTType::NUMBER) return false;
+    try {
+        value = std::stoll(node->value);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Same results as the VM, which wraps on overflow.
+bool evaluate(TokenType op, int64_t a, int64_t b, int64_t& result) {
+    uint64_t ua = static_cast<uint64_t>(a);
+    uint64_t ub = static_cast<uint64_t>(b);
+    switch (op) {
+        case TokenType::PLUS: result = static_cast<int64_t>(ua + ub); break;
+        case TokenType::MINUS: result = static_cast<int64_t>(ua - ub); break;
+        case TokenType::STAR: result = static_cast<int64_t>(ua * ub); break;
+        case TokenType::SLASH:
+            if (b == 0 || (a == std::numeric_limits<int64_t>::min() && b == -1)) return false;
+            result = a / b;
+            break;
+        case TokenType::EQ: result = a == b; break;
+        case TokenType::NEQ: result = a != b; break;
+        case TokenType::LT: result = a < b; break;
+        case TokenType::LEQ: result = a <= b; break;
+        case TokenType::GT: result = a > b; break;
+        case TokenType::GEQ: result = a >= b; break;
+        default: return false;
+    }
+    return true;
+}
+
+ASTPtr literal(int64_t value) {
+    return std::make_shared<ASTNode>(ASTType::NUMBER, std::to_string(value));
+}
+
+class Folder {
+    struct Variable {
+        bool assigned = false;
+        // Globals declared after top-level code made a call can be read by
+        // that call before their initializer runs.
+        bool readEarly = false;
+        bool known = false;
+        int64_t value = 0;
+    };
+
+    std::vector<Variable> variables;
+    ScopedSymbols<size_t> scopes;
+    // Variable of every VAR_DECL, IDENTIFIER and ASSIGN, resolved with the
+    // compiler's scoping rules.
+    std::unordered_map<const ASTNode*, size_t> variableOf;
+    bool inFunction = false;
+    bool topLevelCall = false;
+
+    void declare(const ASTPtr& node) {
+        variables.emplace_back();
+        scopes.declare(node->symbol, variables.size() - 1);
+    }
+
+    void resolve(const ASTPtr& node) {
+        const size_t* variable;
+        switch (node->type) {
+            case ASTType::FUNC_DECL:
+                // Parameters are never known; they share the body's scope.
+                inFunction = true;
+                scopes.enterScope();
+                for (size_t i = 0; i + 1 < node->children.size(); i++) declare(node->children[i]);
+                for (auto& child : node->children.back()->children) resolve(child);
+                scopes.leaveScope();
+                inFunction = false;
+                return;
+            case ASTType::BLOCK:
+                scopes.enterScope();
+                for (auto& child : node->children) resolve(child);
+                scopes.leaveScope();
+                return;
+            case ASTType::VAR_DECL:
+                declare(node);
+                variables.back().readEarly = !inFunction && topLevelCall;
+                variableOf[node.get()] = variables.size() - 1;
+                break;
+            case ASTType::ASSIGN:
+                if ((variable = scopes.find(node->symbol))) {
+                    variables[*variable].assigned = true;
+                    variableOf[node.get()] = *variable;
+                }
+                break;
+            case ASTType::IDENTIFIER:
+                if ((variable = scopes.find(node->symbol))) variableOf[node.get()] = *variable;
+                break;
+            case ASTType::CALL:
+                if (!inFunction) topLevelCall = true;
+                break;
+            default:
+                break;
+        }
+        for (auto& child : node->children) resolve(child);
+    }
+
+    void foldExpression(ASTPtr& node) {
+        for (auto& child : node->children) foldExpression(child);
+        if (node->type == ASTType::IDENTIFIER) {
+            auto variable = variableOf.find(node.get());
+            if (variable == variableOf.end()) return;
+            const Variable& v = variables[variable->second];
+            if (v.known && !v.assigned && !v.readEarly) node = literal(v.value);
+        } else if (node->type == ASTType::BINARY_OP) {
+            int64_t a, b, result;
+            if (literalValue(node->children[0], a) && literalValue(node->children[1], b) &&
+                evaluate(node->op, a, b, result)) {
+                node = literal(result);
+            }
+        }
+    }
+
+    void foldStatement(ASTPtr& node) {
+        int64_t condition;
+        switch (node->type) {
+            case ASTType::VAR_DECL: {
+                foldExpression(node->children[0]);
+                int64_t value;
+                if (literalValue(node->children[0], value)) {
+                    Variable& variable = variables[variableOf.at(node.get())];
+                    variable.known = true;
+                    variable.value = value;
+                }
+                return;
+            }
+            case ASTType::IF_STMT:
+                foldExpression(node->children[0]);
+                if (literalValue(node->children[0], condition)) {
+                    if (condition) {
+                        node = node->children[1];
+                    } else if (node->children.size() == 3) {
+                        node = node->children[2];
+                    } else {
+                        node = std::make_shared<ASTNode>(ASTType::BLOCK);
+                    }
+                    foldStatement(node);
+                    return;
+                }
+                for (size_t i = 1; i < node->children.size(); i++) foldStatement(node->children[i]);
+                return;
+            case ASTType::WHILE_STMT:
+                foldExpression(node->children[0]);
+                if (literalValue(node->children[0], condition) && !condition) {
+                    node = std::make_shared<ASTNode>(ASTType::BLOCK);
+                    return;
+                }
+                foldStatement(node->children[1]);
+                return;
+            case ASTType::PROGRAM:
+            case ASTType::BLOCK:
+            case ASTType::FUNC_DECL:
+                for (auto& child : node->children) foldStatement(child);
+                return;
+            case ASTType::PRINT:
+            case ASTType::RETURN:
+            case ASTType::EXPR_STMT:
+                for (auto& child : node->children) foldExpression(child);
+                return;
+            default:
+                return;
+        }
+    }
+
+public:
+    void run(const ASTPtr& program) {
+        scopes.enterScope();
+        resolve(program);
+        ASTPtr root = program;
+        foldStatement(root);
+    }
+};
+
+}
+
+void foldConstants(const ASTPtr& program) {
+    Folder().run(program);
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include "ast.h"
+
+// AST-level constant folding, run between the parser and the compilers.
+// Folds arithmetic and comparisons on literals, replaces reads of `int`
+// variables that are initialized with a constant and never assigned by the
+// constant, and drops `if`/`while` branches whose condition is constant.
+// Divisions that would trap (by zero, INT64_MIN / -1) are left for run
+// time.
+void foldConstants(const ASTPtr& program);
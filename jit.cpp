@@ -0,0 +1,547 @@
+#include "jit.h"
+#include "strength.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define MINEC_JIT_X86_64 1
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#ifdef MINEC_JIT_X86_64
+namespace {
+
+const size_t kDefaultNativeStack = 8 << 20;
+const size_t kInterpreterHeadroom = 1 << 20;
+
+// Frame layout after the prologue: [rbp-8] saved rbx, [rbp-16] saved r12,
+// local i at [rbp-24-8*i]. rbx holds the JitRuntime and r12 the globals;
+// the operand stack grows down from the locals on rsp.
+int32_t localOffset(int64_t index) {
+    return static_cast<int32_t>(-24 - 8 * index);
+}
+
+uint8_t disp8(size_t offset) {
+    return static_cast<uint8_t>(offset);
+}
+
+bool fitsInt32(int64_t value) {
+    return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+}
+
+// x86 condition codes used by SETcc/Jcc; the negation of cc is cc ^ 1.
+uint8_t conditionCode(OpCode op) {
+    switch (op) {
+        case OpCode::CMP_EQ: case OpCode::JMP_IF_NOT_EQ: return 0x4;
+        case OpCode::CMP_NEQ: case OpCode::JMP_IF_NOT_NEQ: return 0x5;
+        case OpCode::CMP_LT: case OpCode::JMP_IF_NOT_LT: return 0xC;
+        case OpCode::CMP_GEQ: case OpCode::JMP_IF_NOT_GEQ: return 0xD;
+        case OpCode::CMP_LEQ: case OpCode::JMP_IF_NOT_LEQ: return 0xE;
+        default: return 0xF;
+    }
+}
+
+class FunctionCompiler {
+    const std::vector<Instruction>& code;
+    const VerifiedProgram& verified;
+    const std::vector<AsmBlock>& asmBlocks;
+    int32_t id;
+    const FunctionInfo& fn;
+    bool osr;
+    size_t osrHeader;
+    std::vector<uint8_t> out;
+    std::vector<size_t> labels;
+    std::vector<std::pair<size_t, size_t>> fixups;
+
+    void emit(std::initializer_list<uint8_t> bytes) {
+        out.insert(out.end(), bytes);
+    }
+
+    void imm32(int32_t value) {
+        uint8_t bytes[4];
+        std::memcpy(bytes, &value, sizeof(bytes));
+        out.insert(out.end(), bytes, bytes + 4);
+    }
+
+    void imm64(int64_t value) {
+        uint8_t bytes[8];
+        std::memcpy(bytes, &value, sizeof(bytes));
+        out.insert(out.end(), bytes, bytes + 8);
+    }
+
+    void patch32(size_t at, int32_t value) {
+        std::memcpy(&out[at], &value, sizeof(value));
+    }
+
+    void jumpTo(size_t target) {
+        fixups.push_back({out.size(), target});
+        imm32(0);
+    }
+
+    // mov rax, imm64
+    void loadRax(int64_t value) {
+        emit({0x48, 0xB8});
+        imm64(value);
+    }
+
+    // Calls need rsp 16-byte aligned; the prologue leaves it aligned, so
+    // an odd number of operands on the native stack needs one pad slot.
+    void alignForCall(int depth) {
+        if (depth % 2) emit({0x48, 0x83, 0xEC, 0x08});
+    }
+
+    void unalignAfterCall(int depth) {
+        if (depth % 2) emit({0x48, 0x83, 0xC4, 0x08});
+    }
+
+    void callRuntime(size_t offset) {
+        emit({0xFF, 0x53, disp8(offset)});
+    }
+
+    void prologue() {
+        if (!osr) {
+            emit({0x48, 0x3B, 0x67, disp8(offsetof(JitRuntime, stackLimit))});
+            emit({0x73, 0x0B});
+            emit({0x48, 0x89, 0xF2});
+            emit({0xBE});
+            imm32(id);
+            emit({0xFF, 0x67, disp8(offsetof(JitRuntime, interpret))});
+        }
+
+        emit({0x55});
+        emit({0x48, 0x89, 0xE5});
+        emit({0x53});
+        emit({0x41, 0x54});
+        emit({0x48, 0x89, 0xFB});
+        emit({0x4C, 0x8B, 0x67, disp8(offsetof(JitRuntime, globals))});
+
+        uint32_t slots = (fn.localCount + 1) & ~1u;
+        if (slots != 0) {
+            emit({0x48, 0x81, 0xEC});
+            imm32(static_cast<int32_t>(slots * 8));
+        }
+        if (osr) {
+            osrPrologue();
+            return;
+        }
+        if (slots == 0) return;
+        emit({0x31, 0xC0});
+        if (fn.localCount <= 16) {
+            for (uint32_t i = fn.paramCount; i < fn.localCount; i++) {
+                emit({0x48, 0x89, 0x85});
+                imm32(localOffset(i));
+            }
+        } else {
+            emit({0x48, 0x89, 0xE7});
+            emit({0xB9});
+            imm32(static_cast<int32_t>(slots));
+            emit({0xF3, 0x48, 0xAB});
+        }
+        // rsi points at the arguments, the last one first.
+        for (uint32_t i = 0; i < fn.paramCount; i++) {
+            emit({0x48, 0x8B, 0x86});
+            imm32(static_cast<int32_t>(8 * (fn.paramCount - 1 - i)));
+            emit({0x48, 0x89, 0x85});
+            imm32(localOffset(i));
+        }
+    }
+
+    // TAIL_CALL to this function: the arguments on top of the operand stack
+    // become the parameters, the other locals are zeroed again and the body
+    // starts over in the same frame.
+    void selfTailCall(int arguments) {
+        uint32_t slots = (fn.localCount + 1) & ~1u;
+        if (fn.localCount > fn.paramCount) {
+            emit({0x31, 0xC0});
+            if (fn.localCount <= 16) {
+                for (uint32_t i = fn.paramCount; i < fn.localCount; i++) {
+                    emit({0x48, 0x89, 0x85});
+                    imm32(localOffset(i));
+                }
+            } else {
+                emit({0x48, 0x8D, 0xBC, 0x24});
+                imm32(8 * arguments);
+                emit({0xB9});
+                imm32(static_cast<int32_t>(slots));
+                emit({0xF3, 0x48, 0xAB});
+            }
+        }
+        for (int i = 0; i < arguments; i++) {
+            emit({0x48, 0x8B, 0x84, 0x24});
+            imm32(8 * (arguments - 1 - i));
+            emit({0x48, 0x89, 0x85});
+            imm32(localOffset(i));
+        }
+        if (arguments > 0) {
+            emit({0x48, 0x81, 0xC4});
+            imm32(8 * arguments);
+        }
+        emit({0xE9});
+        jumpTo(fn.entry);
+    }
+
+    // TAIL_CALL to another function: copy the arguments to the runtime's
+    // buffer, tear the frame down and jump to the callee (or to the
+    // runtime's call) with our caller's return address on top.
+    void tailCall(int32_t callee, int arguments) {
+        emit({0x48, 0x8B, 0x73, disp8(offsetof(JitRuntime, tailArguments))});
+        for (int i = 0; i < arguments; i++) {
+            emit({0x48, 0x8B, 0x84, 0x24});
+            imm32(8 * i);
+            emit({0x48, 0x89, 0x86});
+            imm32(8 * i);
+        }
+        emit({0x48, 0x89, 0xDF, 0x48, 0x89, 0xF2});
+        emit({0x48, 0x8B, 0x5D, 0xF8, 0x4C, 0x8B, 0x65, 0xF0, 0xC9});
+        emit({0x48, 0x8B, 0x47, disp8(offsetof(JitRuntime, entries))});
+        emit({0x48, 0x8B, 0x80});
+        imm32(callee * 8);
+        emit({0x48, 0x85, 0xC0, 0x74, 0x02, 0xFF, 0xE0});
+        emit({0xBE});
+        imm32(callee);
+        emit({0xFF, 0x67, disp8(offsetof(JitRuntime, call))});
+    }
+
+    // OSR entry: rsi points at the interpreter's locals for this frame and
+    // rdx at the operand stack values live at the loop header. Copy both
+    // into the native frame, then continue at the header.
+    void osrPrologue() {
+        for (uint32_t i = 0; i < fn.localCount; i++) {
+            emit({0x48, 0x8B, 0x86});
+            imm32(static_cast<int32_t>(8 * i));
+            emit({0x48, 0x89, 0x85});
+            imm32(localOffset(i));
+        }
+        for (int i = 0; i < verified.stackHeight[osrHeader]; i++) {
+            emit({0xFF, 0xB2});
+            imm32(8 * i);
+        }
+        emit({0xE9});
+        jumpTo(osrHeader);
+    }
+
+    bool translate(size_t pc) {
+        const Instruction& inst = code[pc];
+        int64_t operand = inst.operand;
+        int depth = verified.stackHeight[pc];
+
+        switch (inst.op) {
+            case OpCode::NOP:
+            case OpCode::SNAPSHOT:
+                return true;
+            case OpCode::NEG:
+                emit({0x48, 0xF7, 0x1C, 0x24});
+                return true;
+            case OpCode::PUSH:
+                if (fitsInt32(operand)) {
+                    emit({0x68});
+                    imm32(static_cast<int32_t>(operand));
+                } else {
+                    loadRax(operand);
+                    emit({0x50});
+                }
+                return true;
+            case OpCode::POP:
+                emit({0x48, 0x83, 0xC4, 0x08});
+                return true;
+            case OpCode::ADD:
+                emit({0x59, 0x48, 0x01, 0x0C, 0x24});
+                return true;
+            case OpCode::SUB:
+                emit({0x59, 0x48, 0x29, 0x0C, 0x24});
+                return true;
+            case OpCode::MUL:
+                emit({0x59, 0x48, 0x8B, 0x04, 0x24, 0x48, 0x0F, 0xAF, 0xC1, 0x48, 0x89, 0x04, 0x24});
+                return true;
+            case OpCode::DIV:
+                emit({0x59, 0x58, 0x48, 0x99, 0x48, 0xF7, 0xF9, 0x50});
+                return true;
+            case OpCode::CMP_EQ:
+            case OpCode::CMP_NEQ:
+            case OpCode::CMP_LT:
+            case OpCode::CMP_GT:
+            case OpCode::CMP_LEQ:
+            case OpCode::CMP_GEQ:
+                emit({0x59, 0x58, 0x48, 0x39, 0xC8});
+                emit({0x0F, static_cast<uint8_t>(0x90 | conditionCode(inst.op)), 0xC0});
+                emit({0x0F, 0xB6, 0xC0, 0x50});
+                return true;
+            case OpCode::LOAD_GLOBAL:
+                emit({0x41, 0xFF, 0xB4, 0x24});
+                imm32(static_cast<int32_t>(operand * 8));
+                return true;
+            case OpCode::STORE_GLOBAL:
+            case OpCode::STORE_KEEP_GLOBAL:
+                if (inst.op == OpCode::STORE_GLOBAL) emit({0x58});
+                else emit({0x48, 0x8B, 0x04, 0x24});
+                emit({0x49, 0x89, 0x84, 0x24});
+                imm32(static_cast<int32_t>(operand * 8));
+                return true;
+            case OpCode::LOAD_LOCAL:
+                emit({0xFF, 0xB5});
+                imm32(localOffset(operand));
+                return true;
+            case OpCode::STORE_LOCAL:
+            case OpCode::STORE_KEEP_LOCAL:
+                if (inst.op == OpCode::STORE_LOCAL) emit({0x58});
+                else emit({0x48, 0x8B, 0x04, 0x24});
+                emit({0x48, 0x89, 0x85});
+                imm32(localOffset(operand));
+                return true;
+            case OpCode::ADD_IMM:
+            case OpCode::SUB_IMM: {
+                bool add = inst.op == OpCode::ADD_IMM;
+                if (fitsInt32(operand)) {
+                    emit({0x48, 0x81, static_cast<uint8_t>(add ? 0x04 : 0x2C), 0x24});
+                    imm32(static_cast<int32_t>(operand));
+                } else {
+                    loadRax(operand);
+                    emit({0x48, static_cast<uint8_t>(add ? 0x01 : 0x29), 0x04, 0x24});
+                }
+                return true;
+            }
+            case OpCode::SHL_IMM:
+                emit({0x48, 0xC1, 0x24, 0x24, static_cast<uint8_t>(operand)});
+                return true;
+            case OpCode::DIV_POW2:
+                emit({0x48, 0x8B, 0x04, 0x24, 0x48, 0x89, 0xC1, 0x48, 0xC1, 0xF9, 0x3F});
+                emit({0x48, 0xC1, 0xE9, static_cast<uint8_t>(64 - operand), 0x48, 0x01, 0xC8});
+                emit({0x48, 0xC1, 0xF8, static_cast<uint8_t>(operand), 0x48, 0x89, 0x04, 0x24});
+                return true;
+            case OpCode::DIV_MAGIC: {
+                MagicDivisor magic = magicDivisor(operand);
+                emit({0x48, 0x8B, 0x0C, 0x24});
+                loadRax(magic.multiplier);
+                emit({0x48, 0xF7, 0xE9});
+                if (magic.correction > 0) emit({0x48, 0x01, 0xCA});
+                if (magic.correction < 0) emit({0x48, 0x29, 0xCA});
+                if (magic.shift > 0) emit({0x48, 0xC1, 0xFA, static_cast<uint8_t>(magic.shift)});
+                emit({0x48, 0x89, 0xD0, 0x48, 0xC1, 0xE8, 0x3F, 0x48, 0x01, 0xC2, 0x48, 0x89, 0x14, 0x24});
+                return true;
+            }
+            case OpCode::ADD_LOCALS:
+                emit({0x48, 0x8B, 0x85});
+                imm32(localOffset(packedLow(operand)));
+                emit({0x48, 0x03, 0x85});
+                imm32(localOffset(packedHigh(operand)));
+                emit({0x50});
+                return true;
+            case OpCode::ADD_LOCAL_IMM:
+                emit({0x48, 0x8B, 0x85});
+                imm32(localOffset(packedLow(operand)));
+                emit({0x48, 0x05});
+                imm32(packedHigh(operand));
+                emit({0x50});
+                return true;
+            case OpCode::JMP:
+                emit({0xE9});
+                jumpTo(static_cast<size_t>(operand));
+                return true;
+            case OpCode::JMP_IF_FALSE:
+                emit({0x58, 0x48, 0x85, 0xC0, 0x0F, 0x84});
+                jumpTo(static_cast<size_t>(operand));
+                return true;
+            case OpCode::JMP_IF_NOT_EQ:
+            case OpCode::JMP_IF_NOT_NEQ:
+            case OpCode::JMP_IF_NOT_LT:
+            case OpCode::JMP_IF_NOT_GT:
+            case OpCode::JMP_IF_NOT_LEQ:
+            case OpCode::JMP_IF_NOT_GEQ:
+                emit({0x59, 0x58, 0x48, 0x39, 0xC8});
+                emit({0x0F, static_cast<uint8_t>(0x80 | (conditionCode(inst.op) ^ 1))});
+                jumpTo(static_cast<size_t>(operand));
+                return true;
+            case OpCode::CALL: {
+                int32_t callee = verified.functionAt[branchTarget(inst)];
+                int arguments = packedHigh(operand);
+                if (verified.functions[static_cast<size_t>(callee)].returnHeight != 1) return false;
+                // The arguments stay where they were pushed: rsi points at
+                // them for compiled callees, rdx for the runtime.
+                if (arguments > 0) emit({0x48, 0x89, 0xE6, 0x48, 0x89, 0xE2});
+                alignForCall(depth);
+                emit({0x48, 0x89, 0xDF});
+                if (callee == id && !osr) {
+                    emit({0xE8});
+                    imm32(-static_cast<int32_t>(out.size() + 4));
+                } else {
+                    // Call the callee's compiled code directly when there is
+                    // some, otherwise let the VM count, compile or interpret.
+                    emit({0x48, 0x8B, 0x43, disp8(offsetof(JitRuntime, entries))});
+                    emit({0x48, 0x8B, 0x80});
+                    imm32(callee * 8);
+                    emit({0x48, 0x85, 0xC0, 0x74, 0x04, 0xFF, 0xD0, 0xEB, 0x08});
+                    emit({0xBE});
+                    imm32(callee);
+                    callRuntime(offsetof(JitRuntime, call));
+                }
+                unalignAfterCall(depth);
+                if (arguments > 0) {
+                    emit({0x48, 0x81, 0xC4});
+                    imm32(8 * arguments);
+                }
+                emit({0x50});
+                return true;
+            }
+            case OpCode::RET:
+                emit({0x58, 0x48, 0x8B, 0x5D, 0xF8, 0x4C, 0x8B, 0x65, 0xF0, 0xC9, 0xC3});
+                return true;
+            case OpCode::TAIL_CALL: {
+                int32_t callee = verified.functionAt[branchTarget(inst)];
+                if (callee == id) selfTailCall(packedHigh(operand));
+                else tailCall(callee, packedHigh(operand));
+                return true;
+            }
+            case OpCode::PRINT:
+                emit({0x5E});
+                alignForCall(depth - 1);
+                emit({0x48, 0x89, 0xDF});
+                callRuntime(offsetof(JitRuntime, print));
+                unalignAfterCall(depth - 1);
+                return true;
+            case OpCode::EXEC_ASM:
+                for (const AsmOp& op : asmBlocks[static_cast<size_t>(operand)]) {
+                    if (op.op == AsmOpCode::PUSH || op.op == AsmOpCode::POP) return false;
+                }
+                alignForCall(depth);
+                emit({0x48, 0x89, 0xDF, 0xBE});
+                imm32(static_cast<int32_t>(operand));
+                callRuntime(offsetof(JitRuntime, execAsm));
+                unalignAfterCall(depth);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+public:
+    FunctionCompiler(const std::vector<Instruction>& instructions, const VerifiedProgram& program,
+                     const std::vector<AsmBlock>& blocks, int32_t functionId, size_t header = SIZE_MAX)
+        : code(instructions), verified(program), asmBlocks(blocks), id(functionId),
+          fn(program.functions[static_cast<size_t>(functionId)]), osr(header != SIZE_MAX), osrHeader(header) {}
+
+    bool run(std::vector<uint8_t>& result) {
+        if (id == 0 || fn.returnHeight != 1) return false;
+        if (fn.localCount > (1u << 24) || verified.globalCount > (1u << 24)) return false;
+        if (osr && (osrHeader >= code.size() || verified.owner[osrHeader] != id || fn.localCount > 4096)) {
+            return false;
+        }
+
+        prologue();
+        labels.assign(code.size(), 0);
+        for (size_t pc = fn.entry; pc < code.size(); pc++) {
+            if (verified.owner[pc] != id) continue;
+            labels[pc] = out.size();
+            if (!translate(pc)) return false;
+        }
+        for (const auto& fixup : fixups) {
+            if (fixup.second >= code.size() || verified.owner[fixup.second] != id) return false;
+            patch32(fixup.first, static_cast<int32_t>(labels[fixup.second]) - static_cast<int32_t>(fixup.first + 4));
+        }
+        result = std::move(out);
+        return true;
+    }
+};
+
+}
+
+bool Jit::available() {
+    return true;
+}
+
+void* Jit::install(const std::vector<uint8_t>& machineCode) {
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t length = (machineCode.size() + page - 1) / page * page;
+    void* memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return nullptr;
+    std::memcpy(memory, machineCode.data(), machineCode.size());
+    if (mprotect(memory, length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, length);
+        return nullptr;
+    }
+    regions.push_back({memory, length});
+    lastSize = machineCode.size();
+    return memory;
+}
+
+JitFunction Jit::compile(const std::vector<Instruction>& code, const VerifiedProgram& verified,
+                         const std::vector<AsmBlock>& asmBlocks, int32_t functionId) {
+    std::vector<uint8_t> machineCode;
+    if (!FunctionCompiler(code, verified, asmBlocks, functionId).run(machineCode)) return nullptr;
+    return reinterpret_cast<JitFunction>(install(machineCode));
+}
+
+JitOsrEntry Jit::compileOsr(const std::vector<Instruction>& code, const VerifiedProgram& verified,
+                            const std::vector<AsmBlock>& asmBlocks, int32_t functionId, size_t header) {
+    std::vector<uint8_t> machineCode;
+    if (!FunctionCompiler(code, verified, asmBlocks, functionId, header).run(machineCode)) return nullptr;
+    return reinterpret_cast<JitOsrEntry>(install(machineCode));
+}
+
+void Jit::reset() {
+    for (const auto& region : regions) {
+        munmap(region.first, region.second);
+    }
+    regions.clear();
+}
+
+static uintptr_t threadStackLimit() {
+    // Worker threads have their own, usually smaller, stacks: use the
+    // calling thread's actual bounds when the platform reports them.
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void* low = nullptr;
+        size_t size = 0;
+        int status = pthread_attr_getstack(&attr, &low, &size);
+        pthread_attr_destroy(&attr);
+        if (status == 0 && size > 0) {
+            size_t reserve = size > 2 * kInterpreterHeadroom ? kInterpreterHeadroom : size / 2;
+            return reinterpret_cast<uintptr_t>(low) + reserve;
+        }
+    }
+    char probe;
+    size_t size = kDefaultNativeStack;
+    rlimit limit;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        size = static_cast<size_t>(limit.rlim_cur);
+    }
+    size_t usable = size > 2 * kInterpreterHeadroom ? size - kInterpreterHeadroom : size / 2;
+    return reinterpret_cast<uintptr_t>(&probe) - usable;
+}
+
+uintptr_t nativeStackLimit() {
+    // Reading the bounds parses /proc/self/maps on the main thread; they
+    // never change, and the debugger calls run() once per stop.
+    static thread_local uintptr_t limit = threadStackLimit();
+    return limit;
+}
+#else
+bool Jit::available() {
+    return false;
+}
+
+JitFunction Jit::compile(const std::vector<Instruction>&, const VerifiedProgram&,
+                         const std::vector<AsmBlock>&, int32_t) {
+    return nullptr;
+}
+
+JitOsrEntry Jit::compileOsr(const std::vector<Instruction>&, const VerifiedProgram&,
+                            const std::vector<AsmBlock>&, int32_t, size_t) {
+    return nullptr;
+}
+
+void Jit::reset() {}
+
+uintptr_t nativeStackLimit() {
+    return std::numeric_limits<uintptr_t>::max();
+}
+#endif
+
+Jit::~Jit() {
+    reset();
+}
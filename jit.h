@@ -0,0 +1,75 @@
+#pragma once
+#include "asm.h"
+#include "token.h"
+#include "verifier.h"
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+struct JitRuntime;
+// `arguments` points at the last argument, with argument i at
+// arguments[paramCount - 1 - i]: where a native caller's pushes leave them.
+using JitFunction = int64_t (*)(JitRuntime*, const int64_t* arguments);
+// On-stack replacement entry: resumes a function at a loop header from the
+// interpreter's locals and the operand stack values live there.
+using JitOsrEntry = int64_t (*)(JitRuntime*, const int64_t* locals, const int64_t* stack);
+
+// Everything compiled code reaches through its context register: the
+// globals, the table of compiled entry points (null while a function is
+// still interpreted) and callbacks into the VM.
+struct JitRuntime {
+    void* vm;
+    int64_t* globals;
+    const JitFunction* entries;
+    // Where a TAIL_CALL leaves the arguments while its frame is torn down,
+    // laid out like `arguments`; room for the most parameters of any
+    // function.
+    int64_t* tailArguments;
+    // Compiled code that finds rsp below this address hands the call to
+    // the interpreter instead of growing the native stack further.
+    uintptr_t stackLimit;
+    int64_t (*call)(JitRuntime* runtime, int64_t functionId, const int64_t* arguments);
+    int64_t (*interpret)(JitRuntime* runtime, int64_t functionId, const int64_t* arguments);
+    void (*print)(JitRuntime* runtime, int64_t value);
+    void (*execAsm)(JitRuntime* runtime, int64_t block);
+};
+
+// Baseline template JIT for x86-64 Linux. Each function is translated
+// instruction by instruction: locals live in the native frame, the operand
+// stack is the native stack, and CALL/PRINT/EXEC_ASM go through the
+// runtime. A TAIL_CALL to the function itself becomes a jump back to its
+// start; to another function it tears the frame down and jumps to the
+// callee, so tail calls never grow the native stack. Code is written to an
+// mmap'd RW buffer that is flipped to RX before use. compile() returns
+// nullptr for anything it cannot translate (the top-level code, asm blocks
+// that push or pop, functions returning other than one value) and on other
+// platforms.
+class Jit {
+    std::vector<std::pair<void*, size_t>> regions;
+    size_t lastSize = 0;
+
+    void* install(const std::vector<uint8_t>& machineCode);
+
+public:
+    Jit() = default;
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+    ~Jit();
+
+    static bool available();
+    JitFunction compile(const std::vector<Instruction>& code, const VerifiedProgram& verified,
+                        const std::vector<AsmBlock>& asmBlocks, int32_t functionId);
+    // Compiles the whole function again, entered at the loop header `header`.
+    JitOsrEntry compileOsr(const std::vector<Instruction>& code, const VerifiedProgram& verified,
+                           const std::vector<AsmBlock>& asmBlocks, int32_t functionId, size_t header);
+    // Releases all compiled code.
+    void reset();
+    size_t compiledCount() const { return regions.size(); }
+    // Length of the machine code returned by the last successful compile.
+    size_t lastCodeSize() const { return lastSize; }
+};
+
+// Lowest address compiled code may push the native stack to when entered
+// from the current frame, keeping headroom for the interpreter and the
+// callbacks it makes.
+uintptr_t nativeStackLimit();
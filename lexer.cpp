@@ -12,18 +12,19 @@ void Lexer::skipWhitespace() {
 }
 
 Token Lexer::readNumber() {
-    std::string num;
+    size_t start = pos;
     while (pos < source.length() && isdigit(source[pos])) {
-        num += source[pos++];
+        pos++;
     }
-    return {TokenType::NUMBER, num, line};
+    return {TokenType::NUMBER, source.substr(start, pos - start), line};
 }
 
 Token Lexer::readIdentifier() {
-    std::string id;
+    size_t start = pos;
     while (pos < source.length() && (isalnum(source[pos]) || source[pos] == '_')) {
-        id += source[pos++];
+        pos++;
     }
+    std::string id = source.substr(start, pos - start);
 
     if (id == "int") return {TokenType::INT, id, line};
     if (id == "void") return {TokenType::VOID, id, line};
@@ -33,8 +34,10 @@ Token Lexer::readIdentifier() {
     if (id == "else") return {TokenType::ELSE, id, line};
     if (id == "while") return {TokenType::WHILE, id, line};
     if (id == "print") return {TokenType::PRINT, id, line};
+    if (id == "snapshot") return {TokenType::SNAPSHOT, id, line};
     
-    return {TokenType::IDENTIFIER, id, line};
+    Symbol symbol = symbols.intern(id);
+    return {TokenType::IDENTIFIER, std::move(id), line, symbol};
 }
 
 Token Lexer::readAsmBlock() {
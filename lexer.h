@@ -1,4 +1,5 @@
 #pragma once
+#include "symbols.h"
 #include "token.h"
 #include <vector>
 #include <string>
@@ -7,6 +8,7 @@ class Lexer {
     std::string source;
     size_t pos;
     int line;
+    Interner symbols;
     
     void skipWhitespace();
     Token nextToken();
@@ -1,15 +1,70 @@
 #include "lexer.h"
 #include "parser.h"
 #include "compiler.h"
+#include "peephole.h"
+#include "fold.h"
+#include "strength.h"
+#include "native.h"
+#include "regcompiler.h"
 #include "vm.h"
+#include "regvm.h"
+#include "runner.h"
 #include "debugger.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <optional>
 #include <sstream>
+#include <sys/resource.h>
+
+// Counts heap allocations so --stats can report allocations during a run.
+// Without --stats the count is off and an allocation costs one branch.
+// Only this operator new and the sized and unsized deletes are replaced:
+// libstdc++'s operator new[] and delete[] forward to them, so arrays are
+// counted too, while the aligned forms allocate and free on their own and
+// are not counted. countAllocations is set before any thread starts.
+static bool countAllocations = false;
+static std::atomic<uint64_t> heapAllocations{0};
+
+void* operator new(std::size_t size) {
+    if (countAllocations) heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+static void printHottestPairs(const OpcodePairCounts& counts, size_t limit) {
+    std::vector<std::pair<uint64_t, std::pair<OpCode, OpCode>>> pairs;
+    for (size_t a = 0; a < counts.size(); a++) {
+        for (size_t b = 0; b < counts[a].size(); b++) {
+            if (counts[a][b]) {
+                pairs.push_back({counts[a][b], {static_cast<OpCode>(a), static_cast<OpCode>(b)}});
+            }
+        }
+    }
+    std::sort(pairs.begin(), pairs.end(), [](const auto& x, const auto& y) { return x.first > y.first; });
+
+    std::cerr << "=== Hottest opcode pairs ===" << std::endl;
+    for (size_t i = 0; i < pairs.size() && i < limit; i++) {
+        std::cerr << pairs[i].first << "\t" << opcodeName(pairs[i].second.first)
+                  << " -> " << opcodeName(pairs[i].second.second) << std::endl;
+    }
+}
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cout << "Usage: microc <file.mc> [--debug]" << std::endl;
+        std::cout << "Usage: microc <file.mc> [--debug] [--record] [--checkpoint-interval=N] [--checkpoint-memory=MB] [--tier=stack|reg] [--stats] [-O0|-O1|-O2] [--no-fold] [--no-fuse] [--no-strength-reduce] [--no-tail-calls] [--opcode-pairs] [--profile] [--trace file] [--trace-records=N] [--perf-map] [--perf-counters[=functions]] [--no-jit] [--jit-threshold=N] [--osr-threshold=N] [--tier-stats] [--flush=halt|line] [--jobs N] [--instances M] [--warm-start] [--snapshot-save file] [--snapshot-load file] [--emit-asm out.s] [-o prog]" << std::endl;
         return 1;
     }
     
@@ -23,26 +78,326 @@ int main(int argc, char* argv[]) {
     buffer << file.rdbuf();
     std::string source = buffer.str();
     
-    bool debugMode = (argc > 2 && std::string(argv[2]) == "--debug");
+    bool debugMode = false;
+    bool record = false;
+    uint64_t checkpointInterval = Recorder::kDefaultInterval;
+    size_t checkpointMemory = Recorder::kDefaultMemoryBudget;
+    bool registerTier = false;
+    bool showStats = false;
+    int optimization = 2;
+    bool fold = true;
+    bool fuse = true;
+    bool strengthReduce = true;
+    bool tailCalls = true;
+    bool pairStats = false;
+    bool profile = false;
+    std::string traceFile;
+    size_t traceRecords = size_t(1) << 20;
+    bool perfMap = false;
+    bool perfCounters = false;
+    bool perfFunctions = false;
+    bool jit = true;
+    uint32_t jitThreshold = VM::kDefaultJitThreshold;
+    uint32_t osrThreshold = VM::kDefaultOsrThreshold;
+    bool tierStats = false;
+    OutputBuffer::FlushPolicy flushPolicy = OutputBuffer::FlushPolicy::OnHalt;
+    std::string asmOutput;
+    std::string nativeOutput;
+    size_t jobs = 1;
+    size_t instances = 0;
+    bool warmStart = false;
+    std::string snapshotSave;
+    std::string snapshotLoad;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--debug") debugMode = true;
+        else if (arg == "--record") record = true;
+        else if (arg.rfind("--checkpoint-interval=", 0) == 0) {
+            checkpointInterval = std::strtoull(arg.c_str() + 22, nullptr, 10);
+        }
+        else if (arg.rfind("--checkpoint-memory=", 0) == 0) {
+            checkpointMemory = static_cast<size_t>(std::strtoull(arg.c_str() + 20, nullptr, 10)) << 20;
+        }
+        else if (arg == "--tier=reg") registerTier = true;
+        else if (arg == "--tier=stack") registerTier = false;
+        else if (arg == "--stats") showStats = true;
+        else if (arg == "-O0" || arg == "-O1" || arg == "-O2") optimization = arg[2] - '0';
+        else if (arg == "--no-fold") fold = false;
+        else if (arg == "--no-fuse") fuse = false;
+        else if (arg == "--no-strength-reduce") strengthReduce = false;
+        else if (arg == "--no-tail-calls") tailCalls = false;
+        else if (arg == "--opcode-pairs") pairStats = true;
+        else if (arg == "--profile") profile = true;
+        else if (arg == "--trace" && i + 1 < argc) traceFile = argv[++i];
+        else if (arg.rfind("--trace-records=", 0) == 0) {
+            traceRecords = std::strtoul(arg.c_str() + 16, nullptr, 10);
+        }
+        else if (arg == "--perf-map") perfMap = true;
+        else if (arg == "--perf-counters") perfCounters = true;
+        else if (arg == "--perf-counters=functions") perfCounters = perfFunctions = true;
+        else if (arg == "--no-jit") jit = false;
+        else if (arg.rfind("--jit-threshold=", 0) == 0) {
+            jitThreshold = static_cast<uint32_t>(std::strtoul(arg.c_str() + 16, nullptr, 10));
+        }
+        else if (arg.rfind("--osr-threshold=", 0) == 0) {
+            osrThreshold = static_cast<uint32_t>(std::strtoul(arg.c_str() + 16, nullptr, 10));
+        }
+        else if (arg == "--tier-stats") tierStats = true;
+        else if (arg == "--flush=halt") flushPolicy = OutputBuffer::FlushPolicy::OnHalt;
+        else if (arg == "--flush=line") flushPolicy = OutputBuffer::FlushPolicy::PerLine;
+        else if (arg == "--jobs" && i + 1 < argc) jobs = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--instances" && i + 1 < argc) instances = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--warm-start") warmStart = true;
+        else if (arg == "--snapshot-save" && i + 1 < argc) snapshotSave = argv[++i];
+        else if (arg == "--snapshot-load" && i + 1 < argc) snapshotLoad = argv[++i];
+        else if (arg == "--emit-asm" && i + 1 < argc) asmOutput = argv[++i];
+        else if (arg == "-o" && i + 1 < argc) nativeOutput = argv[++i];
+        else {
+            std::cerr << "Error: Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    countAllocations = showStats;
+    bool trace = !traceFile.empty();
+    if (optimization == 0) {
+        fold = false;
+        strengthReduce = false;
+    }
+    // The debugger shows locals by name, which optimized frames no longer
+    // have.
+    int ssaLevel = debugMode ? 0 : optimization;
+    if (record && !debugMode) {
+        std::cerr << "Error: --record requires --debug" << std::endl;
+        return 1;
+    }
+    if ((debugMode || pairStats || profile || trace) && registerTier) {
+        std::cerr << "Error: --debug, --opcode-pairs, --profile and --trace require the stack tier" << std::endl;
+        return 1;
+    }
+    bool nativeBuild = !asmOutput.empty() || !nativeOutput.empty();
+    if (jobs > 1 && instances == 0) instances = jobs;
+    if (instances > 0 && (debugMode || pairStats || profile || trace || registerTier || nativeBuild)) {
+        std::cerr << "Error: --jobs and --instances require a plain run on the stack tier" << std::endl;
+        return 1;
+    }
+    bool snapshots = warmStart || !snapshotSave.empty() || !snapshotLoad.empty();
+    if (snapshots && (debugMode || pairStats || profile || trace || registerTier || nativeBuild)) {
+        std::cerr << "Error: snapshots require a plain run on the stack tier" << std::endl;
+        return 1;
+    }
+    if ((warmStart && instances == 0) || (!snapshotSave.empty() && (instances > 0 || !snapshotLoad.empty()))) {
+        std::cerr << "Error: --warm-start needs --instances; --snapshot-save runs a single instance" << std::endl;
+        return 1;
+    }
+    bool plainRun = !(debugMode || pairStats || profile || trace || registerTier || nativeBuild || instances > 0 || snapshots);
+    if (perfCounters && !plainRun) {
+        std::cerr << "Error: --perf-counters requires a plain run on the stack tier" << std::endl;
+        return 1;
+    }
+    if (nativeBuild && (debugMode || pairStats || profile || trace || registerTier)) {
+        std::cerr << "Error: --emit-asm and -o cannot be combined with --debug, --opcode-pairs, --profile, --trace or --tier=reg"
+                  << std::endl;
+        return 1;
+    }
     
+    // Hardware counters cover the compile phase, from lexing to the verified
+    // program, and the run phase.
+    std::optional<PerfCounters> counters;
+    if (perfCounters) {
+        counters.emplace();
+        if (!counters->available()) std::cerr << "Warning: " << counters->error() << std::endl;
+    }
+    PerfSample compileStart = counters ? counters->read() : PerfSample();
+    PerfSample compileEnd;
+    PerfSample runStart;
+    std::vector<PerfSample> perFunction;
+
     try {
+        auto compileClock = std::chrono::steady_clock::now();
         Lexer lexer(source);
         auto tokens = lexer.tokenize();
         
-        Parser parser(tokens);
+        Parser parser(std::move(tokens));
         auto ast = parser.parse();
+        if (fold) {
+            foldConstants(ast);
+        }
+
+        // The stack tier's bytecode, as loaded by every stack VM and the
+        // native backend.
+        auto compileStack = [&](VM* vm) {
+            Compiler compiler(vm);
+            compiler.setOptimizationLevel(ssaLevel);
+            compiler.setTailCalls(tailCalls);
+            auto bytecode = compiler.compile(ast);
+            if (strengthReduce) {
+                reduceStrength(bytecode);
+            }
+            if (fuse) {
+                fuseSuperinstructions(bytecode);
+            }
+            return bytecode;
+        };
         
-        VM vm;
-        Compiler compiler(&vm);
-        auto bytecode = compiler.compile(ast);
-        
-        vm.loadProgram(bytecode);
-        
-        if (debugMode) {
-            Debugger debugger(&vm);
-            debugger.start();
-        } else {
+        if (nativeBuild) {
+            auto bytecode = compileStack(nullptr);
+            std::string assembly = emitNativeAssembly(bytecode);
+            std::string asmPath = asmOutput.empty() ? nativeOutput + ".s" : asmOutput;
+            std::ofstream asmFile(asmPath);
+            if (!asmFile || !(asmFile << assembly) || !asmFile.flush()) {
+                throw std::runtime_error("Cannot write " + asmPath);
+            }
+            if (!nativeOutput.empty()) {
+                linkNativeExecutable(asmPath, nativeOutput);
+                if (asmOutput.empty()) std::remove(asmPath.c_str());
+            }
+            return 0;
+        }
+
+        if (instances > 0) {
+            auto program = prepareProgram(compileStack(nullptr));
+            auto start = std::chrono::steady_clock::now();
+
+            // Instances resume from one shared snapshot instead of each
+            // running the code before the snapshot statement.
+            std::shared_ptr<const VMSnapshot> snapshot;
+            if (!snapshotLoad.empty()) {
+                snapshot = std::make_shared<VMSnapshot>(loadSnapshot(snapshotLoad));
+            } else if (warmStart) {
+                VM setup;
+                setup.getOutput().setFlushPolicy(flushPolicy);
+                setup.loadProgram(program);
+                if (!setup.runToSnapshot()) throw std::runtime_error("Program ended before a snapshot statement");
+                snapshot = std::make_shared<VMSnapshot>(setup.takeSnapshot());
+            }
+            auto results = runInstances(program, instances, jobs, [&](VM& vm) {
+                vm.setJit(jit, jitThreshold, osrThreshold);
+                vm.setPerfMap(perfMap);
+                vm.getOutput().setFlushPolicy(flushPolicy);
+                if (snapshot) vm.restore(*snapshot);
+            });
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+            uint64_t executed = 0;
+            bool failed = false;
+            for (size_t i = 0; i < results.size(); i++) {
+                std::cout.write(results[i].output.data(), static_cast<std::streamsize>(results[i].output.size()));
+                if (!results[i].error.empty()) {
+                    std::cerr << "Error: instance " << i << ": " << results[i].error << std::endl;
+                    failed = true;
+                }
+                executed += results[i].executed;
+            }
+            std::cout.flush();
+            if (showStats) {
+                std::cerr << "[stats] tier=stack instances=" << instances << " jobs=" << jobs
+                          << " instructions=" << executed << " time=" << elapsed.count() << "ms"
+                          << " throughput=" << instances * 1000.0 / elapsed.count() << "/s" << std::endl;
+            }
+            return failed ? 1 : 0;
+        }
+
+        uint64_t executed = 0;
+        size_t jitted = 0;
+        size_t codeSize = 0;
+        std::chrono::duration<double, std::milli> compileTime{};
+        uint64_t allocationsBefore = 0;
+        auto start = std::chrono::steady_clock::now();
+
+        if (registerTier) {
+            // Asm blocks run as written on this tier too, so it accepts
+            // only what the stack tier's verifier accepts.
+            Program stackProgram = compileStack(nullptr);
+            verifyProgram(stackProgram, decodeProgramAsm(stackProgram));
+
+            RegCompiler compiler;
+            compiler.setTailCalls(tailCalls);
+            compiler.setStrengthReduction(strengthReduce);
+            RegVM vm;
+            vm.getOutput().setFlushPolicy(flushPolicy);
+            RegProgram bytecode = compiler.compile(ast);
+            compileTime = std::chrono::steady_clock::now() - compileClock;
+            codeSize = bytecode.code.size();
+            vm.loadProgram(bytecode);
+            allocationsBefore = heapAllocations.load();
+            start = std::chrono::steady_clock::now();
             vm.run();
+            executed = vm.getExecutedCount();
+        } else {
+            VM vm;
+            auto bytecode = compileStack(&vm);
+            compileTime = std::chrono::steady_clock::now() - compileClock;
+            
+            // The debugger, pair counting, the profiler, tracing and
+            // per-function counters observe every instruction.
+            bool observed = debugMode || pairStats || profile || trace || perfFunctions;
+            codeSize = bytecode.code.size();
+            vm.setJit(jit && !observed, jitThreshold, osrThreshold);
+            vm.setTierStats(tierStats);
+            vm.setPerfMap(perfMap);
+            vm.getOutput().setFlushPolicy(flushPolicy);
+            vm.loadProgram(bytecode);
+            if (counters) compileEnd = runStart = counters->read();
+            
+            if (debugMode) {
+                Debugger debugger(&vm);
+                if (record) debugger.record(checkpointInterval, checkpointMemory);
+                debugger.start();
+            } else if (pairStats) {
+                OpcodePairCounts counts{};
+                vm.runCountingPairs(counts);
+                printHottestPairs(counts, 20);
+            } else if (profile) {
+                Profile result;
+                vm.runProfiled(result);
+                printProfile(result, vm.getProgram(), std::cerr);
+            } else if (trace) {
+                TraceBuffer buffer(traceRecords, traceSymbols(vm.getProgram()), traceFile);
+                allocationsBefore = heapAllocations.load();
+                start = std::chrono::steady_clock::now();
+                vm.runTraced(buffer);
+            } else if (perfFunctions) {
+                vm.runCountingPerf(*counters, perFunction);
+            } else if (!snapshotSave.empty()) {
+                if (!vm.runToSnapshot()) throw std::runtime_error("Program ended before a snapshot statement");
+                saveSnapshot(vm.takeSnapshot(), snapshotSave);
+            } else {
+                allocationsBefore = heapAllocations.load();
+                start = std::chrono::steady_clock::now();
+                if (!snapshotLoad.empty()) vm.restore(loadSnapshot(snapshotLoad));
+                vm.run();
+                if (tierStats) vm.printTierStats(std::cerr);
+            }
+            executed = vm.getExecutedCount();
+            jitted = vm.getJitCompiledCount();
+
+            if (counters) {
+                PerfSample runEnd = counters->read();
+                std::cerr << "=== Perf counters ===" << std::endl;
+                printPerfRow(std::cerr, "", PerfSample());
+                printPerfRow(std::cerr, "compile", compileEnd - compileStart);
+                printPerfRow(std::cerr, perfFunctions ? "run (interpreter)" : "run", runEnd - runStart);
+                for (size_t id = 0; id < perFunction.size(); id++) {
+                    if (perFunction[id].instructions) {
+                        printPerfRow(std::cerr, "  " + vm.getProgram().functionNames[id], perFunction[id]);
+                    }
+                }
+            }
+        }
+
+        if (showStats) {
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            struct rusage usage = {};
+            getrusage(RUSAGE_SELF, &usage);
+            std::cerr << "[stats] tier=" << (registerTier ? "reg" : "stack")
+                      << " instructions=" << executed
+                      << " code=" << codeSize
+                      << " jitted=" << jitted
+                      << " compile=" << compileTime.count() << "ms"
+                      << " time=" << elapsed.count() << "ms"
+                      << " allocations=" << heapAllocations.load() - allocationsBefore
+                      << " peak-rss=" << usage.ru_maxrss << "kB" << std::endl;
         }
         
     } catch (const std::exception& e) {
@@ -51,4 +406,4 @@ int main(int argc, char* argv[]) {
     }
     
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,430 @@
+#include "native.h"
+#include "strength.h"
+#include "verifier.h"
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+const char* const kRegisterNames[] = {"rax", "rbx", "rcx", "rdx"};
+
+bool fitsInt32(int64_t value) {
+    return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+}
+
+const char* conditionSuffix(OpCode op, bool negate) {
+    switch (op) {
+        case OpCode::CMP_EQ: case OpCode::JMP_IF_NOT_EQ: return negate ? "ne" : "e";
+        case OpCode::CMP_NEQ: case OpCode::JMP_IF_NOT_NEQ: return negate ? "e" : "ne";
+        case OpCode::CMP_LT: case OpCode::JMP_IF_NOT_LT: return negate ? "ge" : "l";
+        case OpCode::CMP_GT: case OpCode::JMP_IF_NOT_GT: return negate ? "le" : "g";
+        case OpCode::CMP_LEQ: case OpCode::JMP_IF_NOT_LEQ: return negate ? "g" : "le";
+        default: return negate ? "l" : "ge";
+    }
+}
+
+// Frame layout: [rbp-8] saved rbx, local i at [rbp-16-8*i]; the operand
+// stack grows down below the locals on rsp, which the prologue leaves
+// 16-byte aligned. Callers leave the arguments where they pushed them and
+// pass their address in rsi (a TAIL_CALL passes .Ltail); the prologue
+// copies them into the first locals.
+class NativeEmitter {
+    const Program& program;
+    const std::vector<Instruction>& code;
+    std::vector<AsmBlock> asmBlocks;
+    VerifiedProgram verified;
+    std::vector<std::string> names;
+    std::vector<bool> isTarget;
+    std::ostringstream out;
+
+    std::string local(int64_t index) {
+        return "qword ptr [rbp - " + std::to_string(16 + 8 * index) + "]";
+    }
+
+    std::string global(int64_t index) {
+        return "qword ptr [rip + .Lglobals + " + std::to_string(8 * index) + "]";
+    }
+
+    void line(const std::string& text) {
+        out << "    " << text << "\n";
+    }
+
+    void loadImmediate(const char* reg, int64_t value) {
+        line(std::string(fitsInt32(value) ? "mov " : "movabs ") + reg + ", " + std::to_string(value));
+    }
+
+    void alignForCall(int depth) {
+        if (depth % 2) line("sub rsp, 8");
+    }
+
+    void unalignAfterCall(int depth) {
+        if (depth % 2) line("add rsp, 8");
+    }
+
+    void epilogue() {
+        line("mov rbx, qword ptr [rbp - 8]");
+        line("leave");
+        line("ret");
+    }
+
+    void emitFunction(int32_t id) {
+        const FunctionInfo& fn = verified.functions[static_cast<size_t>(id)];
+        out << "\n";
+        if (id == 0) {
+            out << "    .globl main\n    .type main, @function\nmain:\n";
+        } else {
+            out << ".Lfn" << id << ":  # " << names[static_cast<size_t>(id)] << "\n";
+        }
+        line("push rbp");
+        line("mov rbp, rsp");
+        line("push rbx");
+        uint32_t slots = fn.localCount | 1;
+        line("sub rsp, " + std::to_string(8 * slots));
+        if (fn.localCount > 16) {
+            line("mov rdi, rsp");
+            line("mov ecx, " + std::to_string(slots));
+            line("xor eax, eax");
+            line("rep stosq");
+        } else {
+            for (uint32_t i = fn.paramCount; i < fn.localCount; i++) {
+                line("mov " + local(i) + ", 0");
+            }
+        }
+        for (uint32_t i = 0; i < fn.paramCount; i++) {
+            line("mov rax, qword ptr [rsi + " + std::to_string(8 * (fn.paramCount - 1 - i)) + "]");
+            line("mov " + local(i) + ", rax");
+        }
+
+        for (size_t pc = fn.entry; pc < code.size(); pc++) {
+            if (verified.owner[pc] != id) continue;
+            if (isTarget[pc]) out << ".Lpc" << pc << ":\n";
+            out << "    # " << pc << " " << opcodeName(code[pc].op) << " " << code[pc].operand << "\n";
+            emitInstruction(pc);
+        }
+    }
+
+    void emitAsmBlock(const AsmBlock& block) {
+        for (int r = 0; r < 4; r++) {
+            line(std::string("mov ") + kRegisterNames[r] + ", qword ptr [rip + .Lregs + " + std::to_string(8 * r) + "]");
+        }
+        for (const AsmOp& op : block) {
+            const char* dst = kRegisterNames[op.dst];
+            const char* src = kRegisterNames[op.src];
+            switch (op.op) {
+                case AsmOpCode::MOV_IMM:
+                    loadImmediate(dst, op.imm);
+                    break;
+                case AsmOpCode::MOV_REG:
+                    line(std::string("mov ") + dst + ", " + src);
+                    break;
+                case AsmOpCode::ADD_IMM:
+                case AsmOpCode::SUB_IMM: {
+                    const char* mnemonic = op.op == AsmOpCode::ADD_IMM ? "add " : "sub ";
+                    if (fitsInt32(op.imm)) {
+                        line(mnemonic + std::string(dst) + ", " + std::to_string(op.imm));
+                    } else {
+                        loadImmediate("r11", op.imm);
+                        line(mnemonic + std::string(dst) + ", r11");
+                    }
+                    break;
+                }
+                case AsmOpCode::ADD_REG:
+                    line(std::string("add ") + dst + ", " + src);
+                    break;
+                case AsmOpCode::SUB_REG:
+                    line(std::string("sub ") + dst + ", " + src);
+                    break;
+                case AsmOpCode::PUSH:
+                    line(std::string("push ") + dst);
+                    break;
+                case AsmOpCode::POP:
+                    line(std::string("pop ") + dst);
+                    break;
+                case AsmOpCode::INC:
+                    line(std::string("inc ") + dst);
+                    break;
+                case AsmOpCode::DEC:
+                    line(std::string("dec ") + dst);
+                    break;
+            }
+        }
+        for (int r = 0; r < 4; r++) {
+            line(std::string("mov qword ptr [rip + .Lregs + ") + std::to_string(8 * r) + "], " + kRegisterNames[r]);
+        }
+    }
+
+    void emitInstruction(size_t pc) {
+        const Instruction& inst = code[pc];
+        int64_t operand = inst.operand;
+        int depth = verified.stackHeight[pc];
+        std::string target = ".Lpc" + std::to_string(branchTarget(inst));
+
+        switch (inst.op) {
+            case OpCode::NOP:
+            case OpCode::SNAPSHOT:
+            case OpCode::BREAK:
+                break;
+            case OpCode::NEG:
+                line("neg qword ptr [rsp]");
+                break;
+            case OpCode::PUSH:
+                if (fitsInt32(operand)) {
+                    line("push " + std::to_string(operand));
+                } else {
+                    loadImmediate("rax", operand);
+                    line("push rax");
+                }
+                break;
+            case OpCode::POP:
+                line("add rsp, 8");
+                break;
+            case OpCode::ADD:
+                line("pop rcx");
+                line("add qword ptr [rsp], rcx");
+                break;
+            case OpCode::SUB:
+                line("pop rcx");
+                line("sub qword ptr [rsp], rcx");
+                break;
+            case OpCode::MUL:
+                line("pop rcx");
+                line("mov rax, qword ptr [rsp]");
+                line("imul rax, rcx");
+                line("mov qword ptr [rsp], rax");
+                break;
+            case OpCode::DIV:
+                line("pop rcx");
+                line("pop rax");
+                line("cqo");
+                line("idiv rcx");
+                line("push rax");
+                break;
+            case OpCode::CMP_EQ:
+            case OpCode::CMP_NEQ:
+            case OpCode::CMP_LT:
+            case OpCode::CMP_GT:
+            case OpCode::CMP_LEQ:
+            case OpCode::CMP_GEQ:
+                line("pop rcx");
+                line("pop rax");
+                line("cmp rax, rcx");
+                line(std::string("set") + conditionSuffix(inst.op, false) + " al");
+                line("movzx eax, al");
+                line("push rax");
+                break;
+            case OpCode::LOAD_GLOBAL:
+                line("push " + global(operand));
+                break;
+            case OpCode::STORE_GLOBAL:
+                line("pop rax");
+                line("mov " + global(operand) + ", rax");
+                break;
+            case OpCode::STORE_KEEP_GLOBAL:
+                line("mov rax, qword ptr [rsp]");
+                line("mov " + global(operand) + ", rax");
+                break;
+            case OpCode::LOAD_LOCAL:
+                line("push " + local(operand));
+                break;
+            case OpCode::STORE_LOCAL:
+                line("pop rax");
+                line("mov " + local(operand) + ", rax");
+                break;
+            case OpCode::STORE_KEEP_LOCAL:
+                line("mov rax, qword ptr [rsp]");
+                line("mov " + local(operand) + ", rax");
+                break;
+            case OpCode::ADD_IMM:
+            case OpCode::SUB_IMM: {
+                const char* mnemonic = inst.op == OpCode::ADD_IMM ? "add " : "sub ";
+                if (fitsInt32(operand)) {
+                    line(mnemonic + std::string("qword ptr [rsp], ") + std::to_string(operand));
+                } else {
+                    loadImmediate("rax", operand);
+                    line(mnemonic + std::string("qword ptr [rsp], rax"));
+                }
+                break;
+            }
+            case OpCode::SHL_IMM:
+                line("shl qword ptr [rsp], " + std::to_string(operand));
+                break;
+            case OpCode::DIV_POW2:
+                line("mov rax, qword ptr [rsp]");
+                line("mov rcx, rax");
+                line("sar rcx, 63");
+                line("shr rcx, " + std::to_string(64 - operand));
+                line("add rax, rcx");
+                line("sar rax, " + std::to_string(operand));
+                line("mov qword ptr [rsp], rax");
+                break;
+            case OpCode::DIV_MAGIC: {
+                MagicDivisor magic = magicDivisor(operand);
+                line("mov rcx, qword ptr [rsp]");
+                loadImmediate("rax", magic.multiplier);
+                line("imul rcx");
+                if (magic.correction > 0) line("add rdx, rcx");
+                if (magic.correction < 0) line("sub rdx, rcx");
+                if (magic.shift > 0) line("sar rdx, " + std::to_string(magic.shift));
+                line("mov rax, rdx");
+                line("shr rax, 63");
+                line("add rdx, rax");
+                line("mov qword ptr [rsp], rdx");
+                break;
+            }
+            case OpCode::ADD_LOCALS:
+                line("mov rax, " + local(packedLow(operand)));
+                line("add rax, " + local(packedHigh(operand)));
+                line("push rax");
+                break;
+            case OpCode::ADD_LOCAL_IMM:
+                line("mov rax, " + local(packedLow(operand)));
+                line("add rax, " + std::to_string(packedHigh(operand)));
+                line("push rax");
+                break;
+            case OpCode::JMP:
+                line("jmp " + target);
+                break;
+            case OpCode::JMP_IF_FALSE:
+                line("pop rax");
+                line("test rax, rax");
+                line("jz " + target);
+                break;
+            case OpCode::JMP_IF_NOT_EQ:
+            case OpCode::JMP_IF_NOT_NEQ:
+            case OpCode::JMP_IF_NOT_LT:
+            case OpCode::JMP_IF_NOT_GT:
+            case OpCode::JMP_IF_NOT_LEQ:
+            case OpCode::JMP_IF_NOT_GEQ:
+                line("pop rcx");
+                line("pop rax");
+                line("cmp rax, rcx");
+                line(std::string("j") + conditionSuffix(inst.op, true) + " " + target);
+                break;
+            case OpCode::CALL: {
+                int32_t callee = verified.functionAt[branchTarget(inst)];
+                int results = verified.functions[static_cast<size_t>(callee)].returnHeight;
+                int arguments = packedHigh(operand);
+                if (arguments > 0) line("mov rsi, rsp");
+                alignForCall(depth);
+                line("call .Lfn" + std::to_string(callee));
+                unalignAfterCall(depth);
+                if (arguments > 0) line("add rsp, " + std::to_string(8 * arguments));
+                if (results == 1) {
+                    line("push rax");
+                } else {
+                    for (int i = 0; i < results; i++) {
+                        line("push qword ptr [rip + .Lresults + " + std::to_string(8 * i) + "]");
+                    }
+                }
+                break;
+            }
+            case OpCode::TAIL_CALL: {
+                // The callee returns straight to our caller: the arguments
+                // wait in .Ltail while the frame is torn down.
+                int arguments = packedHigh(operand);
+                for (int i = 0; i < arguments; i++) {
+                    line("mov rax, qword ptr [rsp + " + std::to_string(8 * i) + "]");
+                    line("mov qword ptr [rip + .Ltail + " + std::to_string(8 * i) + "], rax");
+                }
+                line("mov rbx, qword ptr [rbp - 8]");
+                line("leave");
+                if (arguments > 0) line("lea rsi, [rip + .Ltail]");
+                line("jmp .Lfn" + std::to_string(verified.functionAt[branchTarget(inst)]));
+                break;
+            }
+            case OpCode::RET:
+                // Like the VM, a function hands its whole operand stack to
+                // the caller: one value in rax, otherwise through .Lresults.
+                if (depth == 1) {
+                    line("pop rax");
+                } else {
+                    for (int i = depth - 1; i >= 0; i--) {
+                        line("pop qword ptr [rip + .Lresults + " + std::to_string(8 * i) + "]");
+                    }
+                }
+                epilogue();
+                break;
+            case OpCode::PRINT:
+                line("pop rsi");
+                alignForCall(depth - 1);
+                line("lea rdi, [rip + .Lprint_format]");
+                line("xor eax, eax");
+                line("call printf@PLT");
+                unalignAfterCall(depth - 1);
+                break;
+            case OpCode::EXEC_ASM:
+                emitAsmBlock(asmBlocks[static_cast<size_t>(operand)]);
+                break;
+            case OpCode::HALT:
+                line("xor eax, eax");
+                epilogue();
+                break;
+            case OpCode::COUNT:
+                throw std::runtime_error("Native backend: invalid opcode at pc " + std::to_string(pc));
+        }
+    }
+
+public:
+    explicit NativeEmitter(const Program& prog)
+        : program(prog), code(prog.code), asmBlocks(decodeProgramAsm(prog)),
+          verified(verifyProgram(prog, asmBlocks)) {
+        names.assign(verified.functions.size(), "<top level>");
+        for (const FunctionEntry& function : program.functions) {
+            names[static_cast<size_t>(verified.functionAt[function.address])] = function.name;
+        }
+        isTarget.assign(code.size() + 1, false);
+        for (const Instruction& inst : code) {
+            if (isBranch(inst.op)) isTarget[branchTarget(inst)] = true;
+        }
+    }
+
+    std::string run() {
+        out << "    .intel_syntax noprefix\n";
+        out << "    .text\n";
+        for (size_t id = 0; id < verified.functions.size(); id++) {
+            emitFunction(static_cast<int32_t>(id));
+        }
+        out << "\n    .section .rodata\n";
+        out << ".Lprint_format:\n    .string \"%ld\\n\"\n";
+        out << "\n    .bss\n    .align 8\n";
+        out << ".Lglobals:\n    .zero " << 8 * std::max<uint32_t>(verified.globalCount, 1) << "\n";
+        out << ".Lregs:\n    .zero 32\n";
+        int results = 1;
+        uint32_t parameters = 1;
+        for (const FunctionInfo& fn : verified.functions) {
+            results = std::max(results, fn.returnHeight);
+            parameters = std::max(parameters, fn.paramCount);
+        }
+        out << ".Lresults:\n    .zero " << 8 * results << "\n";
+        out << ".Ltail:\n    .zero " << 8 * parameters << "\n";
+        out << "\n    .section .note.GNU-stack,\"\",@progbits\n";
+        return out.str();
+    }
+};
+
+std::string shellQuote(const std::string& text) {
+    std::string quoted = "'";
+    for (char c : text) {
+        if (c == '\'') quoted += "'\\''";
+        else quoted += c;
+    }
+    return quoted + "'";
+}
+
+}
+
+std::string emitNativeAssembly(const Program& program) {
+    return NativeEmitter(program).run();
+}
+
+void linkNativeExecutable(const std::string& asmPath, const std::string& outputPath) {
+    const char* cc = std::getenv("CC");
+    std::string command = std::string(cc && *cc ? cc : "gcc") + " -o " + shellQuote(outputPath) + " " +
+                          shellQuote(asmPath);
+    if (std::system(command.c_str()) != 0) {
+        throw std::runtime_error("Linking failed: " + command);
+    }
+}
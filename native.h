@@ -0,0 +1,16 @@
+#pragma once
+#include "program.h"
+#include <string>
+
+// Ahead-of-time backend: lowers verified bytecode to GNU x86-64 assembly
+// (Intel syntax, System V ABI) with `main` as the entry point, so the
+// result runs without the VM. Each MineC function becomes a native
+// function with its locals in the frame and the operand stack on rsp.
+// asm { } blocks are emitted as the real instructions, with the four
+// emulated registers loaded from and stored back to memory around them.
+// Throws std::runtime_error for programs the backend cannot express.
+std::string emitNativeAssembly(const Program& program);
+
+// Assembles and links `asmPath` into the executable `outputPath` with the
+// system C compiler ($CC, default gcc). Throws if the toolchain fails.
+void linkNativeExecutable(const std::string& asmPath, const std::string& outputPath);
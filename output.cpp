@@ -0,0 +1,110 @@
+#include "output.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <mutex>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t kMaxTracked = 64;
+std::atomic<OutputBuffer*> tracked[kMaxTracked];
+
+}
+
+OutputBuffer::OutputBuffer(size_t capacity)
+    : buffer(std::max(capacity, kMaxLine)), pos(buffer.data()), end(buffer.data() + buffer.size()),
+      fd(STDOUT_FILENO), memory(nullptr), flushPolicy(FlushPolicy::OnHalt), muted(false) {
+    track();
+}
+
+OutputBuffer::~OutputBuffer() {
+    untrack();
+    try {
+        flush();
+    } catch (const std::exception&) {
+    }
+}
+
+// Division traps (by zero, INT64_MIN / -1) and other faults kill the
+// process without unwinding, so the handler writes what each tracked buffer
+// holds and then lets the signal terminate the process as before.
+void OutputBuffer::flushOnFault(int signal) {
+    for (auto& slot : tracked) {
+        OutputBuffer* output = slot.load(std::memory_order_acquire);
+        if (!output || output->muted || output->memory) continue;
+        const char* data = output->buffer.data();
+        while (data < output->pos) {
+            ssize_t written = ::write(output->fd, data, static_cast<size_t>(output->pos - data));
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) break;
+            data += written;
+        }
+    }
+    std::signal(signal, SIG_DFL);
+    std::raise(signal);
+}
+
+void OutputBuffer::track() {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        for (int signal : {SIGFPE, SIGSEGV, SIGBUS, SIGILL}) {
+            struct sigaction action = {};
+            action.sa_handler = flushOnFault;
+            sigemptyset(&action.sa_mask);
+            sigaction(signal, &action, nullptr);
+        }
+    });
+    for (auto& slot : tracked) {
+        OutputBuffer* empty = nullptr;
+        if (slot.compare_exchange_strong(empty, this, std::memory_order_acq_rel)) return;
+    }
+}
+
+void OutputBuffer::untrack() {
+    for (auto& slot : tracked) {
+        OutputBuffer* self = this;
+        if (slot.compare_exchange_strong(self, nullptr, std::memory_order_acq_rel)) return;
+    }
+}
+
+void OutputBuffer::redirectToFd(int target) {
+    flush();
+    fd = target;
+    memory = nullptr;
+    untrack();
+    track();
+}
+
+void OutputBuffer::redirectToMemory(std::string* sink) {
+    flush();
+    memory = sink;
+    untrack();
+}
+
+void OutputBuffer::setMuted(bool enabled) {
+    flush();
+    muted = enabled;
+}
+
+void OutputBuffer::flush() {
+    const char* data = buffer.data();
+    size_t size = static_cast<size_t>(pos - data);
+    pos = buffer.data();
+    if (muted) return;
+    if (memory) {
+        memory->append(data, size);
+        return;
+    }
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("Failed to write program output");
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Buffered destination for PRINT. Values are formatted with std::to_chars
+// straight into a reusable buffer, which is written to a file descriptor
+// (stdout by default) or appended to an in-memory string when it fills up
+// and as the flush policy asks. Buffered output is flushed on destruction,
+// and buffers writing to a file descriptor also when the process dies on a
+// fault such as the SIGFPE of INT64_MIN / -1.
+class OutputBuffer {
+public:
+    enum class FlushPolicy {
+        OnHalt,   // when the program halts
+        PerLine,  // after every line, for interactive and debug runs
+        Explicit  // only when flush() is called
+    };
+
+    static constexpr size_t kDefaultCapacity = 1 << 16;
+
+    explicit OutputBuffer(size_t capacity = kDefaultCapacity);
+    ~OutputBuffer();
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    void redirectToFd(int fd);
+    void redirectToMemory(std::string* sink);
+    void setFlushPolicy(FlushPolicy policy) { flushPolicy = policy; }
+    // While muted, output is formatted as usual and then dropped (a replay
+    // re-running code whose output was already written).
+    void setMuted(bool enabled);
+
+    void printLine(int64_t value) {
+        if (static_cast<size_t>(end - pos) < kMaxLine) flush();
+        pos = std::to_chars(pos, end, value).ptr;
+        *pos++ = '\n';
+        if (flushPolicy == FlushPolicy::PerLine) flush();
+    }
+
+    void halt() {
+        if (flushPolicy != FlushPolicy::Explicit) flush();
+    }
+
+    void flush();
+
+private:
+    // Buffers writing to a file descriptor are tracked for flushOnFault,
+    // which only writes and re-raises, as a signal handler must.
+    static void flushOnFault(int signal);
+    void track();
+    void untrack();
+    // "-9223372036854775808\n"
+    static constexpr size_t kMaxLine = 21;
+
+    std::vector<char> buffer;
+    char* pos;
+    char* end;
+    int fd;
+    std::string* memory;
+    FlushPolicy flushPolicy;
+    bool muted;
+};
@@ -1,13 +1,13 @@
 #include "parser.h"
 #include <stdexcept>
 
-Parser::Parser(const std::vector<Token>& toks) : tokens(toks), pos(0) {}
+Parser::Parser(std::vector<Token> toks) : tokens(std::move(toks)), pos(0) {}
 
-Token Parser::current() {
+const Token& Parser::current() const {
     return tokens[pos];
 }
 
-Token Parser::peek(int offset) {
+const Token& Parser::peek(int offset) const {
     if (pos + offset < tokens.size()) return tokens[pos + offset];
     return tokens.back();
 }
@@ -20,7 +20,7 @@ bool Parser::match(TokenType type) {
     return false;
 }
 
-Token Parser::consume(TokenType type) {
+const Token& Parser::consume(TokenType type) {
     if (current().type != type) {
         throw std::runtime_error("Unexpected token at line " + std::to_string(current().line));
     }
@@ -43,7 +43,7 @@ ASTPtr Parser::parseDeclaration() {
     if (current().type == TokenType::INT || current().type == TokenType::VOID) {
         TokenType typeToken = current().type;
         pos++;
-        Token name = consume(TokenType::IDENTIFIER);
+        consume(TokenType::IDENTIFIER);
 
         bool isFunction = (current().type == TokenType::LPAREN);
         pos -= 2;
@@ -62,25 +62,33 @@ ASTPtr Parser::parseDeclaration() {
 
 ASTPtr Parser::parseVarDecl() {
     consume(TokenType::INT);
-    Token name = consume(TokenType::IDENTIFIER);
+    const Token& name = consume(TokenType::IDENTIFIER);
     consume(TokenType::ASSIGN);
     auto expr = parseExpr();
     consume(TokenType::SEMICOLON);
 
-    auto decl = std::make_shared<ASTNode>(ASTType::VAR_DECL, name.value);
+    auto decl = std::make_shared<ASTNode>(ASTType::VAR_DECL, name.value, name.symbol);
     decl->children.push_back(expr);
     return decl;
 }
 
 ASTPtr Parser::parseFuncDecl(TokenType returnType) {
     consume(returnType);
-    Token name = consume(TokenType::IDENTIFIER);
+    const Token& name = consume(TokenType::IDENTIFIER);
     consume(TokenType::LPAREN);
-    consume(TokenType::RPAREN);
-    auto body = parseBlock();
 
-    auto func = std::make_shared<ASTNode>(ASTType::FUNC_DECL, name.value);
-    func->children.push_back(body);
+    // Children: one IDENTIFIER per parameter, then the body.
+    auto func = std::make_shared<ASTNode>(ASTType::FUNC_DECL, name.value, name.symbol);
+    if (current().type != TokenType::RPAREN) {
+        while (true) {
+            consume(TokenType::INT);
+            const Token& param = consume(TokenType::IDENTIFIER);
+            func->children.push_back(std::make_shared<ASTNode>(ASTType::IDENTIFIER, param.value, param.symbol));
+            if (!match(TokenType::COMMA)) break;
+        }
+    }
+    consume(TokenType::RPAREN);
+    func->children.push_back(parseBlock());
     return func;
 }
 
@@ -110,6 +118,10 @@ ASTPtr Parser::parseStatement() {
             return parseReturnStatement();
         case TokenType::PRINT:
             return parsePrintStatement();
+        case TokenType::SNAPSHOT:
+            consume(TokenType::SNAPSHOT);
+            consume(TokenType::SEMICOLON);
+            return std::make_shared<ASTNode>(ASTType::SNAPSHOT);
         case TokenType::LBRACE:
             return parseBlock();
         default:
@@ -233,7 +245,7 @@ ASTPtr Parser::parseAssignment() {
         }
         consume(TokenType::ASSIGN);
         auto value = parseAssignment();
-        auto assign = std::make_shared<ASTNode>(ASTType::ASSIGN, left->value);
+        auto assign = std::make_shared<ASTNode>(ASTType::ASSIGN, left->value, left->symbol);
         assign->children.push_back(value);
         return assign;
     }
@@ -245,13 +257,9 @@ ASTPtr Parser::parseEquality() {
     auto left = parseComparison();
 
     while (current().type == TokenType::EQ || current().type == TokenType::NEQ) {
-        Token op = current();
+        const Token& op = current();
         pos++;
-        auto right = parseComparison();
-        auto binOp = std::make_shared<ASTNode>(ASTType::BINARY_OP, op.value);
-        binOp->children.push_back(left);
-        binOp->children.push_back(right);
-        left = binOp;
+        left = binary(op, left, parseComparison());
     }
 
     return left;
@@ -262,13 +270,9 @@ ASTPtr Parser::parseComparison() {
 
     while (current().type == TokenType::LT || current().type == TokenType::LEQ ||
            current().type == TokenType::GT || current().type == TokenType::GEQ) {
-        Token op = current();
+        const Token& op = current();
         pos++;
-        auto right = parseTerm();
-        auto binOp = std::make_shared<ASTNode>(ASTType::BINARY_OP, op.value);
-        binOp->children.push_back(left);
-        binOp->children.push_back(right);
-        left = binOp;
+        left = binary(op, left, parseTerm());
     }
 
     return left;
@@ -278,13 +282,9 @@ ASTPtr Parser::parseTerm() {
     auto left = parseFactor();
 
     while (current().type == TokenType::PLUS || current().type == TokenType::MINUS) {
-        Token op = current();
+        const Token& op = current();
         pos++;
-        auto right = parseFactor();
-        auto binOp = std::make_shared<ASTNode>(ASTType::BINARY_OP, op.value);
-        binOp->children.push_back(left);
-        binOp->children.push_back(right);
-        left = binOp;
+        left = binary(op, left, parseFactor());
     }
 
     return left;
@@ -294,13 +294,9 @@ ASTPtr Parser::parseFactor() {
     auto left = parseUnary();
 
     while (current().type == TokenType::STAR || current().type == TokenType::SLASH) {
-        Token op = current();
+        const Token& op = current();
         pos++;
-        auto right = parseUnary();
-        auto binOp = std::make_shared<ASTNode>(ASTType::BINARY_OP, op.value);
-        binOp->children.push_back(left);
-        binOp->children.push_back(right);
-        left = binOp;
+        left = binary(op, left, parseUnary());
     }
 
     return left;
@@ -308,13 +304,9 @@ ASTPtr Parser::parseFactor() {
 
 ASTPtr Parser::parseUnary() {
     if (current().type == TokenType::MINUS) {
-        consume(TokenType::MINUS);
+        const Token& minus = consume(TokenType::MINUS);
         auto right = parseUnary();
-        auto zero = std::make_shared<ASTNode>(ASTType::NUMBER, "0");
-        auto binOp = std::make_shared<ASTNode>(ASTType::BINARY_OP, "-");
-        binOp->children.push_back(zero);
-        binOp->children.push_back(right);
-        return binOp;
+        return binary(minus, std::make_shared<ASTNode>(ASTType::NUMBER, "0"), right);
     }
     return parsePrimary();
 }
@@ -327,12 +319,12 @@ ASTPtr Parser::parsePrimary() {
     }
 
     if (current().type == TokenType::IDENTIFIER) {
-        Token id = current();
+        const Token& id = current();
         pos++;
         if (current().type == TokenType::LPAREN) {
-            return finishCall(id.value);
+            return finishCall(id);
         }
-        return std::make_shared<ASTNode>(ASTType::IDENTIFIER, id.value);
+        return std::make_shared<ASTNode>(ASTType::IDENTIFIER, id.value, id.symbol);
     }
 
     if (current().type == TokenType::LPAREN) {
@@ -345,9 +337,17 @@ ASTPtr Parser::parsePrimary() {
     throw std::runtime_error("Unexpected token in expression");
 }
 
-ASTPtr Parser::finishCall(const std::string& name) {
+ASTPtr Parser::binary(const Token& op, ASTPtr left, ASTPtr right) {
+    auto node = std::make_shared<ASTNode>(ASTType::BINARY_OP, op.value);
+    node->op = op.type;
+    node->children.push_back(std::move(left));
+    node->children.push_back(std::move(right));
+    return node;
+}
+
+ASTPtr Parser::finishCall(const Token& name) {
     consume(TokenType::LPAREN);
-    auto call = std::make_shared<ASTNode>(ASTType::CALL, name);
+    auto call = std::make_shared<ASTNode>(ASTType::CALL, name.value, name.symbol);
 
     if (current().type != TokenType::RPAREN) {
         while (true) {
@@ -7,10 +7,10 @@ class Parser {
     std::vector<Token> tokens;
     size_t pos;
     
-    Token current();
-    Token peek(int offset = 1);
+    const Token& current() const;
+    const Token& peek(int offset = 1) const;
     bool match(TokenType type);
-    Token consume(TokenType type);
+    const Token& consume(TokenType type);
     
     ASTPtr parseProgram();
     ASTPtr parseDeclaration();
@@ -32,9 +32,10 @@ class Parser {
     ASTPtr parseFactor();
     ASTPtr parseUnary();
     ASTPtr parsePrimary();
-    ASTPtr finishCall(const std::string& name);
+    ASTPtr finishCall(const Token& name);
+    ASTPtr binary(const Token& op, ASTPtr left, ASTPtr right);
     
 public:
-    Parser(const std::vector<Token>& toks);
+    Parser(std::vector<Token> toks);
     ASTPtr parse();
 };
\ No newline at end of file
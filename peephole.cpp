@@ -0,0 +1,132 @@
+#include "peephole.h"
+#include <limits>
+
+namespace {
+
+bool fitsInt32(int64_t value) {
+    return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+}
+
+bool isLocalIndex(int64_t value) {
+    return value >= 0 && value <= std::numeric_limits<int32_t>::max();
+}
+
+bool always(const Instruction*) {
+    return true;
+}
+
+bool sameOperand(const Instruction* w) {
+    return w[0].operand == w[1].operand;
+}
+
+bool localAndImmediate(const Instruction* w) {
+    return isLocalIndex(w[0].operand) && fitsInt32(w[1].operand);
+}
+
+bool localAndNegatedImmediate(const Instruction* w) {
+    return isLocalIndex(w[0].operand) && fitsInt32(w[1].operand) &&
+           w[1].operand != std::numeric_limits<int32_t>::min();
+}
+
+int64_t firstOperand(const Instruction* w) {
+    return w[0].operand;
+}
+
+int64_t secondOperand(const Instruction* w) {
+    return w[1].operand;
+}
+
+int64_t packLocalAndSecond(const Instruction* w) {
+    return packOperands(static_cast<uint32_t>(w[0].operand), static_cast<int32_t>(w[1].operand));
+}
+
+int64_t packLocalAndNegatedSecond(const Instruction* w) {
+    return packOperands(static_cast<uint32_t>(w[0].operand), static_cast<int32_t>(-w[1].operand));
+}
+
+std::vector<FusionRule> buildDefaultRules() {
+    return {
+        // `x = expr;` as a statement compiles to STORE x, LOAD x, POP.
+        {{OpCode::STORE_LOCAL, OpCode::LOAD_LOCAL, OpCode::POP}, OpCode::STORE_LOCAL, sameOperand, firstOperand},
+        {{OpCode::STORE_GLOBAL, OpCode::LOAD_GLOBAL, OpCode::POP}, OpCode::STORE_GLOBAL, sameOperand, firstOperand},
+        {{OpCode::LOAD_LOCAL, OpCode::LOAD_LOCAL, OpCode::ADD}, OpCode::ADD_LOCALS,
+         [](const Instruction* w) { return isLocalIndex(w[0].operand) && isLocalIndex(w[1].operand); },
+         packLocalAndSecond},
+        {{OpCode::LOAD_LOCAL, OpCode::PUSH, OpCode::ADD}, OpCode::ADD_LOCAL_IMM, localAndImmediate, packLocalAndSecond},
+        {{OpCode::LOAD_LOCAL, OpCode::PUSH, OpCode::SUB}, OpCode::ADD_LOCAL_IMM, localAndNegatedImmediate,
+         packLocalAndNegatedSecond},
+        {{OpCode::STORE_LOCAL, OpCode::LOAD_LOCAL}, OpCode::STORE_KEEP_LOCAL, sameOperand, firstOperand},
+        {{OpCode::STORE_GLOBAL, OpCode::LOAD_GLOBAL}, OpCode::STORE_KEEP_GLOBAL, sameOperand, firstOperand},
+        {{OpCode::PUSH, OpCode::ADD}, OpCode::ADD_IMM, always, firstOperand},
+        {{OpCode::PUSH, OpCode::SUB}, OpCode::SUB_IMM, always, firstOperand},
+        {{OpCode::CMP_EQ, OpCode::JMP_IF_FALSE}, OpCode::JMP_IF_NOT_EQ, always, secondOperand},
+        {{OpCode::CMP_NEQ, OpCode::JMP_IF_FALSE}, OpCode::JMP_IF_NOT_NEQ, always, secondOperand},
+        {{OpCode::CMP_LT, OpCode::JMP_IF_FALSE}, OpCode::JMP_IF_NOT_LT, always, secondOperand},
+        {{OpCode::CMP_GT, OpCode::JMP_IF_FALSE}, OpCode::JMP_IF_NOT_GT, always, secondOperand},
+        {{OpCode::CMP_LEQ, OpCode::JMP_IF_FALSE}, OpCode::JMP_IF_NOT_LEQ, always, secondOperand},
+        {{OpCode::CMP_GEQ, OpCode::JMP_IF_FALSE}, OpCode::JMP_IF_NOT_GEQ, always, secondOperand},
+    };
+}
+
+}
+
+const std::vector<FusionRule>& defaultFusionRules() {
+    static const std::vector<FusionRule> rules = buildDefaultRules();
+    return rules;
+}
+
+void fuseSuperinstructions(Program& program, const std::vector<FusionRule>& rules) {
+    const std::vector<Instruction>& code = program.code;
+    size_t size = code.size();
+
+    std::vector<bool> isTarget(size + 1, false);
+    for (const Instruction& inst : code) {
+        if (isBranch(inst.op) && inst.operand >= 0 && branchTarget(inst) <= size) {
+            isTarget[branchTarget(inst)] = true;
+        }
+    }
+
+    std::vector<Instruction> fused;
+    fused.reserve(size);
+    std::vector<size_t> remap(size + 1, 0);
+
+    size_t pc = 0;
+    while (pc < size) {
+        const FusionRule* applied = nullptr;
+        for (const FusionRule& rule : rules) {
+            size_t length = rule.pattern.size();
+            if (pc + length > size) continue;
+
+            bool match = true;
+            for (size_t i = 0; i < length && match; i++) {
+                match = code[pc + i].op == rule.pattern[i] && (i == 0 || !isTarget[pc + i]);
+            }
+            if (match && rule.matches(&code[pc])) {
+                applied = &rule;
+                break;
+            }
+        }
+
+        size_t length = applied ? applied->pattern.size() : 1;
+        for (size_t i = 0; i < length; i++) {
+            remap[pc + i] = fused.size();
+        }
+        fused.push_back(applied ? Instruction(applied->result, applied->operand(&code[pc])) : code[pc]);
+        pc += length;
+    }
+    remap[size] = fused.size();
+
+    // Out-of-range targets stay as they are: fusion only shrinks the code,
+    // so they remain out of range and the verifier still rejects them.
+    for (Instruction& inst : fused) {
+        if (isBranch(inst.op) && inst.operand >= 0 && branchTarget(inst) <= size) {
+            setBranchTarget(inst, remap[branchTarget(inst)]);
+        }
+    }
+
+    for (FunctionEntry& function : program.functions) {
+        if (function.address <= size) function.address = remap[function.address];
+    }
+
+    program.code = std::move(fused);
+}
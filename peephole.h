@@ -0,0 +1,23 @@
+#pragma once
+#include "program.h"
+#include <vector>
+
+// A fusion rule rewrites a run of adjacent instructions matching `pattern`
+// into a single `result` instruction whose operand is computed from the
+// window. `matches` may reject a window based on its operands (e.g.
+// immediates that do not fit a packed operand).
+struct FusionRule {
+    std::vector<OpCode> pattern;
+    OpCode result;
+    bool (*matches)(const Instruction* window);
+    int64_t (*operand)(const Instruction* window);
+};
+
+// The rule set picked from the hottest fall-through opcode pairs on the
+// bench/ workloads (see --opcode-pairs). Longer patterns come first.
+const std::vector<FusionRule>& defaultFusionRules();
+
+// Rewrites the program in place, greedily applying the first matching rule
+// at each position. Windows never span a jump target, and every branch
+// operand is remapped to the fused layout.
+void fuseSuperinstructions(Program& program, const std::vector<FusionRule>& rules = defaultFusionRules());
@@ -0,0 +1,126 @@
+#include "perf.h"
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define MINEC_PERF_EVENTS 1
+#endif
+
+void writePerfMapEntry(const void* start, size_t size, const std::string& name) {
+    static std::mutex lock;
+    static FILE* map = nullptr;
+    std::lock_guard<std::mutex> guard(lock);
+    if (!map) {
+        std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        map = std::fopen(path.c_str(), "a");
+        if (!map) throw std::runtime_error("Cannot write " + path);
+    }
+    std::fprintf(map, "%" PRIxPTR " %zx %s\n", reinterpret_cast<uintptr_t>(start), size, name.c_str());
+    std::fflush(map);
+}
+
+void printPerfRow(std::ostream& out, const std::string& label, const PerfSample& sample) {
+    if (label.empty()) {
+        out << std::left << std::setw(24) << "" << std::right << std::setw(16) << "cycles" << std::setw(16)
+            << "instructions" << std::setw(8) << "IPC" << std::setw(16) << "branch-misses" << std::setw(16)
+            << "cache-misses" << std::endl;
+        return;
+    }
+    double ipc = sample.cycles ? static_cast<double>(sample.instructions) / static_cast<double>(sample.cycles) : 0;
+    out << std::left << std::setw(24) << label << std::right << std::setw(16) << sample.cycles << std::setw(16)
+        << sample.instructions << std::setw(8) << std::fixed << std::setprecision(2) << ipc << std::defaultfloat
+        << std::setw(16) << sample.branchMisses << std::setw(16) << sample.cacheMisses << std::endl;
+}
+
+PerfCounters::~PerfCounters() {
+    closeAll();
+}
+
+PerfSample PerfSample::operator-(const PerfSample& other) const {
+    return {cycles - other.cycles, instructions - other.instructions, branchMisses - other.branchMisses,
+            cacheMisses - other.cacheMisses};
+}
+
+PerfSample& PerfSample::operator+=(const PerfSample& other) {
+    cycles += other.cycles;
+    instructions += other.instructions;
+    branchMisses += other.branchMisses;
+    cacheMisses += other.cacheMisses;
+    return *this;
+}
+
+#ifdef MINEC_PERF_EVENTS
+static int openCounter(uint64_t config, int group) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+}
+
+PerfCounters::PerfCounters() : leader(-1), members{-1, -1, -1} {
+    leader = openCounter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    const uint64_t events[3] = {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+                                PERF_COUNT_HW_CACHE_MISSES};
+    for (int i = 0; i < 3 && leader >= 0; i++) {
+        members[i] = openCounter(events[i], leader);
+        if (members[i] < 0) {
+            int saved = errno;
+            closeAll();
+            errno = saved;
+        }
+    }
+    if (leader < 0) {
+        failure = std::string("perf_event_open: ") + std::strerror(errno);
+        return;
+    }
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+void PerfCounters::closeAll() {
+    for (int& fd : members) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+    if (leader >= 0) close(leader);
+    leader = -1;
+}
+
+PerfSample PerfCounters::read() const {
+    PerfSample sample;
+    if (leader < 0) return sample;
+    // PERF_FORMAT_GROUP: the number of events, then one value per event in
+    // the order they joined the group.
+    uint64_t values[5] = {};
+    if (::read(leader, values, sizeof(values)) < static_cast<ssize_t>(sizeof(values))) return sample;
+    sample.cycles = values[1];
+    sample.instructions = values[2];
+    sample.branchMisses = values[3];
+    sample.cacheMisses = values[4];
+    return sample;
+}
+#else
+PerfCounters::PerfCounters() : leader(-1), members{-1, -1, -1}, failure("hardware counters need Linux") {}
+
+void PerfCounters::closeAll() {}
+
+PerfSample PerfCounters::read() const {
+    return PerfSample();
+}
+#endif
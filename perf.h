@@ -0,0 +1,46 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+// Appends "start size name" to /tmp/perf-<pid>.map, which `perf report`
+// reads to name code it finds outside any mapped file. Safe to call from
+// several threads; throws if the file cannot be written.
+void writePerfMapEntry(const void* start, size_t size, const std::string& name);
+
+struct PerfSample {
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t branchMisses = 0;
+    uint64_t cacheMisses = 0;
+
+    PerfSample operator-(const PerfSample& other) const;
+    PerfSample& operator+=(const PerfSample& other);
+};
+
+// Prints one row of a counter table, with instructions per cycle; pass an
+// empty label for the header.
+void printPerfRow(std::ostream& out, const std::string& label, const PerfSample& sample);
+
+// User-space hardware counters of the calling thread, opened as one
+// perf_event_open group so all four are read together. available() is
+// false (and error() says why) where the kernel or its
+// perf_event_paranoid setting refuses them; read() then returns zeros.
+class PerfCounters {
+    int leader;
+    int members[3];
+    std::string failure;
+
+    void closeAll();
+
+public:
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const { return leader >= 0; }
+    const std::string& error() const { return failure; }
+    PerfSample read() const;
+};
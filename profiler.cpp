@@ -0,0 +1,117 @@
+#include "profiler.h"
+#include "vm.h"
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <ostream>
+
+namespace {
+
+double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * static_cast<double>(part) / static_cast<double>(whole) : 0.0;
+}
+
+double millis(uint64_t nanos) {
+    return static_cast<double>(nanos) / 1e6;
+}
+
+void printInstruction(const Instruction& inst, std::ostream& out) {
+    out << opcodeName(inst.op);
+    switch (inst.op) {
+        case OpCode::PUSH: case OpCode::STORE_GLOBAL: case OpCode::LOAD_GLOBAL: case OpCode::STORE_LOCAL:
+        case OpCode::LOAD_LOCAL: case OpCode::JMP: case OpCode::JMP_IF_FALSE:
+        case OpCode::EXEC_ASM: case OpCode::ADD_IMM: case OpCode::SUB_IMM: case OpCode::STORE_KEEP_LOCAL:
+        case OpCode::STORE_KEEP_GLOBAL: case OpCode::JMP_IF_NOT_EQ: case OpCode::JMP_IF_NOT_NEQ:
+        case OpCode::JMP_IF_NOT_LT: case OpCode::JMP_IF_NOT_GT: case OpCode::JMP_IF_NOT_LEQ:
+        case OpCode::JMP_IF_NOT_GEQ: case OpCode::SHL_IMM: case OpCode::DIV_POW2: case OpCode::DIV_MAGIC:
+            out << " " << inst.operand;
+            break;
+        case OpCode::ADD_LOCALS: case OpCode::ADD_LOCAL_IMM: case OpCode::CALL: case OpCode::TAIL_CALL:
+            out << " " << packedLow(inst.operand) << " " << packedHigh(inst.operand);
+            break;
+        default:
+            break;
+    }
+}
+
+}
+
+void printProfile(const Profile& profile, const LoadedProgram& program, std::ostream& out) {
+    const std::vector<Instruction>& code = program.code;
+    const VerifiedProgram& verified = program.verified;
+    const size_t opcodes = static_cast<size_t>(OpCode::COUNT);
+
+    uint64_t totalHits = 0;
+    uint64_t totalNanos = 0;
+    std::array<uint64_t, opcodes> opHits{};
+    std::array<uint64_t, opcodes> opNanos{};
+    std::vector<uint64_t> exclusive(verified.functions.size(), 0);
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        size_t op = static_cast<size_t>(code[pc].op);
+        totalHits += profile.hits[pc];
+        totalNanos += profile.nanos[pc];
+        opHits[op] += profile.hits[pc];
+        opNanos[op] += profile.nanos[pc];
+        if (verified.owner[pc] >= 0) exclusive[static_cast<size_t>(verified.owner[pc])] += profile.hits[pc];
+    }
+
+    out << std::fixed << std::setprecision(3);
+    out << "=== Profile ===" << std::endl;
+    out << totalHits << " instructions, " << millis(totalNanos) << " ms" << std::endl;
+
+    out << std::endl << "--- Opcodes (by time) ---" << std::endl;
+    out << std::left << std::setw(20) << "opcode" << std::right << std::setw(14) << "count"
+        << std::setw(12) << "ms" << std::setw(9) << "time%" << std::setw(10) << "ns/op" << std::endl;
+    std::vector<size_t> order;
+    for (size_t op = 0; op < opcodes; op++) {
+        if (opHits[op]) order.push_back(op);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return opNanos[a] > opNanos[b]; });
+    for (size_t op : order) {
+        out << std::left << std::setw(20) << opcodeName(static_cast<OpCode>(op)) << std::right
+            << std::setw(14) << opHits[op] << std::setw(12) << millis(opNanos[op])
+            << std::setw(9) << percent(opNanos[op], totalNanos)
+            << std::setw(10) << static_cast<double>(opNanos[op]) / static_cast<double>(opHits[op]) << std::endl;
+    }
+
+    out << std::endl << "--- Functions (instructions) ---" << std::endl;
+    out << std::left << std::setw(20) << "function" << std::right << std::setw(12) << "calls"
+        << std::setw(14) << "exclusive" << std::setw(9) << "excl%" << std::setw(14) << "inclusive"
+        << std::setw(9) << "incl%" << std::endl;
+    for (size_t id = 0; id < verified.functions.size(); id++) {
+        if (!profile.calls[id]) continue;
+        out << std::left << std::setw(20) << program.functionNames[id] << std::right
+            << std::setw(12) << profile.calls[id] << std::setw(14) << exclusive[id]
+            << std::setw(9) << percent(exclusive[id], totalHits) << std::setw(14) << profile.inclusive[id]
+            << std::setw(9) << percent(profile.inclusive[id], totalHits) << std::endl;
+    }
+
+    bool anyAsm = false;
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        if (code[pc].op != OpCode::EXEC_ASM || !profile.hits[pc]) continue;
+        if (!anyAsm) {
+            out << std::endl << "--- Asm blocks ---" << std::endl;
+            out << std::setw(8) << "pc" << std::setw(12) << "runs" << std::setw(8) << "ops"
+                << std::setw(12) << "ms" << std::setw(9) << "time%" << std::setw(10) << "ns/run" << std::endl;
+            anyAsm = true;
+        }
+        size_t block = static_cast<size_t>(code[pc].operand);
+        out << std::setw(8) << pc << std::setw(12) << profile.hits[pc]
+            << std::setw(8) << program.asmBlocks[block].size() << std::setw(12) << millis(profile.nanos[pc])
+            << std::setw(9) << percent(profile.nanos[pc], totalNanos)
+            << std::setw(10) << static_cast<double>(profile.nanos[pc]) / static_cast<double>(profile.hits[pc])
+            << std::endl;
+    }
+
+    out << std::endl << "--- Listing ---" << std::endl;
+    out << std::setw(8) << "pc" << std::setw(14) << "hits" << std::setw(12) << "ms" << "  instruction" << std::endl;
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        int32_t function = verified.functionAt[pc];
+        if (function >= 0) out << program.functionNames[static_cast<size_t>(function)] << ":" << std::endl;
+        out << std::setw(8) << pc << std::setw(14) << profile.hits[pc] << std::setw(12) << millis(profile.nanos[pc])
+            << "  ";
+        printInstruction(code[pc], out);
+        out << std::endl;
+    }
+    out << std::defaultfloat;
+}
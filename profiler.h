@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+struct LoadedProgram;
+
+// Filled by VM::runProfiled(). Opcode, function and asm block figures are
+// all derived from the per-pc counters when the report is printed. Times
+// are those of the checked switch interpreter, less the clock's own cost.
+struct Profile {
+    // Per pc: times executed and nanoseconds spent in it.
+    std::vector<uint64_t> hits;
+    std::vector<uint64_t> nanos;
+    // Per function id (0 is the top-level code): calls, and instructions
+    // executed while it was active, callees included. Recursive calls are
+    // counted once, from the outermost activation.
+    std::vector<uint64_t> calls;
+    std::vector<uint64_t> inclusive;
+};
+
+// Prints per-opcode, per-function and per-asm-block tables followed by
+// the bytecode listing annotated with hit counts and time.
+void printProfile(const Profile& profile, const LoadedProgram& program, std::ostream& out);
@@ -0,0 +1,104 @@
+#include "program.h"
+#include <stdexcept>
+
+const char* opcodeName(OpCode op) {
+    switch (op) {
+        case OpCode::NOP: return "NOP";
+        case OpCode::PUSH: return "PUSH";
+        case OpCode::POP: return "POP";
+        case OpCode::ADD: return "ADD";
+        case OpCode::SUB: return "SUB";
+        case OpCode::MUL: return "MUL";
+        case OpCode::DIV: return "DIV";
+        case OpCode::NEG: return "NEG";
+        case OpCode::STORE_GLOBAL: return "STORE_GLOBAL";
+        case OpCode::LOAD_GLOBAL: return "LOAD_GLOBAL";
+        case OpCode::STORE_LOCAL: return "STORE_LOCAL";
+        case OpCode::LOAD_LOCAL: return "LOAD_LOCAL";
+        case OpCode::CMP_EQ: return "CMP_EQ";
+        case OpCode::CMP_NEQ: return "CMP_NEQ";
+        case OpCode::CMP_LT: return "CMP_LT";
+        case OpCode::CMP_GT: return "CMP_GT";
+        case OpCode::CMP_LEQ: return "CMP_LEQ";
+        case OpCode::CMP_GEQ: return "CMP_GEQ";
+        case OpCode::JMP: return "JMP";
+        case OpCode::JMP_IF_FALSE: return "JMP_IF_FALSE";
+        case OpCode::CALL: return "CALL";
+        case OpCode::RET: return "RET";
+        case OpCode::TAIL_CALL: return "TAIL_CALL";
+        case OpCode::PRINT: return "PRINT";
+        case OpCode::EXEC_ASM: return "EXEC_ASM";
+        case OpCode::HALT: return "HALT";
+        case OpCode::SNAPSHOT: return "SNAPSHOT";
+        case OpCode::BREAK: return "BREAK";
+        case OpCode::ADD_IMM: return "ADD_IMM";
+        case OpCode::SUB_IMM: return "SUB_IMM";
+        case OpCode::ADD_LOCALS: return "ADD_LOCALS";
+        case OpCode::ADD_LOCAL_IMM: return "ADD_LOCAL_IMM";
+        case OpCode::STORE_KEEP_LOCAL: return "STORE_KEEP_LOCAL";
+        case OpCode::STORE_KEEP_GLOBAL: return "STORE_KEEP_GLOBAL";
+        case OpCode::JMP_IF_NOT_EQ: return "JMP_IF_NOT_EQ";
+        case OpCode::JMP_IF_NOT_NEQ: return "JMP_IF_NOT_NEQ";
+        case OpCode::JMP_IF_NOT_LT: return "JMP_IF_NOT_LT";
+        case OpCode::JMP_IF_NOT_GT: return "JMP_IF_NOT_GT";
+        case OpCode::JMP_IF_NOT_LEQ: return "JMP_IF_NOT_LEQ";
+        case OpCode::JMP_IF_NOT_GEQ: return "JMP_IF_NOT_GEQ";
+        case OpCode::SHL_IMM: return "SHL_IMM";
+        case OpCode::DIV_POW2: return "DIV_POW2";
+        case OpCode::DIV_MAGIC: return "DIV_MAGIC";
+        case OpCode::COUNT: break;
+    }
+    return "UNKNOWN";
+}
+
+bool isBranch(OpCode op) {
+    switch (op) {
+        case OpCode::JMP:
+        case OpCode::JMP_IF_FALSE:
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+        case OpCode::JMP_IF_NOT_EQ:
+        case OpCode::JMP_IF_NOT_NEQ:
+        case OpCode::JMP_IF_NOT_LT:
+        case OpCode::JMP_IF_NOT_GT:
+        case OpCode::JMP_IF_NOT_LEQ:
+        case OpCode::JMP_IF_NOT_GEQ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool isCall(OpCode op) {
+    return op == OpCode::CALL || op == OpCode::TAIL_CALL;
+}
+
+size_t branchTarget(const Instruction& inst) {
+    if (isCall(inst.op)) return packedLow(inst.operand);
+    return static_cast<size_t>(inst.operand);
+}
+
+void setBranchTarget(Instruction& inst, size_t target) {
+    if (isCall(inst.op)) {
+        inst.operand = callOperand(target, static_cast<uint32_t>(packedHigh(inst.operand)));
+    } else {
+        inst.operand = static_cast<int64_t>(target);
+    }
+}
+
+std::vector<AsmBlock> decodeProgramAsm(const Program& program) {
+    std::vector<AsmBlock> blocks(program.strings.size());
+    for (size_t i = 0; i < program.code.size(); i++) {
+        if (program.code[i].op != OpCode::EXEC_ASM) continue;
+        size_t index = static_cast<size_t>(program.code[i].operand);
+        if (index >= program.strings.size()) {
+            throw std::runtime_error("Invalid asm block reference at pc " + std::to_string(i));
+        }
+        try {
+            blocks[index] = decodeAsm(program.strings[index]);
+        } catch (const std::exception& e) {
+            throw std::runtime_error("Invalid asm block at pc " + std::to_string(i) + ": " + e.what());
+        }
+    }
+    return blocks;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "asm.h"
+#include "token.h"
+#include <string>
+#include <vector>
+
+struct FunctionEntry {
+    std::string name;
+    size_t address;
+    uint32_t frameSize;
+    // Parameters occupy the first paramCount local slots.
+    uint32_t paramCount;
+    // Name of each local slot, for the debugger.
+    std::vector<std::string> localNames;
+};
+
+// A compiled program: flat bytecode plus the pool of string constants
+// (asm block sources) that instructions refer to by index, the entry point
+// and local frame size of every function, and the number of globals.
+struct Program {
+    std::vector<Instruction> code;
+    std::vector<std::string> strings;
+    std::vector<FunctionEntry> functions;
+    uint32_t globalCount = 0;
+    std::vector<std::string> globalNames;
+};
+
+const char* opcodeName(OpCode op);
+
+// True for instructions whose operand is a code address.
+bool isBranch(OpCode op);
+
+// CALL or TAIL_CALL.
+bool isCall(OpCode op);
+
+// A CALL or TAIL_CALL operand packs the callee's address (low half) with the number of
+// arguments on top of the operand stack (high half).
+inline int64_t callOperand(size_t address, uint32_t argumentCount) {
+    return packOperands(static_cast<uint32_t>(address), static_cast<int32_t>(argumentCount));
+}
+
+// The code address a branch refers to, and replacing it in place.
+size_t branchTarget(const Instruction& inst);
+void setBranchTarget(Instruction& inst, size_t target);
+
+// Decodes every asm block an EXEC_ASM refers to, indexed like
+// program.strings. Throws naming the pc of a bad reference or block.
+std::vector<AsmBlock> decodeProgramAsm(const Program& program);
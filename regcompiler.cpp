@@ -0,0 +1,452 @@
+#include "regcompiler.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+static bool isImmediate(const ASTPtr& node, int32_t& value) {
+    if (node->type != ASTType::NUMBER) return false;
+    int64_t v = std::stoll(node->value);
+    if (v < std::numeric_limits<int32_t>::min() || v > std::numeric_limits<int32_t>::max()) {
+        return false;
+    }
+    value = static_cast<int32_t>(v);
+    return true;
+}
+
+static bool hasSideEffects(const ASTPtr& node) {
+    if (node->type == ASTType::CALL || node->type == ASTType::ASSIGN) return true;
+    for (auto& child : node->children) {
+        if (hasSideEffects(child)) return true;
+    }
+    return false;
+}
+
+static bool isComparison(TokenType op) {
+    return op == TokenType::EQ || op == TokenType::NEQ || op == TokenType::LT || op == TokenType::LEQ ||
+           op == TokenType::GT || op == TokenType::GEQ;
+}
+
+RegCompiler::RegCompiler() : tailCalls(true), strengthReduction(true) {
+    reset();
+}
+
+void RegCompiler::reset() {
+    program = RegProgram();
+    scopes.clear();
+    functionStack.clear();
+    functionIndices.clear();
+    functionNames.clear();
+    functionDefined.clear();
+    mainIndex = -1;
+    callArguments.clear();
+    tempTop = 0;
+    maxRegister = -1;
+    scopes.enterScope();
+    functionStack.push_back({"__global", false, 0, {}});
+}
+
+size_t RegCompiler::emit(RegOp op, int32_t a, int32_t b, int32_t c) {
+    program.code.emplace_back(op, a, b, c);
+    return program.code.size() - 1;
+}
+
+void RegCompiler::emitConstant(int dst, int64_t value) {
+    if (value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max()) {
+        emit(RegOp::LOADI, dst, static_cast<int32_t>(value));
+    } else {
+        program.constants.push_back(value);
+        emit(RegOp::LOADK, dst, static_cast<int32_t>(program.constants.size() - 1));
+    }
+}
+
+void RegCompiler::beginStatement() {
+    tempTop = functionStack.back().nextLocalIndex;
+}
+
+int RegCompiler::allocTemp() {
+    int reg = tempTop++;
+    maxRegister = std::max(maxRegister, reg);
+    return frameSlot(reg);
+}
+
+bool RegCompiler::isTemp(int slot) const {
+    return !(slot & 1) && (slot >> 1) >= functionStack.back().nextLocalIndex;
+}
+
+int RegCompiler::slotOf(const ASTPtr& node) {
+    const VariableInfo* info = scopes.find(node->symbol);
+    if (!info) throw std::runtime_error("Undefined variable '" + node->value + "'");
+    return info->isGlobal ? globalSlot(info->index) : frameSlot(info->index);
+}
+
+int RegCompiler::functionIndex(const ASTPtr& node) {
+    if (node->symbol >= functionIndices.size()) functionIndices.resize(node->symbol + 1, -1);
+    int& index = functionIndices[node->symbol];
+    if (index >= 0) return index;
+    index = static_cast<int>(program.functions.size());
+    program.functions.push_back({0, 0, 0});
+    functionNames.push_back(node->value);
+    functionDefined.push_back(false);
+    return index;
+}
+
+void RegCompiler::patchJump(size_t index, size_t target) {
+    RegInstruction& inst = program.code[index];
+    int32_t value = static_cast<int32_t>(target);
+    if (inst.op == RegOp::JMP) inst.a = value;
+    else if (inst.op == RegOp::JZ) inst.b = value;
+    else inst.c = value;
+}
+
+void RegCompiler::compileNode(ASTPtr node) {
+    if (!node) return;
+
+    switch (node->type) {
+        case ASTType::PROGRAM:
+            for (auto& child : node->children) {
+                compileNode(child);
+            }
+            break;
+        case ASTType::VAR_DECL:
+            compileVarDecl(node);
+            break;
+        case ASTType::FUNC_DECL:
+            compileFunction(node);
+            break;
+        case ASTType::BLOCK:
+            compileBlock(node);
+            break;
+        case ASTType::PRINT:
+            beginStatement();
+            emit(RegOp::PRINT, compileExpr(node->children[0]));
+            break;
+        case ASTType::SNAPSHOT:
+            break;
+        case ASTType::ASM_BLOCK:
+            program.strings.push_back(node->value);
+            emit(RegOp::EXEC_ASM, static_cast<int32_t>(program.strings.size() - 1));
+            break;
+        case ASTType::IF_STMT:
+            compileIf(node);
+            break;
+        case ASTType::WHILE_STMT:
+            compileWhile(node);
+            break;
+        case ASTType::RETURN:
+            compileReturn(node);
+            break;
+        case ASTType::EXPR_STMT:
+            beginStatement();
+            compileExpr(node->children[0]);
+            break;
+        default:
+            throw std::runtime_error("Unsupported AST node in statement context");
+    }
+}
+
+void RegCompiler::compileBlock(ASTPtr node) {
+    scopes.enterScope();
+    for (auto& child : node->children) {
+        compileNode(child);
+    }
+    scopes.leaveScope();
+}
+
+VariableInfo RegCompiler::declareLocal(const ASTPtr& node) {
+    if (scopes.inCurrentScope(node->symbol)) {
+        throw std::runtime_error("Variable '" + node->value + "' already declared in this scope");
+    }
+
+    VariableInfo info;
+    if (functionStack.back().isFunction) {
+        info.isGlobal = false;
+        info.index = functionStack.back().nextLocalIndex++;
+    } else {
+        info.isGlobal = true;
+        info.index = program.globalCount++;
+    }
+    scopes.declare(node->symbol, info);
+    return info;
+}
+
+void RegCompiler::compileVarDecl(ASTPtr node) {
+    VariableInfo info = declareLocal(node);
+
+    beginStatement();
+    compileExpr(node->children[0], info.isGlobal ? globalSlot(info.index) : frameSlot(info.index));
+}
+
+void RegCompiler::compileFunction(ASTPtr node) {
+    size_t skipIndex = emit(RegOp::JMP);
+
+    int index = functionIndex(node);
+    if (node->value == "main") mainIndex = index;
+    program.functions[static_cast<size_t>(index)].entry = program.code.size();
+    program.functions[static_cast<size_t>(index)].paramCount = static_cast<int>(node->children.size() - 1);
+    functionDefined[static_cast<size_t>(index)] = true;
+
+    int savedTop = tempTop;
+    int savedMax = maxRegister;
+    functionStack.push_back({node->value, true, 0, {}, tailCalls});
+    maxRegister = -1;
+
+    // Parameters are the first registers of the frame, in the body's scope.
+    scopes.enterScope();
+    for (size_t i = 0; i + 1 < node->children.size(); i++) {
+        declareLocal(node->children[i]);
+    }
+    for (auto& child : node->children.back()->children) {
+        compileNode(child);
+    }
+    scopes.leaveScope();
+    beginStatement();
+    int zero = allocTemp();
+    emit(RegOp::LOADI, zero, 0);
+    emit(RegOp::RET, zero);
+
+    program.functions[static_cast<size_t>(index)].frameSize =
+        std::max(functionStack.back().nextLocalIndex, maxRegister + 1);
+    functionStack.pop_back();
+    tempTop = savedTop;
+    maxRegister = savedMax;
+
+    patchJump(skipIndex, program.code.size());
+}
+
+void RegCompiler::compileIf(ASTPtr node) {
+    size_t jumpFalse = compileBranchIfFalse(node->children[0]);
+    compileBlock(node->children[1]);
+
+    if (node->children.size() == 3) {
+        size_t jumpEnd = emit(RegOp::JMP);
+        patchJump(jumpFalse, program.code.size());
+        compileBlock(node->children[2]);
+        patchJump(jumpEnd, program.code.size());
+    } else {
+        patchJump(jumpFalse, program.code.size());
+    }
+}
+
+void RegCompiler::compileWhile(ASTPtr node) {
+    size_t loopStart = program.code.size();
+    size_t exitJump = compileBranchIfFalse(node->children[0]);
+    compileBlock(node->children[1]);
+    emit(RegOp::JMP, static_cast<int32_t>(loopStart));
+    patchJump(exitJump, program.code.size());
+}
+
+void RegCompiler::compileReturn(ASTPtr node) {
+    if (!functionStack.back().isFunction) {
+        throw std::runtime_error("Return statement outside of function");
+    }
+
+    beginStatement();
+    if (!node->children.empty() && node->children[0]->type == ASTType::CALL && functionStack.back().tailCalls) {
+        const ASTPtr& call = node->children[0];
+        int first = compileArguments(call);
+        emit(RegOp::TAIL_CALL, functionIndex(call), 0, first);
+        return;
+    }
+    int value;
+    if (!node->children.empty()) {
+        value = compileExpr(node->children[0]);
+    } else {
+        value = allocTemp();
+        emit(RegOp::LOADI, value, 0);
+    }
+    emit(RegOp::RET, value);
+}
+
+size_t RegCompiler::compileBranchIfFalse(ASTPtr cond) {
+    beginStatement();
+
+    if (cond->type == ASTType::BINARY_OP && isComparison(cond->op)) {
+        RegOp jump, jumpImm;
+        switch (cond->op) {
+            case TokenType::EQ: jump = RegOp::JNE; jumpImm = RegOp::JNEI; break;
+            case TokenType::NEQ: jump = RegOp::JEQ; jumpImm = RegOp::JEQI; break;
+            case TokenType::LT: jump = RegOp::JGE; jumpImm = RegOp::JGEI; break;
+            case TokenType::LEQ: jump = RegOp::JGT; jumpImm = RegOp::JGTI; break;
+            case TokenType::GT: jump = RegOp::JLE; jumpImm = RegOp::JLEI; break;
+            default: jump = RegOp::JLT; jumpImm = RegOp::JLTI; break;
+        }
+
+        int32_t imm;
+        if (isImmediate(cond->children[1], imm)) {
+            int lhs = compileExpr(cond->children[0]);
+            return emit(jumpImm, lhs, imm);
+        }
+
+        int lhs = compileExpr(cond->children[0]);
+        if (!isTemp(lhs) && hasSideEffects(cond->children[1])) {
+            int copy = allocTemp();
+            emit(RegOp::MOV, copy, lhs);
+            lhs = copy;
+        }
+        int rhs = compileExpr(cond->children[1]);
+        return emit(jump, lhs, rhs);
+    }
+
+    int value = compileExpr(cond);
+    return emit(RegOp::JZ, value);
+}
+
+int RegCompiler::compileExpr(ASTPtr node, int dst) {
+    switch (node->type) {
+        case ASTType::NUMBER: {
+            int target = dst >= 0 ? dst : allocTemp();
+            emitConstant(target, std::stoll(node->value));
+            return target;
+        }
+        case ASTType::IDENTIFIER: {
+            int slot = slotOf(node);
+            if (dst >= 0 && dst != slot) {
+                emit(RegOp::MOV, dst, slot);
+                return dst;
+            }
+            return slot;
+        }
+        case ASTType::ASSIGN: {
+            int slot = slotOf(node);
+            compileExpr(node->children[0], slot);
+            if (dst >= 0 && dst != slot) {
+                emit(RegOp::MOV, dst, slot);
+                return dst;
+            }
+            return slot;
+        }
+        case ASTType::CALL:
+            return compileCall(node, dst);
+        case ASTType::BINARY_OP:
+            return compileBinaryOp(node, dst);
+        default:
+            throw std::runtime_error("Unsupported expression");
+    }
+}
+
+int RegCompiler::compileBinaryOp(ASTPtr node, int dst) {
+    ASTPtr left = node->children[0];
+    ASTPtr right = node->children[1];
+    int mark = tempTop;
+
+    RegOp regOp, immOp = RegOp::NOP;
+    switch (node->op) {
+        case TokenType::PLUS: regOp = RegOp::ADD; immOp = RegOp::ADDI; break;
+        case TokenType::MINUS: regOp = RegOp::SUB; immOp = RegOp::SUBI; break;
+        case TokenType::STAR: regOp = RegOp::MUL; immOp = RegOp::MULI; break;
+        case TokenType::SLASH: regOp = RegOp::DIV; immOp = RegOp::DIVI; break;
+        case TokenType::EQ: regOp = RegOp::EQ; break;
+        case TokenType::NEQ: regOp = RegOp::NE; break;
+        case TokenType::LT: regOp = RegOp::LT; break;
+        case TokenType::LEQ: regOp = RegOp::LE; break;
+        case TokenType::GT: regOp = RegOp::GT; break;
+        case TokenType::GEQ: regOp = RegOp::GE; break;
+        default: throw std::runtime_error("Unsupported binary operator '" + node->value + "'");
+    }
+
+    int32_t imm;
+    if (immOp != RegOp::NOP) {
+        bool commutative = (regOp == RegOp::ADD || regOp == RegOp::MUL);
+        if (commutative && isImmediate(left, imm) && !isImmediate(right, imm)) {
+            std::swap(left, right);
+        }
+        if (isImmediate(right, imm)) {
+            if (strengthReduction) reduceImmediate(immOp, imm);
+            int lhs = compileExpr(left);
+            tempTop = mark;
+            int target = dst >= 0 ? dst : allocTemp();
+            emit(immOp, target, lhs, imm);
+            return target;
+        }
+    }
+
+    int lhs = compileExpr(left);
+    if (!isTemp(lhs) && hasSideEffects(right)) {
+        int copy = allocTemp();
+        emit(RegOp::MOV, copy, lhs);
+        lhs = copy;
+    }
+    int rhs = compileExpr(right);
+    tempTop = mark;
+    int target = dst >= 0 ? dst : allocTemp();
+    emit(regOp, target, lhs, rhs);
+    return target;
+}
+
+// Multiplication by a power of two becomes a shift, division by one a
+// rounded shift and by other divisors a multiply-high (strength.h).
+void RegCompiler::reduceImmediate(RegOp& op, int32_t& imm) {
+    if (op != RegOp::MULI && op != RegOp::DIVI) return;
+    int shift = powerOfTwoShift(imm);
+    if (shift > 0) {
+        op = op == RegOp::MULI ? RegOp::SHLI : RegOp::DIVI_POW2;
+        imm = shift;
+    } else if (op == RegOp::DIVI && magicDivisible(imm)) {
+        program.divisors.push_back(magicDivisor(imm));
+        op = RegOp::DIVI_MAGIC;
+        imm = static_cast<int32_t>(program.divisors.size() - 1);
+    }
+}
+
+// Arguments are evaluated straight into consecutive temporaries, which
+// become the callee's parameter registers: the callee's window starts at
+// the first of them.
+int RegCompiler::compileCall(ASTPtr node, int dst) {
+    int target = dst >= 0 ? dst : allocTemp();
+    int first = compileArguments(node);
+    emit(RegOp::CALL, functionIndex(node), target, first);
+    tempTop = first;
+    return target;
+}
+
+int RegCompiler::compileArguments(ASTPtr node) {
+    int first = tempTop;
+    int count = static_cast<int>(node->children.size());
+    for (int i = 0; i < count; i++) allocTemp();
+    for (int i = 0; i < count; i++) {
+        compileExpr(node->children[static_cast<size_t>(i)], frameSlot(first + i));
+        tempTop = first + count;
+    }
+    callArguments.emplace_back(functionIndex(node), count);
+    return first;
+}
+
+RegProgram RegCompiler::compile(ASTPtr ast) {
+    reset();
+    compileNode(ast);
+
+    if (mainIndex < 0) {
+        throw std::runtime_error("Entry point 'main' was not defined");
+    }
+
+    beginStatement();
+    int result = allocTemp();
+    emit(RegOp::CALL, mainIndex, result, tempTop);
+    callArguments.emplace_back(mainIndex, 0);
+    emit(RegOp::HALT);
+
+    std::vector<std::string> unresolved;
+    for (size_t i = 0; i < functionDefined.size(); i++) {
+        if (!functionDefined[i]) unresolved.push_back("'" + functionNames[i] + "'");
+    }
+    if (unresolved.size() == 1) {
+        throw std::runtime_error("Unresolved function call to " + unresolved[0]);
+    }
+    if (!unresolved.empty()) {
+        std::string names = unresolved[0];
+        for (size_t i = 1; i < unresolved.size(); i++) names += ", " + unresolved[i];
+        throw std::runtime_error("Unresolved function calls to " + names);
+    }
+    for (auto& call : callArguments) {
+        int expected = program.functions[static_cast<size_t>(call.first)].paramCount;
+        if (call.second != expected) {
+            const std::string& name = functionNames[static_cast<size_t>(call.first)];
+            throw std::runtime_error("Function '" + name + "' expects " + std::to_string(expected) +
+                                     " arguments, got " + std::to_string(call.second));
+        }
+    }
+
+    program.entryFrameSize = maxRegister + 1;
+    return program;
+}
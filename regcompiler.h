@@ -0,0 +1,64 @@
+#pragma once
+#include "ast.h"
+#include "compiler.h"
+#include "regvm.h"
+#include "symbols.h"
+#include <string>
+#include <vector>
+
+// Compiles the AST to the register-machine tier. Locals and globals are
+// addressed in place as instruction operands; temporaries are allocated in
+// the frame above the locals and released after each (sub)expression.
+class RegCompiler {
+    RegProgram program;
+    ScopedSymbols<VariableInfo> scopes;
+    std::vector<FunctionContext> functionStack;
+    // Function index by symbol, -1 if the name was never called or
+    // declared; names and definedness by function index.
+    std::vector<int> functionIndices;
+    std::vector<std::string> functionNames;
+    std::vector<bool> functionDefined;
+    int mainIndex;
+    // Argument count of every call compiled so far, checked against the
+    // callee's parameters once it is defined.
+    std::vector<std::pair<int, int>> callArguments;
+    int tempTop;
+    int maxRegister;
+    bool tailCalls;
+    bool strengthReduction;
+
+    void reset();
+    void compileNode(ASTPtr node);
+    void compileBlock(ASTPtr node);
+    void compileFunction(ASTPtr node);
+    void compileVarDecl(ASTPtr node);
+    void compileIf(ASTPtr node);
+    void compileWhile(ASTPtr node);
+    void compileReturn(ASTPtr node);
+    int compileExpr(ASTPtr node, int dst = -1);
+    int compileBinaryOp(ASTPtr node, int dst);
+    void reduceImmediate(RegOp& op, int32_t& imm);
+    int compileCall(ASTPtr node, int dst);
+    // Evaluates a call's arguments into fresh consecutive temporaries and
+    // returns the first.
+    int compileArguments(ASTPtr node);
+    size_t compileBranchIfFalse(ASTPtr cond);
+    void patchJump(size_t index, size_t target);
+    int slotOf(const ASTPtr& node);
+    int allocTemp();
+    bool isTemp(int slot) const;
+    void beginStatement();
+    int functionIndex(const ASTPtr& node);
+    VariableInfo declareLocal(const ASTPtr& node);
+    size_t emit(RegOp op, int32_t a = 0, int32_t b = 0, int32_t c = 0);
+    void emitConstant(int dst, int64_t value);
+
+public:
+    RegCompiler();
+    // `return f(...)` compiles to TAIL_CALL unless disabled.
+    void setTailCalls(bool enabled) { tailCalls = enabled; }
+    // On by default: MULI and DIVI by suitable constants become SHLI,
+    // DIVI_POW2 and DIVI_MAGIC.
+    void setStrengthReduction(bool enabled) { strengthReduction = enabled; }
+    RegProgram compile(ASTPtr ast);
+};
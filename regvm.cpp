@@ -0,0 +1,229 @@
+#include "regvm.h"
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__GNUC__) && !defined(MINEC_SWITCH_DISPATCH)
+#define MINEC_THREADED_DISPATCH 1
+#endif
+
+RegVM::RegVM() : executed(0) {}
+
+static bool isJump(RegOp op) {
+    return op >= RegOp::JMP && op <= RegOp::JGEI;
+}
+
+static size_t jumpTarget(const RegInstruction& inst) {
+    if (inst.op == RegOp::JMP) return static_cast<size_t>(inst.a);
+    if (inst.op == RegOp::JZ) return static_cast<size_t>(inst.b);
+    return static_cast<size_t>(inst.c);
+}
+
+void RegVM::loadProgram(const RegProgram& prog) {
+    if (prog.code.empty() || prog.code.back().op != RegOp::HALT) {
+        throw std::runtime_error("Register program must end with HALT");
+    }
+    for (size_t i = 0; i < prog.code.size(); i++) {
+        const RegInstruction& inst = prog.code[i];
+        if (isJump(inst.op) && jumpTarget(inst) >= prog.code.size()) {
+            throw std::runtime_error("Invalid jump target at pc " + std::to_string(i));
+        }
+        if ((inst.op == RegOp::CALL || inst.op == RegOp::TAIL_CALL) && (static_cast<size_t>(inst.a) >= prog.functions.size() || inst.c < 0)) {
+            throw std::runtime_error("Invalid function index at pc " + std::to_string(i));
+        }
+        if ((inst.op == RegOp::SHLI || inst.op == RegOp::DIVI_POW2) && (inst.c < 1 || inst.c > 62)) {
+            throw std::runtime_error("Invalid shift count at pc " + std::to_string(i));
+        }
+        if (inst.op == RegOp::DIVI_MAGIC && (inst.c < 0 || static_cast<size_t>(inst.c) >= prog.divisors.size())) {
+            throw std::runtime_error("Invalid divisor index at pc " + std::to_string(i));
+        }
+    }
+
+    program = prog;
+    asmBlocks.clear();
+    for (const std::string& text : program.strings) {
+        asmBlocks.push_back(decodeAsm(text));
+    }
+    registers.assign(static_cast<size_t>(program.entryFrameSize) + 1024, 0);
+    globals.assign(static_cast<size_t>(program.globalCount), 0);
+    asmStack.clear();
+    callStack.clear();
+    cpu = CPUState();
+    executed = 0;
+}
+
+void RegVM::run() {
+    const RegInstruction* base = program.code.data();
+    const RegInstruction* ip = base;
+    size_t frameBase = 0;
+    int frameSize = program.entryFrameSize;
+    int64_t* slots[2] = {registers.data(), globals.data()};
+    const MagicDivisor* divisors = program.divisors.data();
+    uint64_t count = 0;
+
+#define SLOT(x) slots[(x) & 1][(x) >> 1]
+
+#ifdef MINEC_THREADED_DISPATCH
+    static const void* const handlers[] = {
+        &&op_NOP, &&op_MOV, &&op_LOADI, &&op_LOADK, &&op_ADD, &&op_SUB, &&op_MUL,
+        &&op_DIV, &&op_ADDI, &&op_SUBI, &&op_MULI, &&op_DIVI, &&op_SHLI,
+        &&op_DIVI_POW2, &&op_DIVI_MAGIC, &&op_EQ, &&op_NE,
+        &&op_LT, &&op_GT, &&op_LE, &&op_GE, &&op_JMP, &&op_JZ, &&op_JEQ, &&op_JNE,
+        &&op_JLT, &&op_JGT, &&op_JLE, &&op_JGE, &&op_JEQI, &&op_JNEI, &&op_JLTI,
+        &&op_JGTI, &&op_JLEI, &&op_JGEI, &&op_CALL, &&op_RET, &&op_TAIL_CALL, &&op_PRINT,
+        &&op_EXEC_ASM, &&op_HALT
+    };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == static_cast<size_t>(RegOp::HALT) + 1,
+                  "handler table out of sync with RegOp");
+#define CASE(name) op_##name
+#define DISPATCH() do { ++count; goto *handlers[static_cast<size_t>(ip->op)]; } while (0)
+#define NEXT() do { ++ip; DISPATCH(); } while (0)
+#define JUMP(target) do { ip = base + (target); DISPATCH(); } while (0)
+    DISPATCH();
+#else
+#define CASE(name) case RegOp::name
+#define NEXT() { ++ip; continue; }
+#define JUMP(target) { ip = base + (target); continue; }
+    for (;;) {
+        ++count;
+        switch (ip->op) {
+#endif
+
+#define ARITH(name, expr) CASE(name): { \
+        int64_t a = SLOT(ip->b); \
+        int64_t b = SLOT(ip->c); \
+        SLOT(ip->a) = (expr); \
+        NEXT(); \
+    }
+#define ARITH_IMM(name, expr) CASE(name): { \
+        int64_t a = SLOT(ip->b); \
+        int64_t b = ip->c; \
+        SLOT(ip->a) = (expr); \
+        NEXT(); \
+    }
+#define BRANCH(name, cond) CASE(name): { \
+        int64_t a = SLOT(ip->a); \
+        int64_t b = SLOT(ip->b); \
+        if (cond) JUMP(ip->c); \
+        NEXT(); \
+    }
+#define BRANCH_IMM(name, cond) CASE(name): { \
+        int64_t a = SLOT(ip->a); \
+        int64_t b = ip->b; \
+        if (cond) JUMP(ip->c); \
+        NEXT(); \
+    }
+
+    CASE(NOP):
+        NEXT();
+    CASE(MOV):
+        SLOT(ip->a) = SLOT(ip->b);
+        NEXT();
+    CASE(LOADI):
+        SLOT(ip->a) = ip->b;
+        NEXT();
+    CASE(LOADK):
+        SLOT(ip->a) = program.constants[static_cast<size_t>(ip->b)];
+        NEXT();
+    ARITH(ADD, a + b)
+    ARITH(SUB, a - b)
+    ARITH(MUL, a * b)
+    ARITH(DIV, a / b)
+    ARITH_IMM(ADDI, a + b)
+    ARITH_IMM(SUBI, a - b)
+    ARITH_IMM(MULI, a * b)
+    ARITH_IMM(DIVI, a / b)
+    ARITH_IMM(SHLI, shiftLeft(a, static_cast<int>(b)))
+    ARITH_IMM(DIVI_POW2, divideByPowerOfTwo(a, static_cast<int>(b)))
+    ARITH_IMM(DIVI_MAGIC, divideByMagic(a, divisors[b]))
+    ARITH(EQ, a == b)
+    ARITH(NE, a != b)
+    ARITH(LT, a < b)
+    ARITH(GT, a > b)
+    ARITH(LE, a <= b)
+    ARITH(GE, a >= b)
+    CASE(JMP):
+        JUMP(ip->a);
+    CASE(JZ):
+        if (!SLOT(ip->a)) JUMP(ip->b);
+        NEXT();
+    BRANCH(JEQ, a == b)
+    BRANCH(JNE, a != b)
+    BRANCH(JLT, a < b)
+    BRANCH(JGT, a > b)
+    BRANCH(JLE, a <= b)
+    BRANCH(JGE, a >= b)
+    BRANCH_IMM(JEQI, a == b)
+    BRANCH_IMM(JNEI, a != b)
+    BRANCH_IMM(JLTI, a < b)
+    BRANCH_IMM(JGTI, a > b)
+    BRANCH_IMM(JLEI, a <= b)
+    BRANCH_IMM(JGEI, a >= b)
+    CASE(CALL): {
+        // The arguments are already in place: the callee's window starts at
+        // the first of them.
+        const RegFunction& fn = program.functions[static_cast<size_t>(ip->a)];
+        size_t calleeBase = frameBase + static_cast<size_t>(ip->c);
+        size_t needed = calleeBase + static_cast<size_t>(fn.frameSize);
+        if (needed > registers.size()) {
+            registers.resize(needed * 2, 0);
+        }
+        callStack.push_back({static_cast<size_t>(ip - base) + 1, ip->b, frameBase, frameSize});
+        frameBase = calleeBase;
+        frameSize = fn.frameSize;
+        slots[0] = registers.data() + frameBase;
+        std::fill(slots[0] + fn.paramCount, slots[0] + frameSize, 0);
+        JUMP(fn.entry);
+    }
+    CASE(RET): {
+        if (callStack.empty()) throw std::runtime_error("RET without call frame");
+        int64_t value = SLOT(ip->a);
+        Frame frame = callStack.back();
+        callStack.pop_back();
+        frameBase = frame.base;
+        frameSize = frame.size;
+        slots[0] = registers.data() + frameBase;
+        SLOT(frame.dst) = value;
+        JUMP(frame.returnAddress);
+    }
+    CASE(TAIL_CALL): {
+        const RegFunction& fn = program.functions[static_cast<size_t>(ip->a)];
+        size_t needed = frameBase + static_cast<size_t>(fn.frameSize);
+        if (needed > registers.size()) {
+            registers.resize(needed * 2, 0);
+            slots[0] = registers.data() + frameBase;
+        }
+        if (ip->c > 0) std::copy(slots[0] + ip->c, slots[0] + ip->c + fn.paramCount, slots[0]);
+        frameSize = fn.frameSize;
+        std::fill(slots[0] + fn.paramCount, slots[0] + frameSize, 0);
+        JUMP(fn.entry);
+    }
+    CASE(PRINT):
+        output.printLine(SLOT(ip->a));
+        NEXT();
+    CASE(EXEC_ASM):
+        executeAsmBlock(asmBlocks[static_cast<size_t>(ip->a)], cpu, asmStack);
+        NEXT();
+    CASE(HALT):
+        goto done;
+
+#ifndef MINEC_THREADED_DISPATCH
+        }
+    }
+#endif
+
+done:
+    executed += count;
+    output.halt();
+
+#undef BRANCH_IMM
+#undef BRANCH
+#undef ARITH_IMM
+#undef ARITH
+#undef JUMP
+#undef NEXT
+#undef CASE
+#undef SLOT
+#ifdef MINEC_THREADED_DISPATCH
+#undef DISPATCH
+#endif
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include "token.h"
+#include "asm.h"
+#include "output.h"
+#include "strength.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Register-machine tier. Operands are slots: bit 0 selects the global
+// table (1) or the current frame's register window (0), the remaining bits
+// are the index. Immediates are 32-bit; wider constants go through LOADK.
+enum class RegOp : uint8_t {
+    NOP,
+    MOV,      // a = dst, b = src
+    LOADI,    // a = dst, b = imm
+    LOADK,    // a = dst, b = constant index
+    ADD,      // a = dst, b = lhs, c = rhs
+    SUB,
+    MUL,
+    DIV,
+    ADDI,     // a = dst, b = lhs, c = imm
+    SUBI,
+    MULI,
+    DIVI,
+    SHLI,     // a = dst, b = lhs, c = shift count (strength.h)
+    DIVI_POW2,
+    DIVI_MAGIC, // a = dst, b = lhs, c = index into divisors
+    EQ,       // a = dst, b = lhs, c = rhs
+    NE,
+    LT,
+    GT,
+    LE,
+    GE,
+    JMP,      // a = target
+    JZ,       // a = src, b = target
+    JEQ,      // a = lhs, b = rhs, c = target
+    JNE,
+    JLT,
+    JGT,
+    JLE,
+    JGE,
+    JEQI,     // a = lhs, b = imm, c = target
+    JNEI,
+    JLTI,
+    JGTI,
+    JLEI,
+    JGEI,
+    CALL,     // a = function index, b = dst slot in the caller, c = first
+              // argument register: the callee's frame starts there
+    RET,      // a = src
+    TAIL_CALL, // a = function index, c = first argument register: the
+               // arguments move to the start of the frame, which the
+               // callee takes over
+    PRINT,    // a = src
+    EXEC_ASM, // a = asm block index
+    HALT
+};
+
+struct RegInstruction {
+    RegOp op;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+
+    RegInstruction() = default;
+    RegInstruction(RegOp opcode, int32_t x = 0, int32_t y = 0, int32_t z = 0)
+        : op(opcode), a(x), b(y), c(z) {}
+};
+
+static_assert(sizeof(RegInstruction) == 16, "RegInstruction must stay 16 bytes");
+
+inline int32_t frameSlot(int index) { return index << 1; }
+inline int32_t globalSlot(int index) { return (index << 1) | 1; }
+
+struct RegFunction {
+    size_t entry;
+    int frameSize;
+    int paramCount;
+};
+
+struct RegProgram {
+    std::vector<RegInstruction> code;
+    std::vector<int64_t> constants;
+    std::vector<MagicDivisor> divisors;
+    std::vector<std::string> strings;
+    std::vector<RegFunction> functions;
+    int globalCount = 0;
+    int entryFrameSize = 0;
+};
+
+class RegVM {
+    RegProgram program;
+    std::vector<AsmBlock> asmBlocks;
+    std::vector<int64_t> registers;
+    std::vector<int64_t> globals;
+    std::vector<int64_t> asmStack;
+    struct Frame {
+        size_t returnAddress;
+        int32_t dst;
+        size_t base;
+        int size;
+    };
+    std::vector<Frame> callStack;
+    CPUState cpu;
+    OutputBuffer output;
+    uint64_t executed;
+
+public:
+    RegVM();
+    void loadProgram(const RegProgram& prog);
+    void run();
+    uint64_t getExecutedCount() const { return executed; }
+    CPUState& getCPU() { return cpu; }
+    OutputBuffer& getOutput() { return output; }
+};
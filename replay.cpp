@@ -0,0 +1,70 @@
+#include "replay.h"
+#include <algorithm>
+
+Recorder::Recorder(const VM& vm, uint64_t checkpointInterval, size_t budget)
+    : interval(std::max<uint64_t>(checkpointInterval, 1)), memoryBudget(budget), memoryUsed(0),
+      frontier(vm.getExecutedCount()) {
+    checkpoint(vm);
+}
+
+void Recorder::checkpoint(const VM& vm) {
+    Checkpoint taken{vm.takeSnapshot(), 0};
+    const VMSnapshot& state = taken.state;
+    taken.bytes = sizeof(Checkpoint) + sizeof(int64_t) * (state.stack.size() + state.globals.size() + state.locals.size()) +
+                  sizeof(VMSnapshot::Frame) * state.callStack.size();
+    memoryUsed += taken.bytes;
+    checkpoints.push_back(std::move(taken));
+
+    while (memoryUsed > memoryBudget && checkpoints.size() > 2) {
+        // Keep the first checkpoint and those on multiples of the doubled
+        // interval.
+        interval *= 2;
+        size_t kept = 1;
+        for (size_t i = 1; i < checkpoints.size(); i++) {
+            if (checkpoints[i].state.executed % interval == 0) {
+                checkpoints[kept++] = std::move(checkpoints[i]);
+            } else {
+                memoryUsed -= checkpoints[i].bytes;
+            }
+        }
+        checkpoints.resize(kept);
+    }
+}
+
+void Recorder::forward(VM& vm, uint64_t target, bool stopAtBreaks) {
+    while (!vm.finished() && vm.getExecutedCount() < target) {
+        uint64_t now = vm.getExecutedCount();
+        uint64_t limit = now < frontier ? frontier : (now / interval + 1) * interval;
+        limit = std::min(limit, target);
+        vm.getOutput().setMuted(now < frontier);
+        if (stopAtBreaks) {
+            vm.setInstructionLimit(limit);
+            vm.run();
+            vm.setInstructionLimit(VM::kNoLimit);
+        } else {
+            vm.advance(limit - now);
+        }
+        uint64_t reached = vm.getExecutedCount();
+        frontier = std::max(frontier, reached);
+        if (reached % interval == 0 && reached > checkpoints.back().state.executed && !vm.finished()) {
+            checkpoint(vm);
+        }
+        if (stopAtBreaks && vm.getStop() != VM::Stop::Limit && vm.getStop() != VM::Stop::None) break;
+    }
+    vm.getOutput().setMuted(false);
+}
+
+void Recorder::seek(VM& vm, uint64_t target) {
+    if (target < vm.getExecutedCount()) restore(vm, checkpointBefore(target));
+    forward(vm, target, false);
+}
+
+size_t Recorder::checkpointBefore(uint64_t count) const {
+    auto after = std::upper_bound(checkpoints.begin(), checkpoints.end(), count,
+                                  [](uint64_t value, const Checkpoint& c) { return value < c.state.executed; });
+    return static_cast<size_t>(after - checkpoints.begin()) - 1;
+}
+
+void Recorder::restore(VM& vm, size_t index) const {
+    vm.restore(checkpoints[index].state);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "snapshot.h"
+#include "vm.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Record/replay for the debugger. MineC programs read no input, so a run
+// is fully determined by its program and the recording is just periodic
+// checkpoints of the VM: any earlier instruction count is reached by
+// restoring the nearest checkpoint and replaying forward at most one
+// interval. Output of replayed code, which was already written, is muted.
+//
+// Checkpoints are taken every `interval` instructions; when they outgrow
+// `memoryBudget` bytes every other one is dropped and the interval doubles,
+// so they keep covering the whole run in bounded memory.
+class Recorder {
+    struct Checkpoint {
+        VMSnapshot state;
+        size_t bytes;
+    };
+    std::vector<Checkpoint> checkpoints;
+    uint64_t interval;
+    size_t memoryBudget;
+    size_t memoryUsed;
+    // The furthest instruction count reached; output before it is muted.
+    uint64_t frontier;
+
+    void checkpoint(const VM& vm);
+
+public:
+    static constexpr uint64_t kDefaultInterval = 1000000;
+    static constexpr size_t kDefaultMemoryBudget = size_t(64) << 20;
+
+    // Takes the first checkpoint of `vm`, which must not have run yet.
+    Recorder(const VM& vm, uint64_t interval = kDefaultInterval, size_t memoryBudget = kDefaultMemoryBudget);
+
+    // Runs to `target` instructions or, if `stopAtBreaks`, to an earlier
+    // breakpoint or watch; VM::getStop() tells which.
+    void forward(VM& vm, uint64_t target, bool stopAtBreaks);
+    // Moves to exactly `target` instructions (or the end of the program),
+    // ignoring breakpoints and watches.
+    void seek(VM& vm, uint64_t target);
+
+    // Index of the latest checkpoint at or before `count` instructions.
+    size_t checkpointBefore(uint64_t count) const;
+    uint64_t checkpointAt(size_t index) const { return checkpoints[index].state.executed; }
+    void restore(VM& vm, size_t index) const;
+
+    size_t checkpointCount() const { return checkpoints.size(); }
+    size_t memoryInUse() const { return memoryUsed; }
+    uint64_t checkpointInterval() const { return interval; }
+};
@@ -0,0 +1,37 @@
+#include "runner.h"
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+std::vector<InstanceResult> runInstances(const std::shared_ptr<const LoadedProgram>& program, size_t instances,
+                                         size_t jobs, const std::function<void(VM&)>& configure) {
+    std::vector<InstanceResult> results(instances);
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t index = next++; index < instances; index = next++) {
+            InstanceResult& result = results[index];
+            try {
+                VM vm;
+                vm.getOutput().redirectToMemory(&result.output);
+                vm.loadProgram(program);
+                configure(vm);
+                vm.run();
+                result.executed = vm.getExecutedCount();
+            } catch (const std::exception& e) {
+                result.error = e.what();
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    size_t threads = std::max<size_t>(1, std::min(jobs, instances));
+    for (size_t i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+    return results;
+}
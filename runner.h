@@ -0,0 +1,21 @@
+#pragma once
+#include "vm.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct InstanceResult {
+    std::string output;
+    // Empty when the instance ran to completion.
+    std::string error;
+    uint64_t executed = 0;
+};
+
+// Runs `instances` independent VMs over one shared program on a pool of
+// `jobs` threads. Every instance has its own stack, globals, CPUState and
+// JIT, and prints into its own result. `configure` is applied to each VM
+// after it loads the program, e.g. to restore a shared snapshot.
+std::vector<InstanceResult> runInstances(const std::shared_ptr<const LoadedProgram>& program, size_t instances,
+                                         size_t jobs, const std::function<void(VM&)>& configure);
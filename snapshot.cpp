@@ -0,0 +1,148 @@
+#include "snapshot.h"
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+
+const char kMagic[8] = {'M', 'C', 'S', 'N', 'A', 'P', '0', '1'};
+
+class Fingerprint {
+    uint64_t hash = 14695981039346656037ull;
+
+public:
+    void add(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+    void add(uint64_t value) { add(&value, sizeof(value)); }
+    uint64_t value() const { return hash; }
+};
+
+class Writer {
+    std::ofstream out;
+
+public:
+    explicit Writer(const std::string& path) : out(path, std::ios::binary) {
+        if (!out) throw std::runtime_error("Cannot write snapshot " + path);
+    }
+    void raw(const void* data, size_t size) {
+        out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    }
+    void u64(uint64_t value) { raw(&value, sizeof(value)); }
+    template <typename T>
+    void array(const std::vector<T>& values) {
+        u64(values.size());
+        raw(values.data(), values.size() * sizeof(T));
+    }
+    void finish(const std::string& path) {
+        if (!out.flush()) throw std::runtime_error("Cannot write snapshot " + path);
+    }
+};
+
+class Reader {
+    std::ifstream in;
+    std::string path;
+    uint64_t remaining;
+
+public:
+    explicit Reader(const std::string& file) : in(file, std::ios::binary | std::ios::ate), path(file) {
+        if (!in) throw std::runtime_error("Cannot open snapshot " + path);
+        remaining = static_cast<uint64_t>(in.tellg());
+        in.seekg(0);
+    }
+    // Sizes read from the file are checked against what is left of it
+    // before anything is allocated.
+    void expect(uint64_t count, size_t elementSize) {
+        if (count > remaining / elementSize) throw std::runtime_error("Corrupt snapshot " + path);
+    }
+    void raw(void* data, size_t size) {
+        if (!in.read(static_cast<char*>(data), static_cast<std::streamsize>(size))) {
+            throw std::runtime_error("Truncated snapshot " + path);
+        }
+        remaining -= size;
+    }
+    uint64_t u64() {
+        uint64_t value;
+        raw(&value, sizeof(value));
+        return value;
+    }
+    template <typename T>
+    void array(std::vector<T>& values) {
+        uint64_t size = u64();
+        expect(size, sizeof(T));
+        values.resize(static_cast<size_t>(size));
+        raw(values.data(), values.size() * sizeof(T));
+    }
+};
+
+} // namespace
+
+uint64_t programFingerprint(const Program& program) {
+    Fingerprint hash;
+    hash.add(program.code.size());
+    for (const Instruction& inst : program.code) {
+        hash.add(static_cast<uint64_t>(inst.op));
+        hash.add(static_cast<uint64_t>(inst.operand));
+    }
+    for (const std::string& text : program.strings) {
+        hash.add(text.size());
+        hash.add(text.data(), text.size());
+    }
+    for (const FunctionEntry& function : program.functions) {
+        hash.add(function.address);
+        hash.add(function.frameSize);
+        hash.add(function.paramCount);
+    }
+    hash.add(program.globalCount);
+    return hash.value();
+}
+
+void saveSnapshot(const VMSnapshot& snapshot, const std::string& path) {
+    Writer out(path);
+    out.raw(kMagic, sizeof(kMagic));
+    out.u64(snapshot.fingerprint);
+    out.u64(snapshot.pc);
+    for (int64_t value : snapshot.cpu.regs.data) out.u64(static_cast<uint64_t>(value));
+    out.u64(snapshot.cpu.zf);
+    out.u64(snapshot.cpu.sf);
+    out.array(snapshot.stack);
+    out.array(snapshot.globals);
+    out.array(snapshot.locals);
+    out.u64(snapshot.callStack.size());
+    for (const VMSnapshot::Frame& frame : snapshot.callStack) {
+        out.u64(frame.returnAddress);
+        out.u64(frame.base);
+        out.u64(frame.size);
+    }
+    out.finish(path);
+}
+
+VMSnapshot loadSnapshot(const std::string& path) {
+    Reader in(path);
+    char magic[sizeof(kMagic)];
+    in.raw(magic, sizeof(magic));
+    if (std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+        throw std::runtime_error(path + " is not a MineC snapshot");
+    }
+    VMSnapshot snapshot;
+    snapshot.fingerprint = in.u64();
+    snapshot.pc = in.u64();
+    for (int64_t& value : snapshot.cpu.regs.data) value = static_cast<int64_t>(in.u64());
+    snapshot.cpu.zf = in.u64() != 0;
+    snapshot.cpu.sf = in.u64() != 0;
+    in.array(snapshot.stack);
+    in.array(snapshot.globals);
+    in.array(snapshot.locals);
+    uint64_t frames = in.u64();
+    in.expect(frames, 3 * sizeof(uint64_t));
+    snapshot.callStack.resize(static_cast<size_t>(frames));
+    for (VMSnapshot::Frame& frame : snapshot.callStack) {
+        frame.returnAddress = in.u64();
+        frame.base = in.u64();
+        frame.size = static_cast<uint32_t>(in.u64());
+    }
+    return snapshot;
+}
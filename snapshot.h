@@ -0,0 +1,37 @@
+#pragma once
+#include "program.h"
+#include "token.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Everything a VM mutates while it runs, captured when it pauses at a
+// SNAPSHOT instruction. A VM loaded with the same program resumes from it
+// without re-running the code before that point; one snapshot can seed
+// any number of VMs, as restoring copies only the live state.
+struct VMSnapshot {
+    struct Frame {
+        uint64_t returnAddress;
+        uint64_t base;
+        uint32_t size;
+    };
+    uint64_t fingerprint = 0;
+    uint64_t pc = 0;
+    std::vector<int64_t> stack;
+    std::vector<int64_t> globals;
+    // The locals slab up to the end of the innermost frame.
+    std::vector<int64_t> locals;
+    std::vector<Frame> callStack;
+    CPUState cpu;
+    // Instructions executed before the snapshot; files do not store it.
+    uint64_t executed = 0;
+};
+
+// Identifies a compiled program, so a snapshot is only restored into the
+// program it was taken from.
+uint64_t programFingerprint(const Program& program);
+
+// Snapshot files use the host's byte order and are meant to be reloaded on
+// the machine that wrote them. Both throw on I/O errors and bad files.
+void saveSnapshot(const VMSnapshot& snapshot, const std::string& path);
+VMSnapshot loadSnapshot(const std::string& path);
@@ -0,0 +1,1168 @@
+#include "ssa.h"
+#include "asm.h"
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+enum class SsaOp : uint8_t {
+    Const,
+    Param,
+    Phi,
+    Copy,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Neg,
+    CmpEq,
+    CmpNeq,
+    CmpLt,
+    CmpLeq,
+    CmpGt,
+    CmpGeq,
+    LoadGlobal,
+    StoreGlobal,
+    Call,
+    Print,
+    Asm,
+    Snapshot
+};
+
+struct Value {
+    SsaOp op;
+    // Constant, parameter index, global slot, callee index or asm block
+    // index.
+    int64_t operand;
+    // Operands; a phi has one per predecessor, in the order of Block::preds.
+    std::vector<uint32_t> args;
+    // Defining block, kNone for constants (materialized at each use).
+    uint32_t block;
+    bool removed = false;
+};
+
+enum class Exit : uint8_t { None, Jump, Branch, Return };
+
+struct Block {
+    std::vector<uint32_t> phis;
+    std::vector<uint32_t> body;
+    std::vector<uint32_t> preds;
+    Exit exit = Exit::None;
+    // Branch condition or returned value.
+    uint32_t value = kNone;
+    // Jump target, or branch targets when true and when false.
+    uint32_t target[2] = {kNone, kNone};
+    bool reachable = true;
+};
+
+// A `while` loop: the header evaluates the condition, the preheader is the
+// single block jumping to it from outside.
+struct Loop {
+    uint32_t preheader;
+    uint32_t header;
+    std::vector<uint32_t> blocks;
+};
+
+struct Function {
+    std::vector<Value> values;
+    std::vector<Block> blocks;
+    // Block order for lowering: the order the builder entered them in.
+    std::vector<uint32_t> layout;
+    // Outer loops before the loops nested in them.
+    std::vector<Loop> loops;
+    // One value per parameter, defined on entry in the slot of the same
+    // index.
+    std::vector<uint32_t> params;
+    std::vector<Callee> callees;
+    std::vector<std::string> asmCode;
+    std::unordered_map<int64_t, uint32_t> constants;
+    // Uses of a removed value are redirected to replacement[value].
+    std::vector<uint32_t> replacement;
+
+    uint32_t add(SsaOp op, int64_t operand, std::vector<uint32_t> args, uint32_t block) {
+        uint32_t id = static_cast<uint32_t>(values.size());
+        values.push_back({op, operand, std::move(args), block});
+        replacement.push_back(id);
+        return id;
+    }
+
+    uint32_t constant(int64_t value) {
+        auto found = constants.find(value);
+        if (found != constants.end()) return found->second;
+        uint32_t id = add(SsaOp::Const, value, {}, kNone);
+        constants[value] = id;
+        return id;
+    }
+
+    uint32_t resolve(uint32_t id) {
+        uint32_t root = id;
+        while (replacement[root] != root) root = replacement[root];
+        while (replacement[id] != root) {
+            uint32_t next = replacement[id];
+            replacement[id] = root;
+            id = next;
+        }
+        return root;
+    }
+
+    void replace(uint32_t id, uint32_t with) {
+        replacement[id] = with;
+        values[id].removed = true;
+    }
+
+    // Points every operand at its replacement and drops removed values
+    // from the blocks.
+    void rewrite() {
+        for (Value& value : values) {
+            if (value.removed) continue;
+            for (uint32_t& arg : value.args) arg = resolve(arg);
+        }
+        auto gone = [&](uint32_t id) { return values[id].removed; };
+        for (Block& block : blocks) {
+            if (block.value != kNone) block.value = resolve(block.value);
+            block.phis.erase(std::remove_if(block.phis.begin(), block.phis.end(), gone), block.phis.end());
+            block.body.erase(std::remove_if(block.body.begin(), block.body.end(), gone), block.body.end());
+        }
+    }
+};
+
+bool producesValue(SsaOp op) {
+    return op != SsaOp::StoreGlobal && op != SsaOp::Print && op != SsaOp::Asm && op != SsaOp::Snapshot;
+}
+
+bool arithmetic(SsaOp op) {
+    return op >= SsaOp::Add && op <= SsaOp::CmpGeq;
+}
+
+bool commutative(SsaOp op) {
+    return op == SsaOp::Add || op == SsaOp::Mul || op == SsaOp::CmpEq || op == SsaOp::CmpNeq;
+}
+
+// A division traps unless its divisor is a constant other than 0 and -1.
+bool mayTrap(const Function& fn, const Value& value) {
+    if (value.op != SsaOp::Div) return false;
+    const Value& divisor = fn.values[value.args[1]];
+    return divisor.op != SsaOp::Const || divisor.operand == 0 || divisor.operand == -1;
+}
+
+bool hasSideEffects(const Function& fn, const Value& value) {
+    switch (value.op) {
+        case SsaOp::StoreGlobal:
+        case SsaOp::Call:
+        case SsaOp::Print:
+        case SsaOp::Asm:
+        case SsaOp::Snapshot:
+            return true;
+        default:
+            return mayTrap(fn, value);
+    }
+}
+
+std::vector<uint32_t> successors(const Block& block) {
+    if (block.exit == Exit::Jump) return {block.target[0]};
+    if (block.exit == Exit::Branch) return {block.target[0], block.target[1]};
+    return {};
+}
+
+// Braun et al., "Simple and Efficient Construction of Static Single
+// Assignment Form": locals are looked up per block, and blocks whose
+// predecessors are not all known yet (loop headers) get placeholder phis
+// that are filled in when the block is sealed.
+class Builder {
+    struct BlockState {
+        std::unordered_map<uint32_t, uint32_t> definitions;
+        std::vector<std::pair<uint32_t, uint32_t>> incompletePhis;
+        bool sealed = false;
+    };
+
+    Function& fn;
+    const std::function<int(Symbol)>& globalIndex;
+    std::vector<BlockState> state;
+    ScopedSymbols<uint32_t> scopes;
+    uint32_t variableCount = 0;
+    std::vector<size_t> openLoops;
+    uint32_t current = 0;
+
+    uint32_t newBlock() {
+        uint32_t id = static_cast<uint32_t>(fn.blocks.size());
+        fn.blocks.emplace_back();
+        state.emplace_back();
+        for (size_t loop : openLoops) fn.loops[loop].blocks.push_back(id);
+        return id;
+    }
+
+    void enter(uint32_t block) {
+        current = block;
+        fn.layout.push_back(block);
+    }
+
+    uint32_t emit(SsaOp op, int64_t operand = 0, std::vector<uint32_t> args = {}) {
+        uint32_t id = fn.add(op, operand, std::move(args), current);
+        fn.blocks[current].body.push_back(id);
+        return id;
+    }
+
+    void jump(uint32_t target) {
+        fn.blocks[current].exit = Exit::Jump;
+        fn.blocks[current].target[0] = target;
+        fn.blocks[target].preds.push_back(current);
+    }
+
+    void branch(uint32_t condition, uint32_t whenTrue, uint32_t whenFalse) {
+        Block& block = fn.blocks[current];
+        block.exit = Exit::Branch;
+        block.value = condition;
+        block.target[0] = whenTrue;
+        block.target[1] = whenFalse;
+        fn.blocks[whenTrue].preds.push_back(current);
+        fn.blocks[whenFalse].preds.push_back(current);
+    }
+
+    void write(uint32_t variable, uint32_t block, uint32_t value) {
+        state[block].definitions[variable] = value;
+    }
+
+    uint32_t read(uint32_t variable, uint32_t block) {
+        auto found = state[block].definitions.find(variable);
+        if (found != state[block].definitions.end()) return found->second;
+
+        uint32_t value;
+        if (!state[block].sealed) {
+            value = newPhi(block);
+            state[block].incompletePhis.emplace_back(variable, value);
+        } else if (fn.blocks[block].preds.size() == 1) {
+            value = read(variable, fn.blocks[block].preds[0]);
+        } else if (fn.blocks[block].preds.empty()) {
+            // Only reachable from code before the declaration: a fresh
+            // frame slot reads as zero.
+            value = fn.constant(0);
+        } else {
+            value = newPhi(block);
+            write(variable, block, value);
+            addPhiOperands(variable, value);
+        }
+        write(variable, block, value);
+        return value;
+    }
+
+    uint32_t newPhi(uint32_t block) {
+        uint32_t id = fn.add(SsaOp::Phi, 0, {}, block);
+        fn.blocks[block].phis.push_back(id);
+        return id;
+    }
+
+    void addPhiOperands(uint32_t variable, uint32_t phi) {
+        std::vector<uint32_t> preds = fn.blocks[fn.values[phi].block].preds;
+        for (uint32_t pred : preds) {
+            uint32_t value = read(variable, pred);
+            fn.values[phi].args.push_back(value);
+        }
+    }
+
+    void seal(uint32_t block) {
+        std::vector<std::pair<uint32_t, uint32_t>> incomplete;
+        incomplete.swap(state[block].incompletePhis);
+        for (auto& [variable, phi] : incomplete) addPhiOperands(variable, phi);
+        state[block].sealed = true;
+    }
+
+    bool lookup(Symbol symbol, uint32_t& variable) {
+        uint32_t* found = scopes.find(symbol);
+        if (found) variable = *found;
+        return found != nullptr;
+    }
+
+    // The slot a global assignment or read refers to; throws like the
+    // compiler for unknown names.
+    int global(const ASTPtr& node) const {
+        int index = globalIndex(node->symbol);
+        if (index < 0) throw std::runtime_error("Undefined variable '" + node->value + "'");
+        return index;
+    }
+
+    // Declares a local in the innermost scope, rejecting redeclarations
+    // like the compiler.
+    uint32_t declare(const ASTPtr& node) {
+        if (scopes.inCurrentScope(node->symbol)) {
+            throw std::runtime_error("Variable '" + node->value + "' already declared in this scope");
+        }
+        uint32_t variable = variableCount++;
+        scopes.declare(node->symbol, variable);
+        return variable;
+    }
+
+    static bool balancedAsm(const std::string& text) {
+        AsmBlock block;
+        try {
+            block = decodeAsm(text);
+        } catch (const std::exception&) {
+            return false;
+        }
+        int height = 0;
+        for (const AsmOp& op : block) {
+            if (op.op == AsmOpCode::PUSH) height++;
+            if (op.op == AsmOpCode::POP && --height < 0) return false;
+        }
+        return height == 0;
+    }
+
+    bool statement(const ASTPtr& node) {
+        switch (node->type) {
+            case ASTType::BLOCK:
+                scopes.enterScope();
+                for (auto& child : node->children) {
+                    if (!statement(child)) return false;
+                }
+                scopes.leaveScope();
+                return true;
+            case ASTType::VAR_DECL: {
+                uint32_t variable = declare(node);
+                uint32_t value = expression(node->children[0]);
+                write(variable, current, emit(SsaOp::Copy, 0, {value}));
+                return true;
+            }
+            case ASTType::PRINT:
+                emit(SsaOp::Print, 0, {expression(node->children[0])});
+                return true;
+            case ASTType::SNAPSHOT:
+                emit(SsaOp::Snapshot);
+                return true;
+            case ASTType::ASM_BLOCK:
+                if (!balancedAsm(node->value)) return false;
+                fn.asmCode.push_back(node->value);
+                emit(SsaOp::Asm, static_cast<int64_t>(fn.asmCode.size() - 1));
+                return true;
+            case ASTType::IF_STMT: {
+                uint32_t condition = expression(node->children[0]);
+                uint32_t thenBlock = newBlock();
+                uint32_t elseBlock = newBlock();
+                uint32_t join = newBlock();
+                branch(condition, thenBlock, elseBlock);
+                seal(thenBlock);
+                seal(elseBlock);
+                enter(thenBlock);
+                if (!statement(node->children[1])) return false;
+                jump(join);
+                enter(elseBlock);
+                if (node->children.size() == 3 && !statement(node->children[2])) return false;
+                jump(join);
+                seal(join);
+                enter(join);
+                return true;
+            }
+            case ASTType::WHILE_STMT: {
+                uint32_t header = newBlock();
+                uint32_t exit = newBlock();
+                jump(header);
+                fn.loops.push_back({current, header, {header}});
+                openLoops.push_back(fn.loops.size() - 1);
+                enter(header);
+                uint32_t condition = expression(node->children[0]);
+                uint32_t body = newBlock();
+                branch(condition, body, exit);
+                seal(body);
+                enter(body);
+                if (!statement(node->children[1])) return false;
+                jump(header);
+                openLoops.pop_back();
+                seal(header);
+                seal(exit);
+                enter(exit);
+                return true;
+            }
+            case ASTType::RETURN: {
+                uint32_t value = node->children.empty() ? fn.constant(0) : expression(node->children[0]);
+                fn.blocks[current].exit = Exit::Return;
+                fn.blocks[current].value = value;
+                // Code after a return is unreachable; it still gets a block.
+                uint32_t rest = newBlock();
+                seal(rest);
+                enter(rest);
+                return true;
+            }
+            case ASTType::EXPR_STMT:
+                expression(node->children[0]);
+                return true;
+            default:
+                throw std::runtime_error("Unsupported AST node in statement context");
+        }
+    }
+
+    uint32_t expression(const ASTPtr& node) {
+        uint32_t variable;
+        switch (node->type) {
+            case ASTType::NUMBER:
+                return fn.constant(std::stoll(node->value));
+            case ASTType::IDENTIFIER:
+                if (lookup(node->symbol, variable)) return read(variable, current);
+                return emit(SsaOp::LoadGlobal, global(node));
+            case ASTType::CALL: {
+                std::vector<uint32_t> arguments;
+                for (auto& argument : node->children) arguments.push_back(expression(argument));
+                auto callee = std::find_if(fn.callees.begin(), fn.callees.end(),
+                                           [&](const Callee& c) { return c.symbol == node->symbol; });
+                if (callee == fn.callees.end()) callee = fn.callees.insert(callee, {node->symbol, node->value});
+                return emit(SsaOp::Call, callee - fn.callees.begin(), std::move(arguments));
+            }
+            case ASTType::BINARY_OP:
+                return binary(node);
+            case ASTType::ASSIGN: {
+                if (lookup(node->symbol, variable)) {
+                    uint32_t value = expression(node->children[0]);
+                    write(variable, current, emit(SsaOp::Copy, 0, {value}));
+                    return value;
+                }
+                int index = global(node);
+                uint32_t value = expression(node->children[0]);
+                emit(SsaOp::StoreGlobal, index, {value});
+                return value;
+            }
+            default:
+                throw std::runtime_error("Unsupported expression");
+        }
+    }
+
+    uint32_t binary(const ASTPtr& node) {
+        TokenType op = node->op;
+        const ASTPtr& left = node->children[0];
+        // The parser lowers -x to 0 - x.
+        if (op == TokenType::MINUS && left->type == ASTType::NUMBER && std::stoll(left->value) == 0) {
+            return emit(SsaOp::Neg, 0, {expression(node->children[1])});
+        }
+        uint32_t a = expression(left);
+        uint32_t b = expression(node->children[1]);
+        SsaOp kind;
+        switch (op) {
+            case TokenType::PLUS: kind = SsaOp::Add; break;
+            case TokenType::MINUS: kind = SsaOp::Sub; break;
+            case TokenType::STAR: kind = SsaOp::Mul; break;
+            case TokenType::SLASH: kind = SsaOp::Div; break;
+            case TokenType::EQ: kind = SsaOp::CmpEq; break;
+            case TokenType::NEQ: kind = SsaOp::CmpNeq; break;
+            case TokenType::LT: kind = SsaOp::CmpLt; break;
+            case TokenType::LEQ: kind = SsaOp::CmpLeq; break;
+            case TokenType::GT: kind = SsaOp::CmpGt; break;
+            case TokenType::GEQ: kind = SsaOp::CmpGeq; break;
+            default: throw std::runtime_error("Unsupported binary operator '" + node->value + "'");
+        }
+        return emit(kind, 0, {a, b});
+    }
+
+public:
+    Builder(Function& function, const std::function<int(Symbol)>& globals)
+        : fn(function), globalIndex(globals) {}
+
+    // Parameters share the body's outermost scope, as in the compiler.
+    bool build(const ASTPtr& function) {
+        uint32_t entry = newBlock();
+        seal(entry);
+        enter(entry);
+        scopes.enterScope();
+        for (size_t i = 0; i + 1 < function->children.size(); i++) {
+            uint32_t variable = declare(function->children[i]);
+            fn.params.push_back(fn.add(SsaOp::Param, static_cast<int64_t>(i), {}, entry));
+            write(variable, entry, fn.params.back());
+        }
+        for (auto& child : function->children.back()->children) {
+            if (!statement(child)) return false;
+        }
+        if (fn.blocks[current].exit == Exit::None) {
+            fn.blocks[current].exit = Exit::Return;
+            fn.blocks[current].value = fn.constant(0);
+        }
+        return true;
+    }
+};
+
+// Drops blocks the entry cannot reach (code after a return, branches
+// around it) together with the phi operands flowing in from them.
+void removeUnreachable(Function& fn) {
+    for (Block& block : fn.blocks) block.reachable = false;
+    std::vector<uint32_t> work{0};
+    fn.blocks[0].reachable = true;
+    while (!work.empty()) {
+        uint32_t id = work.back();
+        work.pop_back();
+        for (uint32_t next : successors(fn.blocks[id])) {
+            if (!fn.blocks[next].reachable) {
+                fn.blocks[next].reachable = true;
+                work.push_back(next);
+            }
+        }
+    }
+
+    for (Block& block : fn.blocks) {
+        if (!block.reachable) {
+            for (uint32_t id : block.phis) fn.values[id].removed = true;
+            for (uint32_t id : block.body) fn.values[id].removed = true;
+            block.phis.clear();
+            block.body.clear();
+            block.exit = Exit::None;
+            block.value = kNone;
+            continue;
+        }
+        std::vector<uint32_t> preds;
+        std::vector<bool> keep;
+        for (uint32_t pred : block.preds) {
+            keep.push_back(fn.blocks[pred].reachable);
+            if (keep.back()) preds.push_back(pred);
+        }
+        for (uint32_t phi : block.phis) {
+            std::vector<uint32_t> args;
+            for (size_t i = 0; i < keep.size(); i++) {
+                if (keep[i]) args.push_back(fn.values[phi].args[i]);
+            }
+            fn.values[phi].args = std::move(args);
+        }
+        block.preds = std::move(preds);
+    }
+
+    auto unreachable = [&](uint32_t id) { return !fn.blocks[id].reachable; };
+    fn.layout.erase(std::remove_if(fn.layout.begin(), fn.layout.end(), unreachable), fn.layout.end());
+    fn.loops.erase(std::remove_if(fn.loops.begin(), fn.loops.end(),
+                                  [&](const Loop& loop) { return unreachable(loop.header); }),
+                   fn.loops.end());
+    for (Loop& loop : fn.loops) {
+        loop.blocks.erase(std::remove_if(loop.blocks.begin(), loop.blocks.end(), unreachable), loop.blocks.end());
+    }
+}
+
+// Forwards copies to their source and removes phis whose operands are all
+// the same value (or the phi itself), until none are left.
+void propagateCopies(Function& fn) {
+    for (uint32_t id = 0; id < fn.values.size(); id++) {
+        Value& value = fn.values[id];
+        if (!value.removed && value.op == SsaOp::Copy) fn.replace(id, value.args[0]);
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t block : fn.layout) {
+            for (uint32_t phi : fn.blocks[block].phis) {
+                if (fn.values[phi].removed) continue;
+                uint32_t same = kNone;
+                bool trivial = true;
+                for (uint32_t arg : fn.values[phi].args) {
+                    arg = fn.resolve(arg);
+                    if (arg == phi || arg == same) continue;
+                    if (same != kNone) {
+                        trivial = false;
+                        break;
+                    }
+                    same = arg;
+                }
+                if (!trivial) continue;
+                fn.replace(phi, same == kNone ? fn.constant(0) : same);
+                changed = true;
+            }
+        }
+    }
+    fn.rewrite();
+}
+
+// Keeps values with side effects, branch conditions, returned values and
+// everything they depend on.
+void eliminateDeadCode(Function& fn) {
+    std::vector<bool> live(fn.values.size(), false);
+    std::vector<uint32_t> work;
+    auto mark = [&](uint32_t id) {
+        if (!live[id]) {
+            live[id] = true;
+            work.push_back(id);
+        }
+    };
+    for (uint32_t block : fn.layout) {
+        for (uint32_t id : fn.blocks[block].body) {
+            if (hasSideEffects(fn, fn.values[id])) mark(id);
+        }
+        if (fn.blocks[block].value != kNone) mark(fn.blocks[block].value);
+    }
+    while (!work.empty()) {
+        uint32_t id = work.back();
+        work.pop_back();
+        for (uint32_t arg : fn.values[id].args) mark(arg);
+    }
+    for (uint32_t block : fn.layout) {
+        for (uint32_t id : fn.blocks[block].phis) {
+            if (!live[id]) fn.values[id].removed = true;
+        }
+        for (uint32_t id : fn.blocks[block].body) {
+            if (!live[id]) fn.values[id].removed = true;
+        }
+    }
+    fn.rewrite();
+}
+
+// Immediate dominators (Cooper, Harvey and Kennedy) and the dominator tree
+// children of each reachable block.
+std::vector<std::vector<uint32_t>> dominatorTree(const Function& fn) {
+    size_t count = fn.blocks.size();
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> position(count, kNone);
+    std::vector<bool> visited(count, false);
+    std::vector<std::pair<uint32_t, size_t>> stack{{0, 0}};
+    visited[0] = true;
+    while (!stack.empty()) {
+        auto& [id, next] = stack.back();
+        std::vector<uint32_t> succs = successors(fn.blocks[id]);
+        if (next < succs.size()) {
+            uint32_t succ = succs[next++];
+            if (!visited[succ]) {
+                visited[succ] = true;
+                stack.emplace_back(succ, 0);
+            }
+            continue;
+        }
+        order.push_back(id);
+        stack.pop_back();
+    }
+    std::reverse(order.begin(), order.end());
+    for (size_t i = 0; i < order.size(); i++) position[order[i]] = static_cast<uint32_t>(i);
+
+    std::vector<uint32_t> idom(count, kNone);
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < order.size(); i++) {
+            uint32_t id = order[i];
+            uint32_t dominator = kNone;
+            for (uint32_t pred : fn.blocks[id].preds) {
+                if (idom[pred] == kNone) continue;
+                if (dominator == kNone) {
+                    dominator = pred;
+                    continue;
+                }
+                uint32_t a = pred;
+                uint32_t b = dominator;
+                while (a != b) {
+                    while (position[a] > position[b]) a = idom[a];
+                    while (position[b] > position[a]) b = idom[b];
+                }
+                dominator = a;
+            }
+            if (idom[id] != dominator) {
+                idom[id] = dominator;
+                changed = true;
+            }
+        }
+    }
+
+    std::vector<std::vector<uint32_t>> children(count);
+    for (uint32_t id : order) {
+        if (id != 0) children[idom[id]].push_back(id);
+    }
+    return children;
+}
+
+// Global value numbering over the dominator tree for arithmetic. Within a
+// block, a load after a store or load of the same global with no call in
+// between gets the number of that value, so arithmetic on it matches; the
+// load itself stays, reloading a global is as cheap as reloading a slot.
+void eliminateCommonSubexpressions(Function& fn) {
+    std::vector<std::vector<uint32_t>> children = dominatorTree(fn);
+    std::vector<uint32_t> number(fn.values.size());
+    for (uint32_t id = 0; id < number.size(); id++) number[id] = id;
+    std::map<std::vector<int64_t>, uint32_t> available;
+    std::vector<std::vector<int64_t>> undo;
+    // (block, marker): a marker entry pops that block's keys on the way up.
+    std::vector<std::pair<uint32_t, bool>> stack{{0, false}};
+    std::vector<size_t> undoMark(fn.blocks.size(), 0);
+
+    while (!stack.empty()) {
+        auto [id, leaving] = stack.back();
+        stack.pop_back();
+        if (leaving) {
+            while (undo.size() > undoMark[id]) {
+                available.erase(undo.back());
+                undo.pop_back();
+            }
+            continue;
+        }
+        undoMark[id] = undo.size();
+        stack.emplace_back(id, true);
+        for (auto child = children[id].rbegin(); child != children[id].rend(); ++child) {
+            stack.emplace_back(*child, false);
+        }
+
+        std::unordered_map<int64_t, uint32_t> globals;
+        for (uint32_t value : fn.blocks[id].body) {
+            Value& v = fn.values[value];
+            for (uint32_t& arg : v.args) arg = fn.resolve(arg);
+            if (v.op == SsaOp::Call) {
+                globals.clear();
+            } else if (v.op == SsaOp::StoreGlobal) {
+                globals[v.operand] = number[v.args[0]];
+            } else if (v.op == SsaOp::LoadGlobal) {
+                auto known = globals.find(v.operand);
+                if (known != globals.end()) number[value] = known->second;
+                else globals[v.operand] = value;
+            } else if (arithmetic(v.op)) {
+                // Constants go on the right, where the superinstructions
+                // expect immediates.
+                if (commutative(v.op) && fn.values[v.args[0]].op == SsaOp::Const) std::swap(v.args[0], v.args[1]);
+                std::vector<int64_t> key{static_cast<int64_t>(v.op)};
+                for (uint32_t arg : v.args) key.push_back(number[arg]);
+                if (commutative(v.op) && key[1] > key[2]) std::swap(key[1], key[2]);
+                auto found = available.find(key);
+                if (found != available.end()) {
+                    fn.replace(value, found->second);
+                } else {
+                    available.emplace(key, value);
+                    undo.push_back(std::move(key));
+                }
+            }
+        }
+        if (fn.blocks[id].value != kNone) fn.blocks[id].value = fn.resolve(fn.blocks[id].value);
+    }
+    fn.rewrite();
+}
+
+// Moves arithmetic whose operands are all defined outside a loop into its
+// preheader, inner loops first so that code can keep moving outwards.
+// Global loads move when the loop stores to neither that global nor calls
+// a function. Divisions that may trap stay, the loop might not run.
+void hoistLoopInvariants(Function& fn) {
+    std::vector<bool> inLoop(fn.blocks.size(), false);
+    for (auto loop = fn.loops.rbegin(); loop != fn.loops.rend(); ++loop) {
+        for (uint32_t block : loop->blocks) inLoop[block] = true;
+
+        bool calls = false;
+        std::set<int64_t> stored;
+        for (uint32_t block : loop->blocks) {
+            for (uint32_t id : fn.blocks[block].body) {
+                if (fn.values[id].op == SsaOp::Call) calls = true;
+                if (fn.values[id].op == SsaOp::StoreGlobal) stored.insert(fn.values[id].operand);
+            }
+        }
+
+        Block& preheader = fn.blocks[loop->preheader];
+        for (uint32_t block : fn.layout) {
+            if (!inLoop[block]) continue;
+            std::vector<uint32_t> kept;
+            for (uint32_t id : fn.blocks[block].body) {
+                const Value& value = fn.values[id];
+                bool movable = value.op == SsaOp::LoadGlobal ? !calls && !stored.count(value.operand)
+                                                             : arithmetic(value.op) && !mayTrap(fn, value);
+                for (uint32_t arg : value.args) {
+                    uint32_t home = fn.values[arg].block;
+                    if (home != kNone && inLoop[home]) movable = false;
+                }
+                if (!movable) {
+                    kept.push_back(id);
+                    continue;
+                }
+                fn.values[id].block = loop->preheader;
+                preheader.body.push_back(id);
+            }
+            fn.blocks[block].body = std::move(kept);
+        }
+
+        for (uint32_t block : loop->blocks) inLoop[block] = false;
+    }
+}
+
+// Dense bit set over the values that live in frame slots.
+class Bits {
+    std::vector<uint64_t> words;
+
+public:
+    explicit Bits(size_t count = 0) : words((count + 63) / 64, 0) {}
+    bool test(uint32_t i) const { return words[i >> 6] >> (i & 63) & 1; }
+    void set(uint32_t i) { words[i >> 6] |= uint64_t(1) << (i & 63); }
+    void reset(uint32_t i) { words[i >> 6] &= ~(uint64_t(1) << (i & 63)); }
+    bool merge(const Bits& other) {
+        bool changed = false;
+        for (size_t i = 0; i < words.size(); i++) {
+            uint64_t merged = words[i] | other.words[i];
+            changed |= merged != words[i];
+            words[i] = merged;
+        }
+        return changed;
+    }
+    template <typename F>
+    void each(F f) const {
+        for (size_t i = 0; i < words.size(); i++) {
+            for (uint64_t word = words[i]; word; word &= word - 1) {
+                f(static_cast<uint32_t>(i * 64 + static_cast<size_t>(__builtin_ctzll(word))));
+            }
+        }
+    }
+};
+
+// Out of SSA, back to stack bytecode. A value used once, as an operand of
+// the instruction right after it in its block, stays on the operand stack
+// (instructions nest into trees that keep their original order); constants
+// are pushed at each use; every other value gets a frame slot. Slots are
+// shared by values whose live ranges do not overlap, preferring the slot of
+// the phi a value flows into so that the copy at the end of the block
+// disappears.
+class Lowering {
+    Function& fn;
+    LoweredFunction& out;
+    bool tailCalls;
+    std::vector<uint32_t> uses;
+    std::vector<bool> nested;
+    // Dense index of the values that need a slot, kNone for the others.
+    std::vector<uint32_t> dense;
+    std::vector<uint32_t> slotValues;
+    std::vector<uint32_t> slot;
+    std::vector<size_t> blockStart;
+    std::vector<std::pair<size_t, uint32_t>> fixups;
+
+    bool needsSlot(uint32_t id) const {
+        const Value& value = fn.values[id];
+        if (value.op == SsaOp::Phi || value.op == SsaOp::Param) return true;
+        return value.op != SsaOp::Const && producesValue(value.op) && !nested[id] && uses[id] > 0;
+    }
+
+    // Marks the operands computed by the instructions right before `user`
+    // (at `position` in `body`, or past the end for the block's exit) as
+    // nested, and returns where the tree starts.
+    size_t nest(const std::vector<uint32_t>& body, size_t position, const std::vector<uint32_t>& args) {
+        size_t start = position;
+        for (auto arg = args.rbegin(); arg != args.rend(); ++arg) {
+            if (start == 0 || body[start - 1] != *arg) continue;
+            const Value& value = fn.values[*arg];
+            if (uses[*arg] != 1 || !producesValue(value.op)) continue;
+            nested[*arg] = true;
+            start = nest(body, start - 1, value.args);
+        }
+        return start;
+    }
+
+    void leaves(uint32_t id, std::vector<uint32_t>& result) const {
+        for (uint32_t arg : fn.values[id].args) {
+            if (nested[arg]) leaves(arg, result);
+            else if (dense[arg] != kNone) result.push_back(dense[arg]);
+        }
+    }
+
+    void operand(uint32_t id) {
+        const Value& value = fn.values[id];
+        if (nested[id]) tree(id);
+        else if (value.op == SsaOp::Const) out.code.emplace_back(OpCode::PUSH, value.operand);
+        else out.code.emplace_back(OpCode::LOAD_LOCAL, slot[dense[id]]);
+    }
+
+    void tree(uint32_t id) {
+        const Value& value = fn.values[id];
+        for (uint32_t arg : value.args) operand(arg);
+        switch (value.op) {
+            case SsaOp::Copy: break;
+            case SsaOp::Add: out.code.emplace_back(OpCode::ADD); break;
+            case SsaOp::Sub: out.code.emplace_back(OpCode::SUB); break;
+            case SsaOp::Mul: out.code.emplace_back(OpCode::MUL); break;
+            case SsaOp::Div: out.code.emplace_back(OpCode::DIV); break;
+            case SsaOp::Neg: out.code.emplace_back(OpCode::NEG); break;
+            case SsaOp::CmpEq: out.code.emplace_back(OpCode::CMP_EQ); break;
+            case SsaOp::CmpNeq: out.code.emplace_back(OpCode::CMP_NEQ); break;
+            case SsaOp::CmpLt: out.code.emplace_back(OpCode::CMP_LT); break;
+            case SsaOp::CmpLeq: out.code.emplace_back(OpCode::CMP_LEQ); break;
+            case SsaOp::CmpGt: out.code.emplace_back(OpCode::CMP_GT); break;
+            case SsaOp::CmpGeq: out.code.emplace_back(OpCode::CMP_GEQ); break;
+            case SsaOp::LoadGlobal: out.code.emplace_back(OpCode::LOAD_GLOBAL, value.operand); break;
+            case SsaOp::StoreGlobal: out.code.emplace_back(OpCode::STORE_GLOBAL, value.operand); break;
+            case SsaOp::Call:
+                out.code.emplace_back(OpCode::CALL, packOperands(static_cast<uint32_t>(value.operand),
+                                                                 static_cast<int32_t>(value.args.size())));
+                break;
+            case SsaOp::Print: out.code.emplace_back(OpCode::PRINT); break;
+            case SsaOp::Asm: out.code.emplace_back(OpCode::EXEC_ASM, value.operand); break;
+            case SsaOp::Snapshot: out.code.emplace_back(OpCode::SNAPSHOT); break;
+            case SsaOp::Const:
+            case SsaOp::Param:
+            case SsaOp::Phi: throw std::runtime_error("Internal compiler error: unexpected SSA value");
+        }
+    }
+
+    void jumpTo(uint32_t target) {
+        fixups.emplace_back(out.code.size(), target);
+        out.code.emplace_back(OpCode::JMP, 0);
+    }
+
+    size_t predIndex(uint32_t block, uint32_t pred) const {
+        const std::vector<uint32_t>& preds = fn.blocks[block].preds;
+        return static_cast<size_t>(std::find(preds.begin(), preds.end(), pred) - preds.begin());
+    }
+
+    void assignSlots() {
+        for (uint32_t block : fn.layout) {
+            const Block& b = fn.blocks[block];
+            for (uint32_t id : b.phis) {
+                for (uint32_t arg : fn.values[id].args) uses[arg]++;
+            }
+            for (uint32_t id : b.body) {
+                for (uint32_t arg : fn.values[id].args) uses[arg]++;
+            }
+            if (b.value != kNone) uses[b.value]++;
+        }
+        for (uint32_t block : fn.layout) {
+            const Block& b = fn.blocks[block];
+            if (b.value != kNone) nest(b.body, b.body.size(), {b.value});
+            for (size_t i = b.body.size(); i-- > 0;) {
+                if (!nested[b.body[i]]) i = nest(b.body, i, fn.values[b.body[i]].args);
+            }
+        }
+        for (uint32_t id : fn.params) {
+            dense[id] = static_cast<uint32_t>(slotValues.size());
+            slotValues.push_back(id);
+        }
+        for (uint32_t block : fn.layout) {
+            const Block& b = fn.blocks[block];
+            for (uint32_t id : b.phis) {
+                dense[id] = static_cast<uint32_t>(slotValues.size());
+                slotValues.push_back(id);
+            }
+            for (uint32_t id : b.body) {
+                if (needsSlot(id)) {
+                    dense[id] = static_cast<uint32_t>(slotValues.size());
+                    slotValues.push_back(id);
+                }
+            }
+        }
+
+        // Liveness: phi operands are read at the end of the predecessor,
+        // phis are defined on entry to their block.
+        size_t count = slotValues.size();
+        std::vector<Bits> liveIn(fn.blocks.size(), Bits(count));
+        std::vector<uint32_t> scratch;
+        auto liveOut = [&](uint32_t block) {
+            Bits live(count);
+            for (uint32_t succ : successors(fn.blocks[block])) {
+                Bits in = liveIn[succ];
+                size_t index = predIndex(succ, block);
+                for (uint32_t phi : fn.blocks[succ].phis) in.reset(dense[phi]);
+                for (uint32_t phi : fn.blocks[succ].phis) {
+                    uint32_t source = fn.values[phi].args[index];
+                    if (dense[source] != kNone) in.set(dense[source]);
+                }
+                live.merge(in);
+            }
+            return live;
+        };
+        auto walk = [&](uint32_t block, Bits& live, auto&& onDefinition) {
+            const Block& b = fn.blocks[block];
+            if (b.value != kNone) {
+                scratch.clear();
+                if (nested[b.value]) leaves(b.value, scratch);
+                else if (dense[b.value] != kNone) scratch.push_back(dense[b.value]);
+                for (uint32_t use : scratch) live.set(use);
+            }
+            for (size_t i = b.body.size(); i-- > 0;) {
+                uint32_t id = b.body[i];
+                if (nested[id]) continue;
+                if (dense[id] != kNone) {
+                    live.reset(dense[id]);
+                    onDefinition(dense[id], live);
+                }
+                scratch.clear();
+                leaves(id, scratch);
+                for (uint32_t use : scratch) live.set(use);
+            }
+        };
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto block = fn.layout.rbegin(); block != fn.layout.rend(); ++block) {
+                Bits live = liveOut(*block);
+                walk(*block, live, [](uint32_t, const Bits&) {});
+                for (uint32_t phi : fn.blocks[*block].phis) live.set(dense[phi]);
+                changed |= liveIn[*block].merge(live);
+            }
+        }
+
+        std::vector<std::vector<uint32_t>> interference(count);
+        auto interfere = [&](uint32_t a, uint32_t b) {
+            if (a == b) return;
+            interference[a].push_back(b);
+            interference[b].push_back(a);
+        };
+        for (uint32_t block : fn.layout) {
+            const Block& b = fn.blocks[block];
+            Bits live = liveOut(block);
+            // The phi copies at the end of a jump overwrite the phis' slots
+            // while everything live out of the block is still needed.
+            if (b.exit == Exit::Jump) {
+                const Block& target = fn.blocks[b.target[0]];
+                size_t index = predIndex(b.target[0], block);
+                for (uint32_t phi : target.phis) {
+                    uint32_t source = fn.values[phi].args[index];
+                    live.each([&](uint32_t other) {
+                        if (slotValues[other] != source) interfere(dense[phi], other);
+                    });
+                }
+            }
+            walk(block, live, [&](uint32_t definition, const Bits& liveAfter) {
+                liveAfter.each([&](uint32_t other) { interfere(definition, other); });
+            });
+            for (uint32_t phi : b.phis) {
+                live.each([&](uint32_t other) { interfere(dense[phi], other); });
+                for (uint32_t other : b.phis) interfere(dense[phi], dense[other]);
+            }
+            if (block == 0) {
+                for (uint32_t param : fn.params) {
+                    live.each([&](uint32_t other) { interfere(dense[param], other); });
+                }
+            }
+        }
+
+        // Greedy coloring in definition order; parameters are fixed to the
+        // slots the caller fills, phis and their operands prefer each
+        // other's slot.
+        std::vector<std::vector<uint32_t>> partners(count);
+        for (uint32_t value : slotValues) {
+            if (fn.values[value].op != SsaOp::Phi) continue;
+            for (uint32_t arg : fn.values[value].args) {
+                if (dense[arg] == kNone) continue;
+                partners[dense[value]].push_back(dense[arg]);
+                partners[dense[arg]].push_back(dense[value]);
+            }
+        }
+        slot.assign(count, kNone);
+        uint32_t slots = 0;
+        std::vector<uint32_t> taken;
+        for (uint32_t i = 0; i < count; i++) {
+            taken.clear();
+            for (uint32_t other : interference[i]) {
+                if (slot[other] != kNone) taken.push_back(slot[other]);
+            }
+            std::sort(taken.begin(), taken.end());
+            auto free = [&](uint32_t s) { return !std::binary_search(taken.begin(), taken.end(), s); };
+            uint32_t chosen = i < fn.params.size() ? i : kNone;
+            for (uint32_t partner : partners[i]) {
+                if (chosen == kNone && slot[partner] != kNone && free(slot[partner])) {
+                    chosen = slot[partner];
+                    break;
+                }
+            }
+            for (uint32_t s = 0; chosen == kNone; s++) {
+                if (free(s)) chosen = s;
+            }
+            slot[i] = chosen;
+            slots = std::max(slots, chosen + 1);
+        }
+        out.frameSize = std::max(slots, static_cast<uint32_t>(fn.params.size()));
+    }
+
+    void emitBlocks() {
+        blockStart.assign(fn.blocks.size(), 0);
+        for (size_t i = 0; i < fn.layout.size(); i++) {
+            uint32_t block = fn.layout[i];
+            uint32_t next = i + 1 < fn.layout.size() ? fn.layout[i + 1] : kNone;
+            const Block& b = fn.blocks[block];
+            blockStart[block] = out.code.size();
+
+            for (uint32_t id : b.body) {
+                if (nested[id]) continue;
+                tree(id);
+                if (dense[id] != kNone) out.code.emplace_back(OpCode::STORE_LOCAL, slot[dense[id]]);
+                else if (producesValue(fn.values[id].op)) out.code.emplace_back(OpCode::POP);
+            }
+
+            switch (b.exit) {
+                case Exit::Jump: {
+                    // Parallel copy into the target's phis: push every source,
+                    // then store in reverse.
+                    const Block& target = fn.blocks[b.target[0]];
+                    size_t index = predIndex(b.target[0], block);
+                    std::vector<uint32_t> stores;
+                    for (uint32_t phi : target.phis) {
+                        uint32_t source = fn.values[phi].args[index];
+                        if (dense[source] != kNone && slot[dense[source]] == slot[dense[phi]]) continue;
+                        operand(source);
+                        stores.push_back(slot[dense[phi]]);
+                    }
+                    for (auto store = stores.rbegin(); store != stores.rend(); ++store) {
+                        out.code.emplace_back(OpCode::STORE_LOCAL, *store);
+                    }
+                    if (b.target[0] != next) jumpTo(b.target[0]);
+                    break;
+                }
+                case Exit::Branch:
+                    operand(b.value);
+                    fixups.emplace_back(out.code.size(), b.target[1]);
+                    out.code.emplace_back(OpCode::JMP_IF_FALSE, 0);
+                    if (b.target[0] != next) jumpTo(b.target[0]);
+                    break;
+                case Exit::Return:
+                    operand(b.value);
+                    // A call computed right here for the return leaves only
+                    // its arguments on the stack: the callee can take over
+                    // the frame.
+                    if (tailCalls && nested[b.value] && fn.values[b.value].op == SsaOp::Call) {
+                        out.code.back().op = OpCode::TAIL_CALL;
+                    } else {
+                        out.code.emplace_back(OpCode::RET);
+                    }
+                    break;
+                case Exit::None:
+                    throw std::runtime_error("Internal compiler error: unterminated block");
+            }
+        }
+        for (auto& [index, target] : fixups) out.code[index].operand = static_cast<int64_t>(blockStart[target]);
+        removeJumpsToNext();
+    }
+
+    // Blocks that lower to nothing (an else with no code, a join whose phi
+    // copies all coalesced) leave jumps to the very next instruction.
+    void removeJumpsToNext() {
+        std::vector<size_t> moved(out.code.size() + 1);
+        size_t kept = 0;
+        for (size_t pc = 0; pc < out.code.size(); pc++) {
+            moved[pc] = kept;
+            const Instruction& instruction = out.code[pc];
+            if (instruction.op != OpCode::JMP || static_cast<size_t>(instruction.operand) != pc + 1) kept++;
+        }
+        moved[out.code.size()] = kept;
+        if (kept == out.code.size()) return;
+        std::vector<Instruction> code;
+        code.reserve(kept);
+        for (size_t pc = 0; pc < out.code.size(); pc++) {
+            Instruction instruction = out.code[pc];
+            if (instruction.op == OpCode::JMP && static_cast<size_t>(instruction.operand) == pc + 1) continue;
+            if (instruction.op == OpCode::JMP || instruction.op == OpCode::JMP_IF_FALSE) {
+                instruction.operand = static_cast<int64_t>(moved[static_cast<size_t>(instruction.operand)]);
+            }
+            code.push_back(instruction);
+        }
+        out.code = std::move(code);
+    }
+
+public:
+    Lowering(Function& function, LoweredFunction& result, bool allowTailCalls)
+        : fn(function), out(result), tailCalls(allowTailCalls), uses(function.values.size(), 0),
+          nested(function.values.size(), false), dense(function.values.size(), kNone) {}
+
+    void run() {
+        assignSlots();
+        emitBlocks();
+        out.callees = fn.callees;
+        out.asmCode = fn.asmCode;
+    }
+};
+
+}
+
+bool optimizeFunction(const ASTPtr& function, const std::function<int(Symbol)>& globalIndex,
+                      const SsaPasses& passes, LoweredFunction& out) {
+    Function fn;
+    if (!Builder(fn, globalIndex).build(function)) return false;
+
+    removeUnreachable(fn);
+    propagateCopies(fn);
+    if (passes.cse) eliminateCommonSubexpressions(fn);
+    if (passes.licm) hoistLoopInvariants(fn);
+    eliminateDeadCode(fn);
+
+    LoweredFunction lowered;
+    Lowering(fn, lowered, passes.tailCalls).run();
+    out = std::move(lowered);
+    return true;
+}
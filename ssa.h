@@ -0,0 +1,47 @@
+#pragma once
+#include "ast.h"
+#include "symbols.h"
+#include "token.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Which passes run on a function's SSA form. Copy propagation and dead-code
+// elimination always run. With tailCalls, a returned call lowers to
+// TAIL_CALL.
+struct SsaPasses {
+    bool cse = true;
+    bool licm = true;
+    bool tailCalls = true;
+};
+
+// Bytecode for one function body, ready to be appended to a program. Jump
+// targets are relative to the first instruction, CALL and TAIL_CALL
+// operands pack an index into `callees` with the argument count, and
+// EXEC_ASM operands index `asmCode`.
+struct Callee {
+    Symbol symbol;
+    std::string name;
+};
+
+struct LoweredFunction {
+    std::vector<Instruction> code;
+    std::vector<Callee> callees;
+    std::vector<std::string> asmCode;
+    uint32_t frameSize = 0;
+};
+
+// Builds the SSA form of a FUNC_DECL's body: a CFG of basic blocks split at
+// `if` and `while`, with every local promoted to SSA values joined by phis.
+// Globals stay in memory. Runs the passes, then lowers back to stack
+// bytecode, keeping values that feed the next instruction on the operand
+// stack and coloring the rest into as few local slots as their live ranges
+// allow, parameters staying in the slots the caller moved them to.
+// `globalIndex` returns the slot of a visible global or -1.
+//
+// Returns false, leaving `out` untouched, for bodies the stack layout
+// cannot model: asm blocks that leave values on the operand stack or pop
+// values they did not push.
+bool optimizeFunction(const ASTPtr& function, const std::function<int(Symbol)>& globalIndex,
+                      const SsaPasses& passes, LoweredFunction& out);
@@ -0,0 +1,70 @@
+#include "strength.h"
+#include "peephole.h"
+#include <limits>
+#include <vector>
+
+int powerOfTwoShift(int64_t value) {
+    if (value < 2 || value > (int64_t(1) << 62) || (value & (value - 1)) != 0) return -1;
+    return __builtin_ctzll(static_cast<uint64_t>(value));
+}
+
+bool magicDivisible(int64_t divisor) {
+    return divisor != 0 && divisor != 1 && divisor != -1 && divisor != std::numeric_limits<int64_t>::min() &&
+           powerOfTwoShift(divisor) < 0;
+}
+
+// Hacker's Delight, figure 10-1, for 64 bits: the smallest p >= 64 for
+// which 2^p / |d| rounded up is close enough to give exact quotients for
+// every dividend.
+MagicDivisor magicDivisor(int64_t divisor) {
+    const uint64_t two63 = uint64_t(1) << 63;
+    uint64_t ad = divisor < 0 ? 0 - static_cast<uint64_t>(divisor) : static_cast<uint64_t>(divisor);
+    uint64_t t = two63 + (static_cast<uint64_t>(divisor) >> 63);
+    uint64_t anc = t - 1 - t % ad;
+    int p = 63;
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+    uint64_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) { q1++; r1 -= anc; }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) { q2++; r2 -= ad; }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    MagicDivisor magic;
+    uint64_t multiplier = q2 + 1;
+    magic.multiplier = static_cast<int64_t>(divisor < 0 ? 0 - multiplier : multiplier);
+    magic.shift = p - 64;
+    magic.correction = 0;
+    if (divisor > 0 && magic.multiplier < 0) magic.correction = 1;
+    if (divisor < 0 && magic.multiplier > 0) magic.correction = -1;
+    return magic;
+}
+
+namespace {
+
+int64_t shiftOperand(const Instruction* w) {
+    return powerOfTwoShift(w[0].operand);
+}
+
+bool powerOfTwo(const Instruction* w) {
+    return powerOfTwoShift(w[0].operand) > 0;
+}
+
+}
+
+void reduceStrength(Program& program) {
+    static const std::vector<FusionRule> rules = {
+        {{OpCode::PUSH, OpCode::MUL}, OpCode::SHL_IMM, powerOfTwo, shiftOperand},
+        {{OpCode::PUSH, OpCode::DIV}, OpCode::DIV_POW2, powerOfTwo, shiftOperand},
+        {{OpCode::PUSH, OpCode::DIV}, OpCode::DIV_MAGIC,
+         [](const Instruction* w) { return magicDivisible(w[0].operand); },
+         [](const Instruction* w) { return w[0].operand; }},
+    };
+    fuseSuperinstructions(program, rules);
+}
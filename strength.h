@@ -0,0 +1,50 @@
+#pragma once
+#include "program.h"
+#include <cstdint>
+
+// Multiplication and division by constants without MUL and DIV, after
+// Granlund and Montgomery, "Division by Invariant Integers using
+// Multiplication", and Hacker's Delight ch. 10. Every quotient rounds
+// toward zero exactly like C++ `/`, for all int64 dividends.
+
+// n / d computed as the high half of n * multiplier, corrected by n when
+// the true multiplier lies outside int64 (+1 adds n, -1 subtracts it),
+// shifted right by `shift`, plus one if that is negative.
+struct MagicDivisor {
+    int64_t multiplier;
+    int32_t shift;
+    int32_t correction;
+};
+
+// k for a power of two 2^k in [2, 2^62], else -1.
+int powerOfTwoShift(int64_t value);
+
+// Whether x / divisor is rewritten to DIV_MAGIC: not 0 and -1, which trap,
+// not 1 and INT64_MIN, and not a positive power of two (DIV_POW2).
+bool magicDivisible(int64_t divisor);
+MagicDivisor magicDivisor(int64_t divisor);
+
+inline int64_t shiftLeft(int64_t n, int shift) {
+    return static_cast<int64_t>(static_cast<uint64_t>(n) << shift);
+}
+
+// Negative dividends are biased by 2^shift - 1 so the arithmetic shift
+// rounds toward zero instead of down.
+inline int64_t divideByPowerOfTwo(int64_t n, int shift) {
+    uint64_t bias = static_cast<uint64_t>(n >> 63) >> (64 - shift);
+    return static_cast<int64_t>(static_cast<uint64_t>(n) + bias) >> shift;
+}
+
+inline int64_t divideByMagic(int64_t n, const MagicDivisor& magic) {
+    __int128 product = static_cast<__int128>(n) * magic.multiplier;
+    uint64_t high = static_cast<uint64_t>(static_cast<int64_t>(product >> 64));
+    if (magic.correction > 0) high += static_cast<uint64_t>(n);
+    if (magic.correction < 0) high -= static_cast<uint64_t>(n);
+    int64_t q = static_cast<int64_t>(high) >> magic.shift;
+    return q + static_cast<int64_t>(static_cast<uint64_t>(q) >> 63);
+}
+
+// Rewrites PUSH c followed by MUL or DIV into SHL_IMM, DIV_POW2 and
+// DIV_MAGIC, keeping every other instruction and remapping branches like
+// fuseSuperinstructions. Run before superinstruction fusion.
+void reduceStrength(Program& program);
@@ -0,0 +1,40 @@
+#include "symbols.h"
+
+namespace {
+
+// FNV-1a.
+uint64_t hashName(std::string_view name) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : name) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+}
+
+void Interner::grow() {
+    std::vector<uint32_t> old = std::move(slots);
+    slots.assign(old.empty() ? 64 : old.size() * 2, 0);
+    size_t mask = slots.size() - 1;
+    for (uint32_t entry : old) {
+        if (entry == 0) continue;
+        size_t i = hashName(names[entry - 1]) & mask;
+        while (slots[i] != 0) i = (i + 1) & mask;
+        slots[i] = entry;
+    }
+}
+
+Symbol Interner::intern(std::string_view name) {
+    if ((names.size() + 1) * 2 > slots.size()) grow();
+    size_t mask = slots.size() - 1;
+    size_t i = hashName(name) & mask;
+    while (slots[i] != 0) {
+        if (names[slots[i] - 1] == name) return slots[i] - 1;
+        i = (i + 1) & mask;
+    }
+    names.emplace_back(name);
+    slots[i] = static_cast<uint32_t>(names.size());
+    return static_cast<Symbol>(names.size() - 1);
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Identifiers are interned by the lexer: every distinct name in a source
+// gets a dense id, and the later stages compare and index by that id
+// instead of by string.
+using Symbol = uint32_t;
+constexpr Symbol kNoSymbol = UINT32_MAX;
+
+// Open-addressing hash set of names (linear probing, power-of-two
+// capacity kept at most half full). Slots hold id + 1, 0 when empty.
+class Interner {
+    std::vector<std::string> names;
+    std::vector<uint32_t> slots;
+
+    void grow();
+
+public:
+    Symbol intern(std::string_view name);
+    const std::string& name(Symbol symbol) const { return names[symbol]; }
+    size_t size() const { return names.size(); }
+};
+
+// Bindings of interned names across nested scopes in one flat
+// open-addressing table keyed by symbol. Each slot points at the symbol's
+// innermost binding, and each binding at the one it shadows and the scope
+// depth it was made at, so a lookup is one probe sequence and leaving a
+// scope unwinds only the bindings it made. Slots are never removed, so the
+// table grows with the names bound, not with the program's symbol count.
+// Pointers returned by find() are valid until the next declare().
+template <typename T>
+class ScopedSymbols {
+    struct Binding {
+        Symbol symbol;
+        uint32_t depth;
+        int32_t shadowed;
+        T value;
+    };
+    struct Slot {
+        Symbol symbol = kNoSymbol;
+        int32_t innermost = -1;
+    };
+    std::vector<Slot> slots;
+    size_t used = 0;
+    std::vector<Binding> bindings;
+    std::vector<size_t> scopeStarts;
+
+    static size_t hash(Symbol symbol) { return static_cast<size_t>((symbol * 0x9E3779B97F4A7C15ull) >> 32); }
+
+    const Slot* lookup(Symbol symbol) const {
+        if (slots.empty()) return nullptr;
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash(symbol) & mask;; i = (i + 1) & mask) {
+            if (slots[i].symbol == symbol) return &slots[i];
+            if (slots[i].symbol == kNoSymbol) return nullptr;
+        }
+    }
+
+    Slot& insert(Symbol symbol) {
+        if ((used + 1) * 2 > slots.size()) {
+            std::vector<Slot> old = std::move(slots);
+            slots.assign(old.empty() ? 16 : old.size() * 2, Slot());
+            for (const Slot& slot : old) {
+                if (slot.symbol != kNoSymbol) place(slot.symbol) = slot;
+            }
+        }
+        Slot& slot = place(symbol);
+        if (slot.symbol == kNoSymbol) {
+            slot.symbol = symbol;
+            used++;
+        }
+        return slot;
+    }
+
+    Slot& place(Symbol symbol) {
+        size_t mask = slots.size() - 1;
+        size_t i = hash(symbol) & mask;
+        while (slots[i].symbol != kNoSymbol && slots[i].symbol != symbol) i = (i + 1) & mask;
+        return slots[i];
+    }
+
+public:
+    void clear() {
+        slots.clear();
+        used = 0;
+        bindings.clear();
+        scopeStarts.clear();
+    }
+
+    void enterScope() { scopeStarts.push_back(bindings.size()); }
+
+    void leaveScope() {
+        if (scopeStarts.empty()) return;
+        size_t start = scopeStarts.back();
+        scopeStarts.pop_back();
+        while (bindings.size() > start) {
+            place(bindings.back().symbol).innermost = bindings.back().shadowed;
+            bindings.pop_back();
+        }
+    }
+
+    size_t depth() const { return scopeStarts.size(); }
+
+    T* find(Symbol symbol) {
+        const Slot* slot = lookup(symbol);
+        if (!slot || slot->innermost < 0) return nullptr;
+        return &bindings[static_cast<size_t>(slot->innermost)].value;
+    }
+
+    // Whether the innermost scope already binds `symbol`.
+    bool inCurrentScope(Symbol symbol) const {
+        const Slot* slot = lookup(symbol);
+        return slot && slot->innermost >= 0 && bindings[static_cast<size_t>(slot->innermost)].depth == depth();
+    }
+
+    T& declare(Symbol symbol, const T& value) {
+        Slot& slot = insert(symbol);
+        bindings.push_back({symbol, static_cast<uint32_t>(depth()), slot.innermost, value});
+        slot.innermost = static_cast<int32_t>(bindings.size() - 1);
+        return bindings.back().value;
+    }
+};
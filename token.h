@@ -1,8 +1,10 @@
 #pragma once
 
+#include "symbols.h"
 #include <array>
 #include <cstdint>
 #include <string>
+#include <type_traits>
 
 enum class TokenType {
     END_OF_FILE,
@@ -17,6 +19,7 @@ enum class TokenType {
     ELSE,
     WHILE,
     PRINT,
+    SNAPSHOT,
     PLUS,
     MINUS,
     STAR,
@@ -42,9 +45,11 @@ struct Token {
     TokenType type;
     std::string value;
     int line;
+    // Interned name of an IDENTIFIER.
+    Symbol symbol = kNoSymbol;
 };
 
-enum class OpCode {
+enum class OpCode : uint8_t {
     NOP,
     PUSH,
     POP,
@@ -67,11 +72,51 @@ enum class OpCode {
     JMP_IF_FALSE,
     CALL,
     RET,
+    // CALL that replaces the current frame; the callee returns straight
+    // to the caller's caller.
+    TAIL_CALL,
     PRINT,
     EXEC_ASM,
-    HALT
+    HALT,
+    // Pauses VM::runToSnapshot(); a no-op otherwise.
+    SNAPSHOT,
+    // Patched over an instruction by VM::setBreakpoint; stops run() there.
+    BREAK,
+    // Superinstructions produced by the peephole pass (peephole.h).
+    // Packed operands hold a local index in the low 32 bits and a second
+    // local index or signed 32-bit immediate in the high 32 bits.
+    ADD_IMM,
+    SUB_IMM,
+    ADD_LOCALS,
+    ADD_LOCAL_IMM,
+    STORE_KEEP_LOCAL,
+    STORE_KEEP_GLOBAL,
+    JMP_IF_NOT_EQ,
+    JMP_IF_NOT_NEQ,
+    JMP_IF_NOT_LT,
+    JMP_IF_NOT_GT,
+    JMP_IF_NOT_LEQ,
+    JMP_IF_NOT_GEQ,
+    // Strength-reduced arithmetic (strength.h): SHL_IMM and DIV_POW2 take a
+    // shift count k for x * 2^k and x / 2^k, DIV_MAGIC the divisor itself.
+    SHL_IMM,
+    DIV_POW2,
+    DIV_MAGIC,
+    COUNT
 };
 
+inline int64_t packOperands(uint32_t low, int32_t high) {
+    return static_cast<int64_t>((static_cast<uint64_t>(static_cast<uint32_t>(high)) << 32) | low);
+}
+
+inline uint32_t packedLow(int64_t operand) {
+    return static_cast<uint32_t>(static_cast<uint64_t>(operand));
+}
+
+inline int32_t packedHigh(int64_t operand) {
+    return static_cast<int32_t>(static_cast<uint32_t>(static_cast<uint64_t>(operand) >> 32));
+}
+
 enum class Register {
     RAX,
     RBX,
@@ -109,11 +154,35 @@ struct CPUState {
     }
 };
 
+enum class AsmOpCode : uint8_t {
+    MOV_IMM,
+    MOV_REG,
+    ADD_IMM,
+    ADD_REG,
+    SUB_IMM,
+    SUB_REG,
+    PUSH,
+    POP,
+    INC,
+    DEC
+};
+
+struct AsmOp {
+    AsmOpCode op;
+    uint8_t dst;
+    uint8_t src;
+    int64_t imm;
+};
+
+// Packed bytecode instruction. Text operands (asm blocks) live in the
+// program's string pool and are referenced by index through `operand`.
 struct Instruction {
     OpCode op;
     int64_t operand;
-    std::string text;
 
-    Instruction(OpCode opcode, int64_t opValue = 0, std::string textOperand = {})
-        : op(opcode), operand(opValue), text(std::move(textOperand)) {}
+    Instruction() = default;
+    Instruction(OpCode opcode, int64_t opValue = 0) : op(opcode), operand(opValue) {}
 };
+
+static_assert(sizeof(Instruction) == 16, "Instruction must stay 16 bytes");
+static_assert(std::is_trivially_copyable<Instruction>::value, "Instruction must be trivially copyable");
@@ -0,0 +1,130 @@
+#include "trace.h"
+#include "vm.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kMagic[8] = {'M', 'C', 'T', 'R', 'A', 'C', 'E', '1'};
+const uint32_t kVersion = 1;
+
+uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+}
+
+TraceBuffer::TraceBuffer(size_t capacity, const std::string& symbols, const std::string& path)
+    : mapping(nullptr), length(0), header(nullptr), records(nullptr), mask(0), head(0) {
+    uint64_t rounded = 1024;
+    while (rounded < capacity) rounded <<= 1;
+    uint64_t symbolsOffset = alignUp(sizeof(TraceHeader), 64);
+    uint64_t recordsOffset = alignUp(symbolsOffset + symbols.size(), 64);
+    length = static_cast<size_t>(recordsOffset + rounded * sizeof(TraceRecord));
+
+    if (path.empty()) {
+        mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw std::runtime_error("Cannot create trace file " + path);
+        if (ftruncate(fd, static_cast<off_t>(length)) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot size trace file " + path);
+        }
+        mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (mapping == MAP_FAILED) throw std::runtime_error("Cannot map the trace buffer");
+
+    char* base = static_cast<char*>(mapping);
+    header = new (base) TraceHeader();
+    std::memcpy(header->magic, kMagic, sizeof(kMagic));
+    header->version = kVersion;
+    header->recordSize = sizeof(TraceRecord);
+    header->capacity = rounded;
+    header->symbolsOffset = symbolsOffset;
+    header->symbolsSize = symbols.size();
+    header->recordsOffset = recordsOffset;
+    header->head.store(0, std::memory_order_release);
+    std::memcpy(base + symbolsOffset, symbols.data(), symbols.size());
+    records = reinterpret_cast<TraceRecord*>(base + recordsOffset);
+    mask = rounded - 1;
+}
+
+TraceBuffer::~TraceBuffer() {
+    munmap(mapping, length);
+}
+
+std::string traceSymbols(const LoadedProgram& program) {
+    std::ostringstream out;
+    for (size_t id = 0; id < program.verified.functions.size(); id++) {
+        out << program.verified.functions[id].entry << " " << program.functionNames[id] << "\n";
+    }
+    return out.str();
+}
+
+TraceContents decodeTrace(const void* data, size_t size) {
+    const char* base = static_cast<const char*>(data);
+    const TraceHeader* header = reinterpret_cast<const TraceHeader*>(base);
+    if (size < sizeof(TraceHeader) || std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) {
+        throw std::runtime_error("Not a MineC trace");
+    }
+    uint64_t capacity = header->capacity;
+    if (header->version != kVersion || header->recordSize != sizeof(TraceRecord) || capacity == 0 ||
+        (capacity & (capacity - 1)) != 0 || header->symbolsOffset + header->symbolsSize > size ||
+        header->recordsOffset > size || capacity > (size - header->recordsOffset) / sizeof(TraceRecord)) {
+        throw std::runtime_error("Corrupt or unsupported MineC trace");
+    }
+
+    TraceContents contents;
+    std::istringstream symbols(std::string(base + header->symbolsOffset, header->symbolsSize));
+    uint64_t entry;
+    std::string name;
+    while (symbols >> entry && symbols.get() == ' ' && std::getline(symbols, name)) {
+        contents.symbols.push_back({entry, name});
+    }
+
+    const TraceRecord* records = reinterpret_cast<const TraceRecord*>(base + header->recordsOffset);
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    uint64_t first = head > capacity ? head - capacity : 0;
+    contents.records.reserve(static_cast<size_t>(head - first));
+    for (uint64_t i = first; i < head; i++) {
+        contents.records.push_back(records[i & (capacity - 1)]);
+    }
+    // A writer still running may have lapped the oldest records meanwhile.
+    uint64_t after = header->head.load(std::memory_order_acquire);
+    uint64_t overwritten = after > first + capacity ? after - (first + capacity) : 0;
+    overwritten = std::min<uint64_t>(overwritten, contents.records.size());
+    contents.records.erase(contents.records.begin(), contents.records.begin() + static_cast<std::ptrdiff_t>(overwritten));
+    contents.dropped = first + overwritten;
+    return contents;
+}
+
+TraceContents readTraceFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Cannot open trace file " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        close(fd);
+        throw std::runtime_error("Cannot read trace file " + path);
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) throw std::runtime_error("Cannot map trace file " + path);
+    try {
+        TraceContents contents = decodeTrace(data, size);
+        munmap(data, size);
+        return contents;
+    } catch (...) {
+        munmap(data, size);
+        throw;
+    }
+}
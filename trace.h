@@ -0,0 +1,93 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct LoadedProgram;
+
+enum class TraceKind : uint8_t {
+    // value: top of the operand stack after the instruction (0 when
+    // empty), aux: operand stack depth.
+    Instruction,
+    // Follows the EXEC_ASM that changed a register. op: the register,
+    // value: its new value, aux: the change.
+    RegisterDelta
+};
+
+struct TraceRecord {
+    // Instructions executed before this one.
+    uint64_t sequence;
+    uint32_t pc;
+    TraceKind kind;
+    uint8_t op;
+    uint16_t callDepth;
+    int64_t value;
+    int64_t aux;
+};
+
+static_assert(sizeof(TraceRecord) == 32, "TraceRecord must stay 32 bytes");
+
+// Start of every trace buffer. The function symbols ("entry name" lines)
+// and then the records follow at the given offsets.
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;
+    uint64_t symbolsOffset;
+    uint64_t symbolsSize;
+    uint64_t recordsOffset;
+    // Records ever appended; the newest `capacity` of them are kept.
+    std::atomic<uint64_t> head;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "trace head must be lock-free");
+
+// Single-producer ring of TraceRecords in one mapping, either anonymous
+// memory or a file mapped shared, so the trace survives a crash and can be
+// read while the program runs. Appending never blocks or allocates: when
+// the ring is full the oldest records are overwritten.
+class TraceBuffer {
+    void* mapping;
+    size_t length;
+    TraceHeader* header;
+    TraceRecord* records;
+    uint64_t mask;
+    uint64_t head;
+
+public:
+    // `capacity` is rounded up to a power of two. An empty `path` keeps
+    // the trace in memory only. Throws if the mapping cannot be created.
+    TraceBuffer(size_t capacity, const std::string& symbols, const std::string& path = "");
+    ~TraceBuffer();
+    TraceBuffer(const TraceBuffer&) = delete;
+    TraceBuffer& operator=(const TraceBuffer&) = delete;
+
+    void append(const TraceRecord& record) {
+        records[head & mask] = record;
+        header->head.store(++head, std::memory_order_release);
+    }
+
+    const void* data() const { return mapping; }
+    size_t size() const { return length; }
+};
+
+// "entry name" lines for every function of the program.
+std::string traceSymbols(const LoadedProgram& program);
+
+struct TraceContents {
+    // Function entry pc and name.
+    std::vector<std::pair<uint64_t, std::string>> symbols;
+    // Oldest first.
+    std::vector<TraceRecord> records;
+    // Records overwritten before they could be read.
+    uint64_t dropped = 0;
+};
+
+// Decodes a trace buffer's bytes, or a trace file. Both throw on
+// malformed input.
+TraceContents decodeTrace(const void* data, size_t size);
+TraceContents readTraceFile(const std::string& path);
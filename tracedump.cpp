@@ -0,0 +1,110 @@
+#include "program.h"
+#include "trace.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+const char* registerName(uint8_t reg) {
+    static const char* const names[] = {"rax", "rbx", "rcx", "rdx"};
+    return reg < static_cast<uint8_t>(Register::COUNT) ? names[reg] : "?";
+}
+
+// The function whose code contains `pc`: the one with the closest entry
+// at or before it.
+const std::string& functionAt(const TraceContents& trace, uint64_t pc) {
+    static const std::string unknown = "?";
+    const std::string* best = &unknown;
+    uint64_t bestEntry = 0;
+    for (const auto& symbol : trace.symbols) {
+        if (symbol.first <= pc && (best == &unknown || symbol.first >= bestEntry)) {
+            best = &symbol.second;
+            bestEntry = symbol.first;
+        }
+    }
+    return *best;
+}
+
+void printText(const TraceContents& trace) {
+    if (trace.dropped) std::cout << "(" << trace.dropped << " earlier records overwritten)\n";
+    for (const TraceRecord& record : trace.records) {
+        if (record.kind == TraceKind::RegisterDelta) {
+            std::cout << "        " << registerName(record.op) << " = " << record.value
+                      << " (" << (record.aux >= 0 ? "+" : "") << record.aux << ")\n";
+            continue;
+        }
+        std::cout << record.sequence << " [" << record.callDepth << "] " << record.pc << " "
+                  << opcodeName(static_cast<OpCode>(record.op)) << "  depth=" << record.aux;
+        if (record.aux > 0) std::cout << " top=" << record.value;
+        std::cout << "\n";
+    }
+}
+
+void printEvent(const std::string& name, char phase, uint64_t ts, bool& first) {
+    std::cout << (first ? "\n" : ",\n") << "{\"name\":\"";
+    for (char c : name) {
+        if (c == '"' || c == '\\') std::cout << '\\';
+        std::cout << c;
+    }
+    std::cout << "\",\"ph\":\"" << phase
+              << "\",\"ts\":" << ts << ",\"pid\":1,\"tid\":1}";
+    first = false;
+}
+
+// Chrome trace-event JSON (chrome://tracing, Perfetto) with a slice per
+// call; one instruction is one microsecond on the timeline.
+void printChrome(const TraceContents& trace) {
+    std::cout << "{\"traceEvents\":[";
+    bool first = true;
+    std::vector<std::string> open;
+    uint64_t ts = 0;
+    for (const TraceRecord& record : trace.records) {
+        if (record.kind != TraceKind::Instruction) continue;
+        ts = record.sequence;
+        if (open.empty()) {
+            // Frames entered before the oldest record kept.
+            for (uint16_t depth = 0; depth < record.callDepth; depth++) {
+                open.push_back("(earlier)");
+                printEvent(open.back(), 'B', ts, first);
+            }
+            open.push_back(functionAt(trace, record.pc));
+            printEvent(open.back(), 'B', ts, first);
+        }
+        while (open.size() > static_cast<size_t>(record.callDepth) + 1) {
+            printEvent(open.back(), 'E', ts, first);
+            open.pop_back();
+        }
+        while (open.size() < static_cast<size_t>(record.callDepth) + 1) {
+            open.push_back(functionAt(trace, record.pc));
+            printEvent(open.back(), 'B', ts, first);
+        }
+    }
+    while (!open.empty()) {
+        printEvent(open.back(), 'E', ts + 1, first);
+        open.pop_back();
+    }
+    std::cout << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || (argc == 3 && std::string(argv[2]) != "--chrome") || argc > 3) {
+        std::cout << "Usage: microc-trace <trace> [--chrome]" << std::endl;
+        return 1;
+    }
+    try {
+        TraceContents trace = readTraceFile(argv[1]);
+        if (argc == 3) {
+            printChrome(trace);
+        } else {
+            printText(trace);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
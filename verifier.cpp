@@ -0,0 +1,286 @@
+#include "verifier.h"
+#include "strength.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+struct StackEffect {
+    int pops;
+    int pushes;
+};
+
+StackEffect stackEffect(OpCode op) {
+    switch (op) {
+        case OpCode::PUSH:
+        case OpCode::LOAD_GLOBAL:
+        case OpCode::LOAD_LOCAL:
+        case OpCode::ADD_LOCALS:
+        case OpCode::ADD_LOCAL_IMM:
+            return {0, 1};
+        case OpCode::POP:
+        case OpCode::STORE_GLOBAL:
+        case OpCode::STORE_LOCAL:
+        case OpCode::JMP_IF_FALSE:
+        case OpCode::PRINT:
+            return {1, 0};
+        case OpCode::ADD:
+        case OpCode::SUB:
+        case OpCode::MUL:
+        case OpCode::DIV:
+        case OpCode::CMP_EQ:
+        case OpCode::CMP_NEQ:
+        case OpCode::CMP_LT:
+        case OpCode::CMP_GT:
+        case OpCode::CMP_LEQ:
+        case OpCode::CMP_GEQ:
+            return {2, 1};
+        case OpCode::NEG:
+        case OpCode::ADD_IMM:
+        case OpCode::SUB_IMM:
+        case OpCode::STORE_KEEP_LOCAL:
+        case OpCode::STORE_KEEP_GLOBAL:
+        case OpCode::SHL_IMM:
+        case OpCode::DIV_POW2:
+        case OpCode::DIV_MAGIC:
+            return {1, 1};
+        case OpCode::JMP_IF_NOT_EQ:
+        case OpCode::JMP_IF_NOT_NEQ:
+        case OpCode::JMP_IF_NOT_LT:
+        case OpCode::JMP_IF_NOT_GT:
+        case OpCode::JMP_IF_NOT_LEQ:
+        case OpCode::JMP_IF_NOT_GEQ:
+            return {2, 0};
+        default:
+            return {0, 0};
+    }
+}
+
+bool usesLocals(OpCode op) {
+    return op == OpCode::LOAD_LOCAL || op == OpCode::STORE_LOCAL || op == OpCode::STORE_KEEP_LOCAL ||
+           op == OpCode::ADD_LOCALS || op == OpCode::ADD_LOCAL_IMM;
+}
+
+class Verifier {
+    const Program& program;
+    const std::vector<Instruction>& code;
+    const std::vector<AsmBlock>& asmBlocks;
+    VerifiedProgram result;
+    std::vector<int32_t> owner;
+    std::vector<int> height;
+
+    [[noreturn]] void fail(size_t pc, const std::string& message) {
+        std::string where = pc < code.size() ? std::string(" (") + opcodeName(code[pc].op) + ")" : "";
+        throw std::runtime_error("Bytecode verification failed at pc " + std::to_string(pc) + where + ": " + message);
+    }
+
+    void useLocal(size_t pc, const FunctionInfo& fn, int64_t index) {
+        if (index < 0 || index >= static_cast<int64_t>(fn.localCount)) {
+            fail(pc, "local index " + std::to_string(index) + " outside the frame of size " +
+                 std::to_string(fn.localCount));
+        }
+    }
+
+    void useGlobal(size_t pc, int64_t index) {
+        if (index < 0 || index >= static_cast<int64_t>(result.globalCount)) {
+            fail(pc, "global index " + std::to_string(index) + " outside the " +
+                 std::to_string(result.globalCount) + " declared globals");
+        }
+    }
+
+    void discoverFunctions() {
+        result.globalCount = program.globalCount;
+        result.functionAt.assign(code.size() + 1, -1);
+        result.functions.push_back({0, 0, 0, 0, 1});
+        result.functionAt[0] = 0;
+
+        for (const FunctionEntry& function : program.functions) {
+            if (function.address == 0 || function.address >= code.size()) {
+                throw std::runtime_error("Bytecode verification failed: function '" + function.name +
+                                         "' has invalid address " + std::to_string(function.address));
+            }
+            if (function.paramCount > function.frameSize) {
+                throw std::runtime_error("Bytecode verification failed: function '" + function.name + "' has " +
+                                         std::to_string(function.paramCount) + " parameters but a frame of size " +
+                                         std::to_string(function.frameSize));
+            }
+            if (result.functionAt[function.address] < 0) {
+                result.functionAt[function.address] = static_cast<int32_t>(result.functions.size());
+                result.functions.push_back({function.address, function.frameSize, function.paramCount, 0, 1});
+            }
+        }
+
+        for (size_t pc = 0; pc < code.size(); pc++) {
+            const Instruction& inst = code[pc];
+            if (!isBranch(inst.op)) continue;
+            if ((!isCall(inst.op) && inst.operand < 0) || branchTarget(inst) > code.size()) {
+                fail(pc, "target " + std::to_string(branchTarget(inst)) + " out of range");
+            }
+            if (!isCall(inst.op)) continue;
+            int32_t callee = result.functionAt[branchTarget(inst)];
+            if (callee <= 0) {
+                fail(pc, "call target " + std::to_string(branchTarget(inst)) + " is not a function entry");
+            }
+            const FunctionInfo& fn = result.functions[static_cast<size_t>(callee)];
+            if (packedHigh(inst.operand) != static_cast<int32_t>(fn.paramCount)) {
+                fail(pc, "call passes " + std::to_string(packedHigh(inst.operand)) + " arguments to a function taking " +
+                     std::to_string(fn.paramCount));
+            }
+        }
+    }
+
+    // Returns the observed return height, or -1 when no RET is reachable.
+    int walk(int32_t id) {
+        FunctionInfo& fn = result.functions[static_cast<size_t>(id)];
+        fn.maxStack = 0;
+        int returnHeight = -1;
+        std::vector<size_t> worklist;
+
+        auto reach = [&](size_t from, size_t pc, int h) {
+            if (pc == code.size()) return;
+            if (owner[pc] < 0) {
+                owner[pc] = id;
+                height[pc] = h;
+                worklist.push_back(pc);
+            } else if (owner[pc] != id) {
+                fail(from, "pc " + std::to_string(pc) + " is reachable from more than one function");
+            } else if (height[pc] != h) {
+                fail(from, "inconsistent stack height at pc " + std::to_string(pc) + " (" +
+                     std::to_string(height[pc]) + " vs " + std::to_string(h) + ")");
+            }
+        };
+
+        reach(fn.entry, fn.entry, 0);
+        while (!worklist.empty()) {
+            size_t pc = worklist.back();
+            worklist.pop_back();
+            const Instruction& inst = code[pc];
+            int h = height[pc];
+
+            StackEffect effect = stackEffect(inst.op);
+            if (isCall(inst.op)) effect.pops = packedHigh(inst.operand);
+            if (h < effect.pops) {
+                fail(pc, "stack underflow (needs " + std::to_string(effect.pops) + ", has " + std::to_string(h) + ")");
+            }
+
+            if (usesLocals(inst.op)) {
+                if (id == 0) fail(pc, "local access outside of a function");
+                if (inst.op == OpCode::ADD_LOCALS || inst.op == OpCode::ADD_LOCAL_IMM) {
+                    useLocal(pc, fn, packedLow(inst.operand));
+                    if (inst.op == OpCode::ADD_LOCALS) useLocal(pc, fn, packedHigh(inst.operand));
+                } else {
+                    useLocal(pc, fn, inst.operand);
+                }
+            }
+            if (inst.op == OpCode::LOAD_GLOBAL || inst.op == OpCode::STORE_GLOBAL ||
+                inst.op == OpCode::STORE_KEEP_GLOBAL) {
+                useGlobal(pc, inst.operand);
+            }
+            if ((inst.op == OpCode::SHL_IMM || inst.op == OpCode::DIV_POW2) &&
+                (inst.operand < 1 || inst.operand > 62)) {
+                fail(pc, "shift count " + std::to_string(inst.operand) + " outside 1..62");
+            }
+            if (inst.op == OpCode::DIV_MAGIC && !magicDivisible(inst.operand)) {
+                fail(pc, "divisor " + std::to_string(inst.operand) + " has no multiply-high form");
+            }
+
+            int after = h - effect.pops + effect.pushes;
+            fn.maxStack = std::max(fn.maxStack, static_cast<uint32_t>(after));
+            size_t target = isBranch(inst.op) ? branchTarget(inst) : static_cast<size_t>(inst.operand);
+
+            switch (inst.op) {
+                case OpCode::HALT:
+                    break;
+                case OpCode::JMP:
+                    reach(pc, target, after);
+                    break;
+                case OpCode::RET:
+                    if (id == 0) fail(pc, "RET outside of a function");
+                    if (returnHeight >= 0 && returnHeight != h) {
+                        fail(pc, "inconsistent return stack height (" + std::to_string(returnHeight) +
+                             " vs " + std::to_string(h) + ")");
+                    }
+                    returnHeight = h;
+                    break;
+                case OpCode::TAIL_CALL: {
+                    // The frame is reused, so nothing but the arguments may
+                    // be left on it, and the callee's results become ours.
+                    if (id == 0) fail(pc, "TAIL_CALL outside of a function");
+                    if (after != 0) fail(pc, std::to_string(after) + " values left below the arguments");
+                    int results = result.functions[static_cast<size_t>(result.functionAt[target])].returnHeight;
+                    if (returnHeight >= 0 && returnHeight != results) {
+                        fail(pc, "inconsistent return stack height (" + std::to_string(returnHeight) +
+                             " vs " + std::to_string(results) + ")");
+                    }
+                    returnHeight = results;
+                    break;
+                }
+                case OpCode::CALL: {
+                    const FunctionInfo& callee = result.functions[static_cast<size_t>(result.functionAt[target])];
+                    reach(pc, pc + 1, after + callee.returnHeight);
+                    break;
+                }
+                case OpCode::EXEC_ASM: {
+                    if (target >= asmBlocks.size()) fail(pc, "invalid asm block index");
+                    int asmHeight = h;
+                    for (const AsmOp& op : asmBlocks[target]) {
+                        if (op.op == AsmOpCode::PUSH) {
+                            asmHeight++;
+                            fn.maxStack = std::max(fn.maxStack, static_cast<uint32_t>(asmHeight));
+                        } else if (op.op == AsmOpCode::POP) {
+                            if (asmHeight == 0) fail(pc, "asm pop with no value on the frame's stack");
+                            asmHeight--;
+                        }
+                    }
+                    reach(pc, pc + 1, asmHeight);
+                    break;
+                }
+                default:
+                    if (isBranch(inst.op)) reach(pc, target, after);
+                    reach(pc, pc + 1, after);
+                    break;
+            }
+        }
+        return returnHeight;
+    }
+
+public:
+    Verifier(const Program& prog, const std::vector<AsmBlock>& blocks)
+        : program(prog), code(prog.code), asmBlocks(blocks) {}
+
+    VerifiedProgram run() {
+        discoverFunctions();
+
+        // Return heights feed the stack effect of CALL, and recursion means a
+        // callee may be walked before its own height is known. Assume 1 (the
+        // return value) and re-walk until the assumption is consistent.
+        for (size_t iteration = 0; iteration <= result.functions.size(); iteration++) {
+            owner.assign(code.size(), -1);
+            height.assign(code.size(), 0);
+            bool changed = false;
+            for (size_t id = 0; id < result.functions.size(); id++) {
+                int observed = walk(static_cast<int32_t>(id));
+                if (observed >= 0 && observed != result.functions[id].returnHeight) {
+                    result.functions[id].returnHeight = observed;
+                    changed = true;
+                }
+            }
+            if (!changed) {
+                for (const FunctionInfo& fn : result.functions) {
+                    result.maxStack = std::max(result.maxStack, fn.maxStack);
+                }
+                result.owner = std::move(owner);
+                result.stackHeight = std::move(height);
+                return result;
+            }
+        }
+        fail(0, "function return heights do not converge");
+    }
+};
+
+}
+
+VerifiedProgram verifyProgram(const Program& program, const std::vector<AsmBlock>& asmBlocks) {
+    return Verifier(program, asmBlocks).run();
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "asm.h"
+#include "program.h"
+#include "token.h"
+#include <cstdint>
+#include <vector>
+
+// Per-function facts proven by the verifier. Function 0 is the top-level
+// code starting at pc 0; the others are the program's declared functions.
+// localCount is the frame size recorded by the compiler, of which the first
+// paramCount slots are filled with the arguments by every CALL.
+struct FunctionInfo {
+    size_t entry;
+    uint32_t localCount;
+    uint32_t paramCount;
+    uint32_t maxStack;
+    int returnHeight;
+};
+
+struct VerifiedProgram {
+    std::vector<FunctionInfo> functions;
+    // Function id for each pc that is a CALL target, -1 elsewhere.
+    std::vector<int32_t> functionAt;
+    // Owning function id (-1 when unreachable) and operand stack height on
+    // entry, relative to the function's frame, for every pc.
+    std::vector<int32_t> owner;
+    std::vector<int> stackHeight;
+    uint32_t globalCount = 0;
+    uint32_t maxStack = 0;
+};
+
+// Walks the control-flow graph of every function and proves that each
+// instruction sees enough operands, that all paths agree on the stack
+// height at every pc and at every RET, that jump targets are in range and
+// calls land on declared functions with as many arguments as they take,
+// that a TAIL_CALL finds only its arguments on the frame and returns like
+// its function's RETs, that local/global indices fit the declared frame
+// sizes and global count, and that shift counts and DIV_MAGIC divisors are
+// ones strength.h produces. Throws std::runtime_error naming the offending
+// pc on the first violation.
+VerifiedProgram verifyProgram(const Program& program, const std::vector<AsmBlock>& asmBlocks);
@@ -1,10 +1,35 @@
 #include "vm.h"
 #include <algorithm>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
-#include <sstream>
+#include <limits>
 #include <stdexcept>
 
-VM::VM() : pc(0), running(false), stepMode(false) {}
+// Build with -DMINEC_SWITCH_DISPATCH (or a compiler without labels-as-values)
+// to use the portable switch interpreter for normal runs.
+#if defined(__GNUC__) && !defined(MINEC_SWITCH_DISPATCH)
+#define MINEC_THREADED_DISPATCH 1
+#endif
+
+static const size_t kInitialLocalsSlab = 4096;
+static const size_t kInitialCallDepth = 256;
+
+VM::VM()
+    : program(std::make_shared<LoadedProgram>()), jitEnabled(true), jitThreshold(kDefaultJitThreshold), osrThreshold(kDefaultOsrThreshold), tierStats(false), perfMap(false),
+      nativeDepth(0), nativeSeconds(0), runSeconds(0), pc(0), executed(0), running(false),
+      pauseAtSnapshot(false), paused(false), stop(Stop::None), lastWatch(),
+      instructionLimit(kNoLimit) {
+    jitRuntime.vm = this;
+    jitRuntime.globals = nullptr;
+    jitRuntime.entries = nullptr;
+    jitRuntime.tailArguments = nullptr;
+    jitRuntime.stackLimit = std::numeric_limits<uintptr_t>::max();
+    jitRuntime.call = jitCall;
+    jitRuntime.interpret = jitInterpret;
+    jitRuntime.print = jitPrint;
+    jitRuntime.execAsm = jitExecAsm;
+}
 
 void VM::ensureGlobal(size_t index) {
     if (globals.size() <= index) {
@@ -12,96 +37,343 @@ void VM::ensureGlobal(size_t index) {
     }
 }
 
-void VM::loadProgram(const std::vector<Instruction>& program) {
-    code = program;
-    pc = 0;
-    stack.clear();
-    globals.clear();
-    callStack.clear();
-    cpu = CPUState();
+int64_t& VM::localSlot(size_t index, const char* opName) {
+    if (callStack.empty()) throw std::runtime_error(std::string(opName) + " without call frame");
+    return locals[callStack.back().base + index];
 }
 
-void VM::setStepMode(bool enabled) {
-    stepMode = enabled;
+void VM::pushFrame(size_t returnAddress, const FunctionInfo& callee) {
+    size_t base = callStack.empty() ? 0 : callStack.back().base + callStack.back().size;
+    fillFrame(base, callee);
+    callStack.push_back({returnAddress, base, callee.localCount});
 }
 
-void VM::executeASM(const std::string& asmCode) {
-    std::istringstream iss(asmCode);
-    std::string inst, arg1, arg2;
-
-    while (iss >> inst) {
-        std::transform(inst.begin(), inst.end(), inst.begin(), ::tolower);
-
-        auto toRegister = [](const std::string& name) -> Register {
-            if (name == "rax") return Register::RAX;
-            if (name == "rbx") return Register::RBX;
-            if (name == "rcx") return Register::RCX;
-            if (name == "rdx") return Register::RDX;
-            throw std::runtime_error("Unknown register '" + name + "'");
-        };
-
-        if (inst == "mov") {
-            iss >> arg1 >> arg2;
-            if (arg2[0] >= '0' && arg2[0] <= '9') {
-                int64_t val = std::stoll(arg2);
-                Register dstReg = toRegister(arg1);
-                cpu.regs[dstReg] = val;
-            } else {
-                Register dstReg = toRegister(arg1);
-                Register srcReg = toRegister(arg2);
-                cpu.regs[dstReg] = cpu.regs[srcReg];
-            }
+void VM::replaceFrame(const FunctionInfo& callee) {
+    if (callStack.empty()) throw std::runtime_error("TAIL_CALL without call frame");
+    if (stack.size() < callee.paramCount) throw std::runtime_error("Stack underflow on TAIL_CALL");
+    fillFrame(callStack.back().base, callee);
+    callStack.back().size = callee.localCount;
+}
+
+void VM::fillFrame(size_t base, const FunctionInfo& callee) {
+    uint32_t size = callee.localCount;
+    if (base + size > locals.size()) {
+        locals.resize(std::max(locals.size() * 2, base + size), 0);
+    }
+    if (stack.size() < callee.paramCount) throw std::runtime_error("Stack underflow on CALL");
+    auto arguments = stack.end() - callee.paramCount;
+    auto slots = locals.begin() + static_cast<std::ptrdiff_t>(base);
+    std::copy(arguments, stack.end(), slots);
+    std::fill(slots + callee.paramCount, slots + size, 0);
+    stack.erase(arguments, stack.end());
+}
+
+static bool compareValues(OpCode op, int64_t a, int64_t b) {
+    switch (op) {
+        case OpCode::CMP_EQ: case OpCode::JMP_IF_NOT_EQ: return a == b;
+        case OpCode::CMP_NEQ: case OpCode::JMP_IF_NOT_NEQ: return a != b;
+        case OpCode::CMP_LT: case OpCode::JMP_IF_NOT_LT: return a < b;
+        case OpCode::CMP_GT: case OpCode::JMP_IF_NOT_GT: return a > b;
+        case OpCode::CMP_LEQ: case OpCode::JMP_IF_NOT_LEQ: return a <= b;
+        case OpCode::CMP_GEQ: case OpCode::JMP_IF_NOT_GEQ: return a >= b;
+        default: return false;
+    }
+}
+
+std::shared_ptr<const LoadedProgram> prepareProgram(const Program& source) {
+    auto program = std::make_shared<LoadedProgram>();
+    program->code = source.code;
+    program->asmBlocks = decodeProgramAsm(source);
+    program->verified = verifyProgram(source, program->asmBlocks);
+    program->fingerprint = programFingerprint(source);
+    const VerifiedProgram& verified = program->verified;
+
+    program->functionNames.assign(verified.functions.size(), "<top level>");
+    for (const FunctionEntry& function : source.functions) {
+        program->functionNames[static_cast<size_t>(verified.functionAt[function.address])] = function.name;
+    }
+    program->globalNames = source.globalNames;
+    program->localNames.assign(verified.functions.size(), {});
+    for (const FunctionEntry& function : source.functions) {
+        program->localNames[static_cast<size_t>(verified.functionAt[function.address])] = function.localNames;
+    }
+    const std::vector<Instruction>& code = program->code;
+    program->loopAt.assign(code.size(), -1);
+    int32_t loopCount = 0;
+    for (size_t i = 0; i < code.size(); i++) {
+        if (code[i].op == OpCode::JMP && static_cast<size_t>(code[i].operand) <= i && verified.owner[i] >= 0) {
+            program->loopAt[i] = loopCount++;
         }
-        else if (inst == "add") {
-            iss >> arg1 >> arg2;
-            int64_t val = std::stoll(arg2);
-            Register dstReg = toRegister(arg1);
-            cpu.regs[dstReg] += val;
-            cpu.updateFlags(cpu.regs[dstReg]);
-        }
-        else if (inst == "sub") {
-            iss >> arg1 >> arg2;
-            int64_t val = std::stoll(arg2);
-            Register dstReg = toRegister(arg1);
-            cpu.regs[dstReg] -= val;
-            cpu.updateFlags(cpu.regs[dstReg]);
-        }
-        else if (inst == "push") {
-            iss >> arg1;
-            Register reg = toRegister(arg1);
-            stack.push_back(cpu.regs[reg]);
-        }
-        else if (inst == "pop") {
-            iss >> arg1;
-            if (!stack.empty()) {
-                int64_t val = stack.back();
-                stack.pop_back();
-                Register reg = toRegister(arg1);
-                cpu.regs[reg] = val;
+    }
+
+    // A function reaches a SNAPSHOT if it contains one or calls a function
+    // that does.
+    std::vector<bool>& reaches = program->reachesSnapshot;
+    reaches.assign(verified.functions.size(), false);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < code.size(); i++) {
+            int32_t owner = verified.owner[i];
+            if (owner < 0 || reaches[static_cast<size_t>(owner)]) continue;
+            int32_t callee = isCall(code[i].op) ? verified.functionAt[branchTarget(code[i])] : -1;
+            if (code[i].op == OpCode::SNAPSHOT || (callee >= 0 && reaches[static_cast<size_t>(callee)])) {
+                reaches[static_cast<size_t>(owner)] = true;
+                changed = true;
             }
         }
-        else if (inst == "inc") {
-            iss >> arg1;
-            Register reg = toRegister(arg1);
-            cpu.regs[reg]++;
-            cpu.updateFlags(cpu.regs[reg]);
+    }
+    return program;
+}
+
+void VM::loadProgram(const Program& source) {
+    loadProgram(prepareProgram(source));
+}
+
+void VM::loadProgram(std::shared_ptr<const LoadedProgram> shared) {
+    program = std::move(shared);
+    patchedProgram.reset();
+    breakpoints.clear();
+    watches.clear();
+    stop = Stop::None;
+    threadedCode.clear();
+    pc = 0;
+    stack.clear();
+    globals.assign(program->verified.globalCount, 0);
+    callStack.clear();
+    callStack.reserve(kInitialCallDepth);
+    locals.assign(kInitialLocalsSlab, 0);
+    cpu = CPUState();
+    executed = 0;
+    jitRuntime.globals = globals.data();
+    uint32_t mostParams = 1;
+    for (const FunctionInfo& function : program->verified.functions) {
+        mostParams = std::max(mostParams, function.paramCount);
+    }
+    tailArguments.assign(mostParams, 0);
+    jitRuntime.tailArguments = tailArguments.data();
+
+    loops.clear();
+    for (size_t i = 0; i < program->loopAt.size(); i++) {
+        if (program->loopAt[i] >= 0) {
+            loops.push_back({i, program->verified.owner[i], 0, nullptr, false, 0, 0});
         }
-        else if (inst == "dec") {
-            iss >> arg1;
-            Register reg = toRegister(arg1);
-            cpu.regs[reg]--;
-            cpu.updateFlags(cpu.regs[reg]);
+    }
+    resetJit();
+}
+
+void VM::setJit(bool enabled, uint32_t threshold, uint32_t loopThreshold) {
+    jitEnabled = enabled;
+    jitThreshold = std::max<uint32_t>(threshold, 1);
+    osrThreshold = std::max<uint32_t>(loopThreshold, 1);
+    resetJit();
+}
+
+void VM::setTierStats(bool enabled) {
+    tierStats = enabled;
+}
+
+void VM::setPerfMap(bool enabled) {
+    perfMap = enabled;
+}
+
+void VM::resetJit() {
+    // Compiled code cannot pause, so while runToSnapshot() is waiting for a
+    // SNAPSHOT every function that can reach one stays interpreted.
+    auto compilable = [this](int32_t id) {
+        bool blocked = pauseAtSnapshot && program->reachesSnapshot[static_cast<size_t>(id)];
+        return jitEnabled && Jit::available() && !blocked;
+    };
+    const uint64_t never = std::numeric_limits<uint64_t>::max();
+    jit.reset();
+    nativeEntries.assign(program->verified.functions.size(), nullptr);
+    jitCountdown.resize(program->verified.functions.size());
+    for (size_t id = 0; id < jitCountdown.size(); id++) {
+        jitCountdown[id] = compilable(static_cast<int32_t>(id)) ? jitThreshold : never;
+    }
+    jitRuntime.entries = nativeEntries.data();
+    for (LoopTier& loop : loops) {
+        uint64_t countdown = compilable(loop.function) ? osrThreshold : never;
+        loop = {loop.jumpPc, loop.function, countdown, nullptr, false, 0, 0};
+    }
+    nativeSeconds = 0;
+    runSeconds = 0;
+}
+
+inline JitFunction VM::hotFunction(int32_t id) {
+    size_t index = static_cast<size_t>(id);
+    JitFunction native = nativeEntries[index];
+    if (native || --jitCountdown[index] != 0) return native;
+    return compileHot(id);
+}
+
+JitFunction VM::compileHot(int32_t id) {
+    JitFunction native = jit.compile(program->code, program->verified, program->asmBlocks, id);
+    if (native) {
+        nativeEntries[static_cast<size_t>(id)] = native;
+        if (perfMap) {
+            writePerfMapEntry(reinterpret_cast<const void*>(native), jit.lastCodeSize(),
+                              "minec::" + program->functionNames[static_cast<size_t>(id)]);
         }
+    } else {
+        jitCountdown[static_cast<size_t>(id)] = std::numeric_limits<uint64_t>::max();
     }
+    return native;
 }
-
+
+bool VM::nativeStackRoom() const {
+    char probe;
+    return reinterpret_cast<uintptr_t>(&probe) > jitRuntime.stackLimit;
+}
+
+// Compiled code takes its arguments where a native caller pushed them,
+// the last one at the lowest address, so they are reversed in place.
+// The callee copies them into its frame before it can re-enter the
+// interpreter and move the operand stack.
+int64_t VM::runNative(JitFunction native, uint32_t argumentCount) {
+    size_t argumentsAt = stack.size() - argumentCount;
+    std::reverse(stack.begin() + static_cast<std::ptrdiff_t>(argumentsAt), stack.end());
+    const int64_t* arguments = stack.data() + argumentsAt;
+    int64_t result;
+    if (!tierStats || nativeDepth > 0) {
+        result = native(&jitRuntime, arguments);
+    } else {
+        nativeDepth++;
+        auto start = std::chrono::steady_clock::now();
+        result = native(&jitRuntime, arguments);
+        nativeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        nativeDepth--;
+    }
+    stack.resize(argumentsAt);
+    return result;
+}
+
+// Called when a loop's back edge runs out of countdown, with the VM state
+// synced and the current frame's operand stack at the loop header height.
+// Runs the rest of the frame's function natively from the header and
+// completes its RET; returns false (leaving the state alone) if the loop
+// cannot be promoted.
+bool VM::enterOsr(int32_t index) {
+    LoopTier& loop = loops[static_cast<size_t>(index)];
+    size_t header = static_cast<size_t>(program->code[loop.jumpPc].operand);
+    if (!loop.entry && !loop.rejected) {
+        loop.entry = jit.compileOsr(program->code, program->verified, program->asmBlocks, loop.function,
+                                    header);
+        loop.rejected = !loop.entry;
+        if (loop.entry && perfMap) {
+            writePerfMapEntry(reinterpret_cast<const void*>(loop.entry), jit.lastCodeSize(),
+                              "minec::" + program->functionNames[static_cast<size_t>(loop.function)] + "@osr" +
+                                  std::to_string(header));
+        }
+    }
+    if (!loop.entry) {
+        loop.countdown = std::numeric_limits<uint64_t>::max();
+        return false;
+    }
+    loop.countdown = osrThreshold;
+    if (!nativeStackRoom()) return false;
+
+    size_t valuesBase = stack.size() - static_cast<size_t>(program->verified.stackHeight[header]);
+    const int64_t* frameLocals = locals.data() + callStack.back().base;
+    loop.transfers++;
+    int64_t result;
+    if (tierStats && nativeDepth == 0) {
+        nativeDepth++;
+        auto start = std::chrono::steady_clock::now();
+        result = loop.entry(&jitRuntime, frameLocals, stack.data() + valuesBase);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        nativeDepth--;
+        loop.nativeSeconds += seconds;
+        nativeSeconds += seconds;
+    } else {
+        result = loop.entry(&jitRuntime, frameLocals, stack.data() + valuesBase);
+    }
+
+    stack.resize(valuesBase);
+    stack.push_back(result);
+    pc = callStack.back().returnAddress;
+    callStack.pop_back();
+    return true;
+}
+
+void VM::printTierStats(std::ostream& out) const {
+    out << std::fixed << std::setprecision(3);
+    out << "=== Tier stats ===" << std::endl;
+    out << "run: " << runSeconds * 1000 << " ms total, " << (runSeconds - nativeSeconds) * 1000
+        << " ms interpreter, " << nativeSeconds * 1000 << " ms native" << std::endl;
+    for (size_t id = 0; id < nativeEntries.size(); id++) {
+        if (nativeEntries[id]) {
+            out << "function " << program->functionNames[id] << ": native after " << jitThreshold << " calls"
+                << std::endl;
+        }
+    }
+    for (const LoopTier& loop : loops) {
+        out << "loop " << program->functionNames[static_cast<size_t>(loop.function)] << " pc " << loop.jumpPc
+            << " -> " << program->code[loop.jumpPc].operand << ": ";
+        if (loop.entry) {
+            out << "promoted after " << osrThreshold << " back edges, " << loop.transfers << " OSR entries, "
+                << loop.nativeSeconds * 1000 << " ms native" << std::endl;
+        } else {
+            out << (loop.rejected ? "not compilable, interpreted" : "interpreted") << std::endl;
+        }
+    }
+    out << std::defaultfloat;
+}
+
+// Runs one call of function `id` on the interpreter from inside compiled
+// code: the frame returns to code.size(), which ends the nested run.
+// `arguments` is laid out as compiled code pushed them, last one first.
+int64_t VM::interpretFunction(int32_t id, const int64_t* arguments) {
+    const FunctionInfo& callee = program->verified.functions[static_cast<size_t>(id)];
+    size_t resumePc = pc;
+    for (uint32_t i = callee.paramCount; i-- > 0;) {
+        stack.push_back(arguments[i]);
+    }
+    pushFrame(program->code.size(), callee);
+    pc = callee.entry;
+#ifdef MINEC_THREADED_DISPATCH
+    runThreaded();
+#else
+    runSwitch();
+#endif
+    pc = resumePc;
+    int64_t result = stack.back();
+    stack.pop_back();
+    return result;
+}
+
+int64_t VM::jitCall(JitRuntime* runtime, int64_t id, const int64_t* arguments) {
+    VM* vm = static_cast<VM*>(runtime->vm);
+    if (JitFunction native = vm->hotFunction(static_cast<int32_t>(id))) {
+        return native(runtime, arguments);
+    }
+    return vm->interpretFunction(static_cast<int32_t>(id), arguments);
+}
+
+int64_t VM::jitInterpret(JitRuntime* runtime, int64_t id, const int64_t* arguments) {
+    return static_cast<VM*>(runtime->vm)->interpretFunction(static_cast<int32_t>(id), arguments);
+}
+
+void VM::jitPrint(JitRuntime* runtime, int64_t value) {
+    static_cast<VM*>(runtime->vm)->output.printLine(value);
+}
+
+void VM::jitExecAsm(JitRuntime* runtime, int64_t block) {
+    VM* vm = static_cast<VM*>(runtime->vm);
+    vm->executeASM(vm->program->asmBlocks[static_cast<size_t>(block)]);
+}
+
+void VM::executeASM(const AsmBlock& block) {
+    executeAsmBlock(block, cpu, stack);
+}
+
 void VM::executeInstruction() {
-    if (pc >= code.size()) {
+    if (pc >= program->code.size()) {
         running = false;
         return;
     }
 
-    Instruction inst = code[pc++];
+    const Instruction& inst = program->code[pc++];
+    executed++;
 
     switch (inst.op) {
         case OpCode::PUSH:
@@ -153,22 +425,13 @@ void VM::executeInstruction() {
         }
         case OpCode::STORE_LOCAL: {
             if (stack.empty()) throw std::runtime_error("Stack underflow on STORE_LOCAL");
-            if (callStack.empty()) throw std::runtime_error("STORE_LOCAL without call frame");
-            auto& locals = callStack.back().locals;
-            size_t index = static_cast<size_t>(inst.operand);
-            if (locals.size() <= index) locals.resize(index + 1, 0);
-            locals[index] = stack.back();
+            localSlot(static_cast<size_t>(inst.operand), "STORE_LOCAL") = stack.back();
             stack.pop_back();
             break;
         }
-        case OpCode::LOAD_LOCAL: {
-            if (callStack.empty()) throw std::runtime_error("LOAD_LOCAL without call frame");
-            auto& locals = callStack.back().locals;
-            size_t index = static_cast<size_t>(inst.operand);
-            if (locals.size() <= index) locals.resize(index + 1, 0);
-            stack.push_back(locals[index]);
+        case OpCode::LOAD_LOCAL:
+            stack.push_back(localSlot(static_cast<size_t>(inst.operand), "LOAD_LOCAL"));
             break;
-        }
         case OpCode::CMP_EQ:
         case OpCode::CMP_NEQ:
         case OpCode::CMP_LT:
@@ -178,22 +441,15 @@ void VM::executeInstruction() {
             if (stack.size() < 2) throw std::runtime_error("Stack underflow on comparison");
             int64_t b = stack.back(); stack.pop_back();
             int64_t a = stack.back(); stack.pop_back();
-            int64_t result = 0;
-            switch (inst.op) {
-                case OpCode::CMP_EQ: result = (a == b); break;
-                case OpCode::CMP_NEQ: result = (a != b); break;
-                case OpCode::CMP_LT: result = (a < b); break;
-                case OpCode::CMP_GT: result = (a > b); break;
-                case OpCode::CMP_LEQ: result = (a <= b); break;
-                case OpCode::CMP_GEQ: result = (a >= b); break;
-                default: break;
-            }
-            stack.push_back(result);
+            stack.push_back(compareValues(inst.op, a, b));
             break;
         }
-        case OpCode::JMP:
+        case OpCode::JMP: {
+            int32_t loop = program->loopAt[pc - 1];
+            if (loop >= 0 && --loops[static_cast<size_t>(loop)].countdown == 0 && enterOsr(loop)) break;
             pc = static_cast<size_t>(inst.operand);
             break;
+        }
         case OpCode::JMP_IF_FALSE: {
             if (stack.empty()) throw std::runtime_error("Stack underflow on JMP_IF_FALSE");
             int64_t value = stack.back();
@@ -204,10 +460,19 @@ void VM::executeInstruction() {
             break;
         }
         case OpCode::CALL: {
-            CallFrame frame;
-            frame.returnAddress = pc;
-            callStack.push_back(frame);
-            pc = static_cast<size_t>(inst.operand);
+            size_t target = branchTarget(inst);
+            int32_t callee = program->verified.functionAt[target];
+            const FunctionInfo& function = program->verified.functions[static_cast<size_t>(callee)];
+            if (JitFunction native = hotFunction(callee)) {
+                if (nativeStackRoom()) {
+                    if (stack.size() < function.paramCount) throw std::runtime_error("Stack underflow on CALL");
+                    int64_t result = runNative(native, function.paramCount);
+                    stack.push_back(result);
+                    break;
+                }
+            }
+            pushFrame(pc, function);
+            pc = target;
             break;
         }
         case OpCode::RET: {
@@ -217,40 +482,840 @@ void VM::executeInstruction() {
             pc = returnAddress;
             break;
         }
+        case OpCode::TAIL_CALL: {
+            size_t target = branchTarget(inst);
+            int32_t callee = program->verified.functionAt[target];
+            const FunctionInfo& function = program->verified.functions[static_cast<size_t>(callee)];
+            // A compiled callee runs on the native stack; its result is
+            // then returned from this frame.
+            if (JitFunction native = hotFunction(callee)) {
+                if (nativeStackRoom()) {
+                    if (callStack.empty()) throw std::runtime_error("TAIL_CALL without call frame");
+                    if (stack.size() < function.paramCount) throw std::runtime_error("Stack underflow on TAIL_CALL");
+                    stack.push_back(runNative(native, function.paramCount));
+                    pc = callStack.back().returnAddress;
+                    callStack.pop_back();
+                    break;
+                }
+            }
+            replaceFrame(function);
+            pc = target;
+            break;
+        }
         case OpCode::PRINT:
             if (stack.empty()) throw std::runtime_error("Stack underflow on PRINT");
-            std::cout << stack.back() << std::endl;
+            output.printLine(stack.back());
             stack.pop_back();
             break;
         case OpCode::EXEC_ASM:
-            executeASM(inst.text);
+            executeASM(program->asmBlocks[static_cast<size_t>(inst.operand)]);
             break;
         case OpCode::HALT:
             running = false;
+            output.halt();
+            break;
+        case OpCode::SNAPSHOT:
+            if (pauseAtSnapshot) {
+                running = false;
+                paused = true;
+            }
+            break;
+        case OpCode::BREAK:
+            pc--;
+            executed--;
+            running = false;
+            stop = Stop::Breakpoint;
+            break;
+        case OpCode::NEG:
+            if (stack.empty()) throw std::runtime_error("Stack underflow on NEG");
+            stack.back() = -stack.back();
+            break;
+        case OpCode::ADD_IMM:
+            if (stack.empty()) throw std::runtime_error("Stack underflow on ADD_IMM");
+            stack.back() += inst.operand;
             break;
+        case OpCode::SUB_IMM:
+            if (stack.empty()) throw std::runtime_error("Stack underflow on SUB_IMM");
+            stack.back() -= inst.operand;
+            break;
+        case OpCode::SHL_IMM:
+            if (stack.empty()) throw std::runtime_error("Stack underflow on SHL_IMM");
+            stack.back() = shiftLeft(stack.back(), static_cast<int>(inst.operand));
+            break;
+        case OpCode::DIV_POW2:
+            if (stack.empty()) throw std::runtime_error("Stack underflow on DIV_POW2");
+            stack.back() = divideByPowerOfTwo(stack.back(), static_cast<int>(inst.operand));
+            break;
+        case OpCode::DIV_MAGIC:
+            // Deriving the multiplier costs more than the divide it saves;
+            // the threaded loop derives it once per program.
+            if (stack.empty()) throw std::runtime_error("Stack underflow on DIV_MAGIC");
+            stack.back() /= inst.operand;
+            break;
+        case OpCode::ADD_LOCALS: {
+            int64_t a = localSlot(packedLow(inst.operand), "ADD_LOCALS");
+            int64_t b = localSlot(static_cast<size_t>(packedHigh(inst.operand)), "ADD_LOCALS");
+            stack.push_back(a + b);
+            break;
+        }
+        case OpCode::ADD_LOCAL_IMM:
+            stack.push_back(localSlot(packedLow(inst.operand), "ADD_LOCAL_IMM") + packedHigh(inst.operand));
+            break;
+        case OpCode::STORE_KEEP_LOCAL:
+            if (stack.empty()) throw std::runtime_error("Stack underflow on STORE_KEEP_LOCAL");
+            localSlot(static_cast<size_t>(inst.operand), "STORE_KEEP_LOCAL") = stack.back();
+            break;
+        case OpCode::STORE_KEEP_GLOBAL:
+            if (stack.empty()) throw std::runtime_error("Stack underflow on STORE_KEEP_GLOBAL");
+            ensureGlobal(static_cast<size_t>(inst.operand));
+            globals[static_cast<size_t>(inst.operand)] = stack.back();
+            break;
+        case OpCode::JMP_IF_NOT_EQ:
+        case OpCode::JMP_IF_NOT_NEQ:
+        case OpCode::JMP_IF_NOT_LT:
+        case OpCode::JMP_IF_NOT_GT:
+        case OpCode::JMP_IF_NOT_LEQ:
+        case OpCode::JMP_IF_NOT_GEQ: {
+            if (stack.size() < 2) throw std::runtime_error("Stack underflow on conditional jump");
+            int64_t b = stack.back(); stack.pop_back();
+            int64_t a = stack.back(); stack.pop_back();
+            if (!compareValues(inst.op, a, b)) {
+                pc = static_cast<size_t>(inst.operand);
+            }
+            break;
+        }
         default:
             break;
     }
 }
 
 void VM::step() {
-    if (pc < code.size()) {
-        executeInstruction();
+    if (pc < program->code.size()) {
+        stop = Stop::None;
+        if (breakpoints.count(pc)) {
+            stepOverBreakpoint();
+        } else {
+            executeStep();
+        }
         printState();
     }
 }
 
 void VM::run() {
+    // A run cut short by the instruction limit has not reached the BREAK at
+    // pc yet; any other stop there is the user resuming from it.
+    bool resuming = stop != Stop::Limit;
     running = true;
+    stop = Stop::None;
+    jitRuntime.stackLimit = nativeStackLimit();
+    if (resuming && breakpoints.count(pc)) {
+        stepOverBreakpoint();
+        if (!running) return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+#ifdef MINEC_THREADED_DISPATCH
+    if (instructionLimit == kNoLimit) {
+        runThreaded();
+    } else {
+        runSwitch();
+    }
+#else
+    runSwitch();
+#endif
+    if (tierStats) {
+        runSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+bool VM::runToSnapshot() {
+    pauseAtSnapshot = true;
+    paused = false;
+    resetJit();
+    run();
+    pauseAtSnapshot = false;
+    resetJit();
+    output.halt();
+    return paused;
+}
+
+VMSnapshot VM::takeSnapshot() const {
+    VMSnapshot snapshot;
+    snapshot.fingerprint = program->fingerprint;
+    snapshot.pc = pc;
+    snapshot.stack = stack;
+    snapshot.globals = globals;
+    size_t used = callStack.empty() ? 0 : callStack.back().base + callStack.back().size;
+    snapshot.locals.assign(locals.begin(), locals.begin() + static_cast<std::ptrdiff_t>(used));
+    for (const CallFrame& frame : callStack) {
+        snapshot.callStack.push_back({frame.returnAddress, frame.base, frame.size});
+    }
+    snapshot.cpu = cpu;
+    snapshot.executed = executed;
+    return snapshot;
+}
+
+// The fast path trusts the verifier, so a snapshot (possibly read from a
+// file) must describe a state the program can be in: every frame belongs to
+// the function owning its pc and returns right after a CALL to it, or to a
+// function returning as many values that a TAIL_CALL replaced it with, and
+// the operand stack holds exactly what those pcs expect (less, at each
+// CALL, the arguments it moved into the callee's frame).
+// `breakpoints` holds the opcodes under any BREAK patched into `program`.
+static bool consistentSnapshot(const LoadedProgram& program, const std::map<size_t, OpCode>& breakpoints,
+                               const VMSnapshot& snapshot) {
+    const VerifiedProgram& verified = program.verified;
+    if (snapshot.pc >= program.code.size() || snapshot.globals.size() != verified.globalCount) return false;
+
+    uint64_t base = 0;
+    for (const VMSnapshot::Frame& frame : snapshot.callStack) {
+        if (frame.base != base) return false;
+        base += frame.size;
+    }
+    if (base != snapshot.locals.size()) return false;
+
+    size_t pc = snapshot.pc;
+    uint64_t height = 0;
+    uint32_t arguments = 0;
+    for (size_t i = snapshot.callStack.size(); i-- > 0;) {
+        const VMSnapshot::Frame& frame = snapshot.callStack[i];
+        int32_t owner = verified.owner[pc];
+        if (owner <= 0 || frame.size != verified.functions[static_cast<size_t>(owner)].localCount) return false;
+        if (frame.returnAddress == 0 || frame.returnAddress > program.code.size()) return false;
+        Instruction call = program.code[frame.returnAddress - 1];
+        auto patched = breakpoints.find(frame.returnAddress - 1);
+        if (patched != breakpoints.end()) call.op = patched->second;
+        if (call.op != OpCode::CALL) return false;
+        const FunctionInfo& called = verified.functions[static_cast<size_t>(verified.functionAt[branchTarget(call)])];
+        if (called.returnHeight != verified.functions[static_cast<size_t>(owner)].returnHeight) return false;
+        height += static_cast<uint64_t>(verified.stackHeight[pc]) - arguments;
+        arguments = static_cast<uint32_t>(packedHigh(call.operand));
+        pc = frame.returnAddress - 1;
+    }
+    if (verified.owner[pc] != 0) return false;
+    height += static_cast<uint64_t>(verified.stackHeight[pc]) - arguments;
+    return height == snapshot.stack.size();
+}
+
+void VM::restore(const VMSnapshot& snapshot) {
+    if (snapshot.fingerprint != program->fingerprint) {
+        throw std::runtime_error("Snapshot was taken from a different program");
+    }
+    if (!consistentSnapshot(*program, breakpoints, snapshot)) {
+        throw std::runtime_error("Snapshot does not match the program's state at pc " + std::to_string(snapshot.pc));
+    }
+    pc = snapshot.pc;
+    stack = snapshot.stack;
+    globals = snapshot.globals;
+    locals.assign(std::max(kInitialLocalsSlab, snapshot.locals.size()), 0);
+    std::copy(snapshot.locals.begin(), snapshot.locals.end(), locals.begin());
+    callStack.clear();
+    for (const VMSnapshot::Frame& frame : snapshot.callStack) {
+        callStack.push_back({frame.returnAddress, frame.base, frame.size});
+    }
+    cpu = snapshot.cpu;
+    executed = snapshot.executed;
+    jitRuntime.globals = globals.data();
+    running = false;
+    stop = Stop::None;
+}
+
+void VM::runSwitch() {
+    size_t end = program->code.size();
+    if (!watches.empty()) {
+        while (running && pc < end && executed < instructionLimit) {
+            executeWatched();
+        }
+    } else {
+        while (running && pc < end && executed < instructionLimit) {
+            executeInstruction();
+        }
+    }
+    if (running && pc < end) {
+        running = false;
+        stop = Stop::Limit;
+    }
+}
+
+void VM::advance(uint64_t count) {
+    uint64_t target = executed + count;
+    size_t end = program->code.size();
+    running = true;
+    while (executed < target && pc < end) {
+        if (program->code[pc].op == OpCode::BREAK) {
+            stepOverBreakpoint();
+        } else {
+            executeInstruction();
+        }
+    }
+    running = false;
+    stop = Stop::None;
+}
+
+void VM::executeStep() {
+    if (watches.empty()) {
+        executeInstruction();
+    } else {
+        executeWatched();
+    }
+}
+
+// executeInstruction plus, for stores, a check of the watched variables.
+void VM::executeWatched() {
+    const Instruction& inst = program->code[pc];
+    bool global = inst.op == OpCode::STORE_GLOBAL || inst.op == OpCode::STORE_KEEP_GLOBAL;
+    if (!global && inst.op != OpCode::STORE_LOCAL && inst.op != OpCode::STORE_KEEP_LOCAL) {
+        executeInstruction();
+        return;
+    }
+    size_t at = pc;
+    size_t slot = static_cast<size_t>(inst.operand);
+    if (global) ensureGlobal(slot);
+    int64_t before = global ? globals[slot] : localSlot(slot, opcodeName(inst.op));
+    executeInstruction();
+    int64_t after = global ? globals[slot] : localSlot(slot, opcodeName(inst.op));
+    if (after != before) watchFired(global, slot, at, before, after);
+}
+
+bool VM::watchFired(bool global, size_t slot, size_t at, int64_t before, int64_t after) {
+    int32_t function = global ? -1 : program->verified.owner[at];
+    for (const Watch& watch : watches) {
+        if (watch.function == function && watch.slot == slot) {
+            lastWatch = {watch, at, before, after};
+            stop = Stop::Watch;
+            running = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs the instruction under the breakpoint at pc, which run() and step()
+// would otherwise stop at again.
+void VM::stepOverBreakpoint() {
+    Instruction& inst = patchedProgram->code[pc];
+    inst.op = breakpoints.at(pc);
+    try {
+        executeStep();
+    } catch (...) {
+        inst.op = OpCode::BREAK;
+        throw;
+    }
+    inst.op = OpCode::BREAK;
+}
+
+void VM::setBreakpoint(size_t at) {
+    if (at >= program->code.size()) throw std::runtime_error("No instruction at pc " + std::to_string(at));
+    if (breakpoints.count(at)) return;
+    if (!patchedProgram) {
+        patchedProgram = std::make_shared<LoadedProgram>(*program);
+        program = patchedProgram;
+    }
+    breakpoints[at] = patchedProgram->code[at].op;
+    patchedProgram->code[at].op = OpCode::BREAK;
+    threadedCode.clear();
+}
+
+OpCode VM::originalOp(size_t at) const {
+    auto breakpoint = breakpoints.find(at);
+    return breakpoint != breakpoints.end() ? breakpoint->second : program->code[at].op;
+}
+
+void VM::clearBreakpoint(size_t at) {
+    auto breakpoint = breakpoints.find(at);
+    if (breakpoint == breakpoints.end()) return;
+    patchedProgram->code[at].op = breakpoint->second;
+    breakpoints.erase(breakpoint);
+    threadedCode.clear();
+}
+
+void VM::addWatch(const Watch& watch) {
+    watches.push_back(watch);
+    threadedCode.clear();
+}
+
+void VM::clearWatches() {
+    watches.clear();
+    threadedCode.clear();
+}
+
+bool VM::readVariable(const Watch& variable, int64_t& value) const {
+    if (variable.function < 0) {
+        value = variable.slot < globals.size() ? globals[variable.slot] : 0;
+        return true;
+    }
+    // Frame i runs the function owning the pc it will return to from frame
+    // i + 1, the innermost one the function owning pc.
+    size_t at = pc;
+    for (size_t i = callStack.size(); i-- > 0;) {
+        if (at < program->code.size() && program->verified.owner[at] == variable.function) {
+            if (variable.slot >= callStack[i].size) return false;
+            value = locals[callStack[i].base + variable.slot];
+            return true;
+        }
+        at = callStack[i].returnAddress - 1;
+    }
+    return false;
+}
+
+void VM::runCountingPairs(OpcodePairCounts& counts) {
+    running = true;
+    const std::vector<Instruction>& code = program->code;
+    size_t previous = code.size();
     while (running && pc < code.size()) {
+        size_t current = pc;
+        if (current == previous + 1) {
+            counts[static_cast<size_t>(code[previous].op)][static_cast<size_t>(code[current].op)]++;
+        }
         executeInstruction();
-        if (stepMode) {
-            printState();
-            std::cout << "Press ENTER to continue...";
-            std::cin.get();
+        previous = current;
+    }
+}
+
+void VM::runProfiled(Profile& profile) {
+    const std::vector<Instruction>& code = program->code;
+    const VerifiedProgram& verified = program->verified;
+    profile.hits.assign(code.size(), 0);
+    profile.nanos.assign(code.size(), 0);
+    profile.calls.assign(verified.functions.size(), 0);
+    profile.inclusive.assign(verified.functions.size(), 0);
+
+    // Shadow call stack: the function and instruction count at each entry,
+    // and how many activations of each function are open.
+    struct Activation {
+        int32_t function;
+        uint64_t start;
+    };
+    std::vector<Activation> activations{{0, 0}};
+    std::vector<uint32_t> open(verified.functions.size(), 0);
+    open[0] = 1;
+    profile.calls[0] = 1;
+    auto leave = [&](const Activation& activation, uint64_t now) {
+        if (--open[static_cast<size_t>(activation.function)] == 0) {
+            profile.inclusive[static_cast<size_t>(activation.function)] += now - activation.start;
+        }
+    };
+
+    // Every instruction pays for one clock read; take its cheapest observed
+    // cost off each sample.
+    int64_t clockCost = std::numeric_limits<int64_t>::max();
+    for (int i = 0; i < 1000; i++) {
+        auto a = std::chrono::steady_clock::now();
+        auto b = std::chrono::steady_clock::now();
+        clockCost = std::min<int64_t>(clockCost, std::chrono::nanoseconds(b - a).count());
+    }
+
+    running = true;
+    uint64_t count = 0;
+    auto last = std::chrono::steady_clock::now();
+    while (running && pc < code.size()) {
+        size_t current = pc;
+        size_t depth = callStack.size();
+        executeInstruction();
+        auto now = std::chrono::steady_clock::now();
+        int64_t elapsed = std::chrono::nanoseconds(now - last).count() - clockCost;
+        profile.hits[current]++;
+        profile.nanos[current] += static_cast<uint64_t>(std::max<int64_t>(elapsed, 0));
+        last = now;
+        count++;
+
+        // A TAIL_CALL that kept the depth ended one activation and
+        // started another in the same frame.
+        bool tailCall = code[current].op == OpCode::TAIL_CALL && callStack.size() == depth;
+        if (callStack.size() < depth || tailCall) {
+            leave(activations.back(), count);
+            activations.pop_back();
+        }
+        if (callStack.size() > depth || tailCall) {
+            int32_t callee = verified.functionAt[pc];
+            profile.calls[static_cast<size_t>(callee)]++;
+            open[static_cast<size_t>(callee)]++;
+            activations.push_back({callee, count});
+        }
+    }
+    while (!activations.empty()) {
+        leave(activations.back(), count);
+        activations.pop_back();
+    }
+}
+
+void VM::runCountingPerf(const PerfCounters& counters, std::vector<PerfSample>& perFunction) {
+    const std::vector<Instruction>& code = program->code;
+    perFunction.assign(program->verified.functions.size(), PerfSample());
+    std::vector<int32_t> active{0};
+    running = true;
+    PerfSample last = counters.read();
+    while (running && pc < code.size()) {
+        size_t depth = callStack.size();
+        bool tailCall = code[pc].op == OpCode::TAIL_CALL;
+        executeInstruction();
+        tailCall = tailCall && callStack.size() == depth;
+        if (callStack.size() == depth && !tailCall) continue;
+        PerfSample now = counters.read();
+        perFunction[static_cast<size_t>(active.back())] += now - last;
+        last = now;
+        if (callStack.size() > depth) {
+            active.push_back(program->verified.functionAt[pc]);
+        } else if (tailCall) {
+            active.back() = program->verified.functionAt[pc];
+        } else {
+            active.pop_back();
+        }
+    }
+    perFunction[static_cast<size_t>(active.back())] += counters.read() - last;
+}
+
+void VM::runTraced(TraceBuffer& trace) {
+    const std::vector<Instruction>& code = program->code;
+    running = true;
+    uint64_t sequence = 0;
+    while (running && pc < code.size()) {
+        TraceRecord record;
+        record.sequence = sequence++;
+        record.pc = static_cast<uint32_t>(pc);
+        record.kind = TraceKind::Instruction;
+        record.op = static_cast<uint8_t>(code[pc].op);
+        record.callDepth = static_cast<uint16_t>(std::min<size_t>(callStack.size(), UINT16_MAX));
+        bool asmBlock = code[pc].op == OpCode::EXEC_ASM;
+        CPURegisterFile before;
+        if (asmBlock) before = cpu.regs;
+        executeInstruction();
+        record.value = stack.empty() ? 0 : stack.back();
+        record.aux = static_cast<int64_t>(stack.size());
+        trace.append(record);
+        if (!asmBlock) continue;
+        record.kind = TraceKind::RegisterDelta;
+        for (size_t reg = 0; reg < before.data.size(); reg++) {
+            int64_t now = cpu.regs.data[reg];
+            if (now == before.data[reg]) continue;
+            record.op = static_cast<uint8_t>(reg);
+            record.value = now;
+            record.aux = static_cast<int64_t>(static_cast<uint64_t>(now) - static_cast<uint64_t>(before.data[reg]));
+            trace.append(record);
         }
     }
 }
+
+#ifdef MINEC_THREADED_DISPATCH
+// Direct-threaded engine using GCC labels-as-values. The bytecode is
+// translated once into (handler address, operand) pairs; pc, the operand
+// stack pointer and the current frame live in locals and are written back
+// to the VM only when leaving the loop or calling out (EXEC_ASM).
+//
+// The loop performs no stack, frame or index checks: loadProgram only
+// accepts programs the verifier has proven safe. The operand stack is
+// grown once per CALL to cover the callee's proven maximum depth, and
+// frames are windows of the locals slab sized by the compiler.
+void VM::runThreaded() {
+    static const void* const handlers[] = {
+        &&op_NOP, &&op_PUSH, &&op_POP, &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV,
+        &&op_NEG, &&op_STORE_GLOBAL, &&op_LOAD_GLOBAL, &&op_STORE_LOCAL,
+        &&op_LOAD_LOCAL, &&op_CMP_EQ, &&op_CMP_NEQ, &&op_CMP_LT, &&op_CMP_GT,
+        &&op_CMP_LEQ, &&op_CMP_GEQ, &&op_JMP, &&op_JMP_IF_FALSE, &&op_CALL,
+        &&op_RET, &&op_TAIL_CALL, &&op_PRINT, &&op_EXEC_ASM, &&op_HALT, &&op_SNAPSHOT, &&op_BREAK, &&op_ADD_IMM, &&op_SUB_IMM,
+        &&op_ADD_LOCALS, &&op_ADD_LOCAL_IMM, &&op_STORE_KEEP_LOCAL,
+        &&op_STORE_KEEP_GLOBAL, &&op_JMP_IF_NOT_EQ, &&op_JMP_IF_NOT_NEQ,
+        &&op_JMP_IF_NOT_LT, &&op_JMP_IF_NOT_GT, &&op_JMP_IF_NOT_LEQ,
+        &&op_JMP_IF_NOT_GEQ, &&op_SHL_IMM, &&op_DIV_POW2, &&op_DIV_MAGIC
+    };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == static_cast<size_t>(OpCode::COUNT),
+                  "handler table out of sync with OpCode");
+    const VerifiedProgram& verified = program->verified;
+
+    if (threadedCode.size() != program->code.size() + 1) {
+        threadedCode.clear();
+        threadedCode.reserve(program->code.size() + 1);
+        threadedDivisors.clear();
+        for (const Instruction& inst : program->code) {
+            int64_t operand = inst.operand;
+            if (isCall(inst.op)) {
+                operand = packOperands(packedLow(operand), verified.functionAt[branchTarget(inst)]);
+            }
+            if (inst.op == OpCode::DIV_MAGIC) {
+                operand = static_cast<int64_t>(threadedDivisors.size());
+                threadedDivisors.push_back(magicDivisor(inst.operand));
+            }
+            // A BREAK patched over a back edge must stay a BREAK.
+            if (inst.op == OpCode::JMP && program->loopAt[threadedCode.size()] >= 0) {
+                threadedCode.push_back({&&op_LOOP, packOperands(static_cast<uint32_t>(operand),
+                                                                program->loopAt[threadedCode.size()])});
+                continue;
+            }
+            if (!watches.empty() && (inst.op == OpCode::STORE_GLOBAL || inst.op == OpCode::STORE_KEEP_GLOBAL ||
+                                     inst.op == OpCode::STORE_LOCAL || inst.op == OpCode::STORE_KEEP_LOCAL)) {
+                threadedCode.push_back({&&op_WATCHED_STORE, operand});
+                continue;
+            }
+            threadedCode.push_back({handlers[static_cast<size_t>(inst.op)], operand});
+        }
+        threadedCode.push_back({&&op_END, 0});
+    }
+
+    const ThreadedOp* base = threadedCode.data();
+    const ThreadedOp* ip = base + pc;
+    size_t sp = stack.size();
+    stack.resize(sp + verified.maxStack);
+    int64_t* sb = stack.data();
+    int64_t* gp = globals.data();
+    const MagicDivisor* divisors = threadedDivisors.data();
+    int64_t* fp = callStack.empty() ? nullptr : locals.data() + callStack.back().base;
+    size_t frameTop = callStack.empty() ? 0 : callStack.back().base + callStack.back().size;
+    uint64_t count = 0;
+
+#define NEXT() do { ++ip; ++count; goto *ip->handler; } while (0)
+#define JUMP(target) do { ip = base + (target); ++count; goto *ip->handler; } while (0)
+#define SYNC() do { \
+        stack.resize(sp); \
+        pc = static_cast<size_t>(ip - base) + 1; \
+        executed += count; \
+        count = 0; \
+    } while (0)
+#define BINARY(expr) do { \
+        int64_t b = sb[--sp]; \
+        int64_t a = sb[sp - 1]; \
+        sb[sp - 1] = (expr); \
+        NEXT(); \
+    } while (0)
+#define BRANCH_UNLESS(cond) do { \
+        int64_t b = sb[--sp]; \
+        int64_t a = sb[--sp]; \
+        if (!(cond)) JUMP(ip->operand); \
+        NEXT(); \
+    } while (0)
+
+    ++count;
+    goto *ip->handler;
+
+op_NOP:
+    NEXT();
+op_NEG:
+    sb[sp - 1] = -sb[sp - 1];
+    NEXT();
+op_PUSH:
+    sb[sp++] = ip->operand;
+    NEXT();
+op_POP:
+    sp--;
+    NEXT();
+op_ADD:
+    BINARY(a + b);
+op_SUB:
+    BINARY(a - b);
+op_MUL:
+    BINARY(a * b);
+op_DIV:
+    BINARY(a / b);
+op_CMP_EQ:
+    BINARY(a == b);
+op_CMP_NEQ:
+    BINARY(a != b);
+op_CMP_LT:
+    BINARY(a < b);
+op_CMP_GT:
+    BINARY(a > b);
+op_CMP_LEQ:
+    BINARY(a <= b);
+op_CMP_GEQ:
+    BINARY(a >= b);
+op_STORE_GLOBAL:
+    gp[ip->operand] = sb[--sp];
+    NEXT();
+op_LOAD_GLOBAL:
+    sb[sp++] = gp[ip->operand];
+    NEXT();
+op_STORE_LOCAL:
+    fp[ip->operand] = sb[--sp];
+    NEXT();
+op_LOAD_LOCAL:
+    sb[sp++] = fp[ip->operand];
+    NEXT();
+op_JMP:
+    JUMP(ip->operand);
+op_LOOP:
+    if (--loops[static_cast<size_t>(packedHigh(ip->operand))].countdown == 0) {
+        SYNC();
+        bool entered = enterOsr(packedHigh(ip->operand));
+        sp = stack.size();
+        stack.resize(sp + verified.maxStack);
+        sb = stack.data();
+        fp = callStack.empty() ? nullptr : locals.data() + callStack.back().base;
+        frameTop = callStack.empty() ? 0 : callStack.back().base + callStack.back().size;
+        if (entered) JUMP(pc);
+    }
+    JUMP(packedLow(ip->operand));
+op_JMP_IF_FALSE:
+    if (!sb[--sp]) JUMP(ip->operand);
+    NEXT();
+op_CALL: {
+    int32_t calleeId = packedHigh(ip->operand);
+    if (JitFunction native = hotFunction(calleeId)) {
+        if (nativeStackRoom()) {
+            SYNC();
+            int64_t result = runNative(native, verified.functions[static_cast<size_t>(calleeId)].paramCount);
+            sp = stack.size();
+            stack.resize(sp + verified.maxStack);
+            sb = stack.data();
+            fp = callStack.empty() ? nullptr : locals.data() + callStack.back().base;
+            sb[sp++] = result;
+            NEXT();
+        }
+    }
+    const FunctionInfo& callee = verified.functions[static_cast<size_t>(calleeId)];
+    if (sp + callee.maxStack > stack.size()) {
+        stack.resize((sp + callee.maxStack) * 2);
+        sb = stack.data();
+    }
+    size_t frameBase = frameTop;
+    frameTop += callee.localCount;
+    if (frameTop > locals.size()) {
+        locals.resize(frameTop * 2, 0);
+    }
+    fp = locals.data() + frameBase;
+    sp -= callee.paramCount;
+    for (uint32_t i = 0; i < callee.paramCount; i++) fp[i] = sb[sp + i];
+    for (uint32_t i = callee.paramCount; i < callee.localCount; i++) fp[i] = 0;
+    callStack.push_back({static_cast<size_t>(ip - base) + 1, frameBase, callee.localCount});
+    JUMP(packedLow(ip->operand));
+}
+op_RET: {
+    size_t returnAddress = callStack.back().returnAddress;
+    frameTop = callStack.back().base;
+    callStack.pop_back();
+    fp = callStack.empty() ? nullptr : locals.data() + callStack.back().base;
+    JUMP(returnAddress);
+}
+op_TAIL_CALL: {
+    int32_t calleeId = packedHigh(ip->operand);
+    if (JitFunction native = hotFunction(calleeId)) {
+        if (nativeStackRoom()) {
+            SYNC();
+            int64_t result = runNative(native, verified.functions[static_cast<size_t>(calleeId)].paramCount);
+            sp = stack.size();
+            stack.resize(sp + verified.maxStack);
+            sb = stack.data();
+            fp = locals.data() + callStack.back().base;
+            sb[sp++] = result;
+            goto op_RET;
+        }
+    }
+    // The frame's operand stack holds only the arguments, so the callee's
+    // frame takes its place at the same base.
+    const FunctionInfo& callee = verified.functions[static_cast<size_t>(calleeId)];
+    if (sp + callee.maxStack > stack.size()) {
+        stack.resize((sp + callee.maxStack) * 2);
+        sb = stack.data();
+    }
+    size_t frameBase = callStack.back().base;
+    frameTop = frameBase + callee.localCount;
+    if (frameTop > locals.size()) {
+        locals.resize(frameTop * 2, 0);
+    }
+    fp = locals.data() + frameBase;
+    sp -= callee.paramCount;
+    for (uint32_t i = 0; i < callee.paramCount; i++) fp[i] = sb[sp + i];
+    for (uint32_t i = callee.paramCount; i < callee.localCount; i++) fp[i] = 0;
+    callStack.back().size = callee.localCount;
+    JUMP(packedLow(ip->operand));
+}
+op_PRINT:
+    output.printLine(sb[--sp]);
+    NEXT();
+op_EXEC_ASM:
+    SYNC();
+    executeASM(program->asmBlocks[static_cast<size_t>(ip->operand)]);
+    sp = stack.size();
+    stack.resize(sp + verified.maxStack);
+    sb = stack.data();
+    NEXT();
+op_HALT:
+    running = false;
+    SYNC();
+    output.halt();
+    return;
+op_SNAPSHOT:
+    if (pauseAtSnapshot) {
+        running = false;
+        paused = true;
+        SYNC();
+        return;
+    }
+    NEXT();
+op_BREAK:
+    count--;
+    running = false;
+    stop = Stop::Breakpoint;
+    SYNC();
+    pc--;
+    return;
+op_WATCHED_STORE: {
+    OpCode op = program->code[static_cast<size_t>(ip - base)].op;
+    bool global = op == OpCode::STORE_GLOBAL || op == OpCode::STORE_KEEP_GLOBAL;
+    int64_t* slot = (global ? gp : fp) + ip->operand;
+    int64_t before = *slot;
+    *slot = op == OpCode::STORE_GLOBAL || op == OpCode::STORE_LOCAL ? sb[--sp] : sb[sp - 1];
+    if (*slot != before &&
+        watchFired(global, static_cast<size_t>(ip->operand), static_cast<size_t>(ip - base), before, *slot)) {
+        SYNC();
+        return;
+    }
+    NEXT();
+}
+op_ADD_IMM:
+    sb[sp - 1] += ip->operand;
+    NEXT();
+op_SUB_IMM:
+    sb[sp - 1] -= ip->operand;
+    NEXT();
+op_ADD_LOCALS:
+    sb[sp++] = fp[packedLow(ip->operand)] + fp[packedHigh(ip->operand)];
+    NEXT();
+op_ADD_LOCAL_IMM:
+    sb[sp++] = fp[packedLow(ip->operand)] + packedHigh(ip->operand);
+    NEXT();
+op_STORE_KEEP_LOCAL:
+    fp[ip->operand] = sb[sp - 1];
+    NEXT();
+op_STORE_KEEP_GLOBAL:
+    gp[ip->operand] = sb[sp - 1];
+    NEXT();
+op_JMP_IF_NOT_EQ:
+    BRANCH_UNLESS(a == b);
+op_JMP_IF_NOT_NEQ:
+    BRANCH_UNLESS(a != b);
+op_JMP_IF_NOT_LT:
+    BRANCH_UNLESS(a < b);
+op_JMP_IF_NOT_GT:
+    BRANCH_UNLESS(a > b);
+op_JMP_IF_NOT_LEQ:
+    BRANCH_UNLESS(a <= b);
+op_JMP_IF_NOT_GEQ:
+    BRANCH_UNLESS(a >= b);
+op_SHL_IMM:
+    sb[sp - 1] = shiftLeft(sb[sp - 1], static_cast<int>(ip->operand));
+    NEXT();
+op_DIV_POW2:
+    sb[sp - 1] = divideByPowerOfTwo(sb[sp - 1], static_cast<int>(ip->operand));
+    NEXT();
+op_DIV_MAGIC:
+    sb[sp - 1] = divideByMagic(sb[sp - 1], divisors[ip->operand]);
+    NEXT();
+op_END:
+    count--;
+    SYNC();
+    pc = program->code.size();
+    return;
+
+#undef BRANCH_UNLESS
+#undef BINARY
+#undef SYNC
+#undef JUMP
+#undef NEXT
+}
+#else
+void VM::runThreaded() {
+    runSwitch();
+}
+#endif
 
 void VM::printState() {
     std::cout << "\n=== CPU State ===" << std::endl;
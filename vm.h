@@ -1,34 +1,228 @@
 #pragma once
 #include "token.h"
 #include "ast.h"
+#include "asm.h"
+#include "program.h"
+#include "verifier.h"
+#include "jit.h"
+#include "output.h"
+#include "perf.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "strength.h"
+#include "trace.h"
+#include <array>
+#include <cstdint>
+#include <iosfwd>
 #include <vector>
 #include <map>
+#include <memory>
 #include <string>
 
-class VM {
+using OpcodePairCounts = std::array<std::array<uint64_t, static_cast<size_t>(OpCode::COUNT)>,
+                                    static_cast<size_t>(OpCode::COUNT)>;
+
+// A program decoded and verified once and then shared read-only by any
+// number of VMs, on any threads. Everything a VM mutates lives in the VM.
+struct LoadedProgram {
     std::vector<Instruction> code;
+    std::vector<AsmBlock> asmBlocks;
+    VerifiedProgram verified;
+    std::vector<std::string> functionNames;
+    // Variable names for the debugger: per global, and per function and
+    // local slot.
+    std::vector<std::string> globalNames;
+    std::vector<std::vector<std::string>> localNames;
+    // Index of the while loop whose back edge (a backward JMP) is at each
+    // pc, or -1.
+    std::vector<int32_t> loopAt;
+    // Per function: whether it can execute a SNAPSHOT, directly or
+    // through the functions it calls.
+    std::vector<bool> reachesSnapshot;
+    uint64_t fingerprint = 0;
+};
+
+std::shared_ptr<const LoadedProgram> prepareProgram(const Program& program);
+
+class VM {
+    std::shared_ptr<const LoadedProgram> program;
     std::vector<int64_t> stack;
     std::vector<int64_t> globals;
+    // Locals of all active frames live in one slab; each frame is a
+    // bump-allocated window [base, base + size) sized by the compiler.
+    std::vector<int64_t> locals;
     struct CallFrame {
         size_t returnAddress;
-        std::vector<int64_t> locals;
+        size_t base;
+        uint32_t size;
     };
     std::vector<CallFrame> callStack;
+    struct ThreadedOp {
+        const void* handler;
+        int64_t operand;
+    };
+    std::vector<ThreadedOp> threadedCode;
+    // Multiply-high constants of the threaded code's DIV_MAGICs, whose
+    // operands index here.
+    std::vector<MagicDivisor> threadedDivisors;
+    OutputBuffer output;
+    // Per-function JIT state: compiled entry points, and calls left before
+    // a function counts as hot (never reaches zero once disabled/rejected).
+    Jit jit;
+    JitRuntime jitRuntime;
+    std::vector<JitFunction> nativeEntries;
+    std::vector<int64_t> tailArguments;
+    std::vector<uint64_t> jitCountdown;
+    bool jitEnabled;
+    uint32_t jitThreshold;
+    // Every while loop's back edge counts down to on-stack replacement
+    // into a native copy of its function.
+    struct LoopTier {
+        size_t jumpPc;
+        int32_t function;
+        uint64_t countdown;
+        JitOsrEntry entry;
+        bool rejected;
+        uint64_t transfers;
+        double nativeSeconds;
+    };
+    std::vector<LoopTier> loops;
+    uint32_t osrThreshold;
+    bool tierStats;
+    bool perfMap;
+    uint32_t nativeDepth;
+    double nativeSeconds;
+    double runSeconds;
     CPUState cpu;
     size_t pc;
+    uint64_t executed;
     bool running;
-    bool stepMode;
+    bool pauseAtSnapshot;
+    bool paused;
+
+public:
+    // A watched variable: a global (function < 0) or a local slot of every
+    // activation of `function`.
+    struct Watch {
+        int32_t function;
+        uint32_t slot;
+    };
+    struct WatchHit {
+        Watch watch;
+        size_t pc;
+        int64_t before;
+        int64_t after;
+    };
+    // Limit: the count set by setInstructionLimit was reached.
+    enum class Stop { None, Breakpoint, Watch, Limit };
+    static constexpr uint64_t kNoLimit = UINT64_MAX;
+
+private:
+    // Breakpoints patch BREAK into a private copy of the code and remember
+    // the opcodes they cover. While any watch is set the stores dispatch to
+    // instrumented handlers; otherwise nothing is checked.
+    std::shared_ptr<LoadedProgram> patchedProgram;
+    std::map<size_t, OpCode> breakpoints;
+    std::vector<Watch> watches;
+    Stop stop;
+    WatchHit lastWatch;
+    uint64_t instructionLimit;
 
     void ensureGlobal(size_t index);
+    int64_t& localSlot(size_t index, const char* opName);
+    // Opens a frame for `callee`, moving its arguments off the top of the
+    // operand stack into the first slots and zeroing the rest.
+    void pushFrame(size_t returnAddress, const FunctionInfo& callee);
+    // The same for TAIL_CALL, reusing the innermost frame.
+    void replaceFrame(const FunctionInfo& callee);
+    void fillFrame(size_t base, const FunctionInfo& callee);
+    void runSwitch();
+    void executeStep();
+    void executeWatched();
+    void stepOverBreakpoint();
+    bool watchFired(bool global, size_t slot, size_t at, int64_t before, int64_t after);
+    void runThreaded();
+    void resetJit();
+    JitFunction hotFunction(int32_t id);
+    JitFunction compileHot(int32_t id);
+    bool nativeStackRoom() const;
+    // Calls compiled code with the top `argumentCount` operand stack values
+    // as arguments and pops them.
+    int64_t runNative(JitFunction native, uint32_t argumentCount);
+    bool enterOsr(int32_t loop);
+    int64_t interpretFunction(int32_t id, const int64_t* arguments);
+    static int64_t jitCall(JitRuntime* runtime, int64_t id, const int64_t* arguments);
+    static int64_t jitInterpret(JitRuntime* runtime, int64_t id, const int64_t* arguments);
+    static void jitPrint(JitRuntime* runtime, int64_t value);
+    static void jitExecAsm(JitRuntime* runtime, int64_t block);
 
 public:
     VM();
-    void loadProgram(const std::vector<Instruction>& program);
+    void loadProgram(const Program& program);
+    void loadProgram(std::shared_ptr<const LoadedProgram> program);
     void run();
+    // Runs to completion on the switch interpreter, counting how often each
+    // opcode falls through to the next one (input for peephole fusion).
+    void runCountingPairs(OpcodePairCounts& counts);
+    // Runs to completion on the switch interpreter, timing every
+    // instruction and tracking calls. The other run loops carry no
+    // profiling code, so it costs nothing unless asked for.
+    void runProfiled(Profile& profile);
+    // Runs to completion on the switch interpreter, reading `counters` at
+    // every call and return to charge each function for its own code.
+    void runCountingPerf(const PerfCounters& counters, std::vector<PerfSample>& perFunction);
+    // Runs to completion on the switch interpreter, appending a record per
+    // instruction, and per register an EXEC_ASM block changed, to `trace`.
+    void runTraced(TraceBuffer& trace);
     void step();
-    void setStepMode(bool enabled);
+    // Runs on the interpreter alone until a SNAPSHOT instruction pauses the
+    // VM, so that takeSnapshot() can capture it; false if the program ended
+    // first. run() resumes after the pause.
+    bool runToSnapshot();
+    VMSnapshot takeSnapshot() const;
+    // Continues from `snapshot` instead of the start of the loaded program,
+    // which must be the one the snapshot was taken from.
+    void restore(const VMSnapshot& snapshot);
+    // Functions are compiled to native code after `threshold` interpreted
+    // calls, loops are replaced on the stack after `loopThreshold` back
+    // edges. Call before loadProgram or between runs.
+    void setJit(bool enabled, uint32_t threshold = kDefaultJitThreshold,
+                uint32_t loopThreshold = kDefaultOsrThreshold);
+    size_t getJitCompiledCount() const { return jit.compiledCount(); }
+    static constexpr uint32_t kDefaultJitThreshold = 100;
+    static constexpr uint32_t kDefaultOsrThreshold = 1000;
+    // Times the run per tier and records promotions for printTierStats.
+    void setTierStats(bool enabled);
+    // Names compiled code in /tmp/perf-<pid>.map for perf.
+    void setPerfMap(bool enabled);
+    void printTierStats(std::ostream& out) const;
+    // The JIT must be off while breakpoints or watches are set.
+    void setBreakpoint(size_t pc);
+    void clearBreakpoint(size_t pc);
+    bool hasBreakpoint(size_t pc) const { return breakpoints.count(pc) != 0; }
+    // The opcode at pc as compiled, not the BREAK patched over it.
+    OpCode originalOp(size_t pc) const;
+    // run() stops once `limit` instructions have executed in total. Runs
+    // with a limit use the switch interpreter.
+    void setInstructionLimit(uint64_t limit) { instructionLimit = limit; }
+    // Executes `count` more instructions, fewer if the program ends, past
+    // any breakpoints and watches.
+    void advance(uint64_t count);
+    void addWatch(const Watch& watch);
+    void clearWatches();
+    // Why the last run() or step() stopped early, if it did.
+    Stop getStop() const { return stop; }
+    const WatchHit& getWatchHit() const { return lastWatch; }
+    bool finished() const { return pc >= program->code.size(); }
+    size_t getPc() const { return pc; }
+    // A global, or a local of the innermost activation of its function;
+    // false if that function is not on the call stack.
+    bool readVariable(const Watch& variable, int64_t& value) const;
     void printState();
     void executeInstruction();
-    void executeASM(const std::string& asmCode);
+    void executeASM(const AsmBlock& block);
     CPUState& getCPU() { return cpu; }
+    OutputBuffer& getOutput() { return output; }
+    const LoadedProgram& getProgram() const { return *program; }
+    uint64_t getExecutedCount() const { return executed; }
 };
\ No newline at end of file